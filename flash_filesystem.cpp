@@ -29,6 +29,7 @@
 
 #include "flash_filesystem.hpp"
 #include "bloomFilter.hpp"
+#include "fnv.hpp"
 #include "string.hpp"
 
 
@@ -39,6 +40,7 @@
 
 
 #ifdef __TEST__
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -89,7 +91,8 @@ flash_filesystem::StringBuffer<length> to_string(int num)
 
 
 
-flash_filesystem::StringBuffer<12> stringify(flash_filesystem::s32 num)
+flash_filesystem::StringBuffer<12>
+flash_filesystem::stringify(flash_filesystem::s32 num)
 {
     return to_string<12>(num);
 }
@@ -126,11 +129,20 @@ public:
         std::vector<uint8_t> contents((std::istreambuf_iterator<char>(stream)),
                                       std::istreambuf_iterator<char>());
         data_ = contents;
+        erases_.resize(data_.size());
 
         // std::cout << "loaded data, size: " << data_.size() << std::endl;
     }
 
 
+    // Blank save media of the given size.
+    Platform(u32 capacity, const std::string& output) : output_(output)
+    {
+        data_.resize(capacity, 0xff);
+        erases_.resize(capacity);
+    }
+
+
     void erase_save_sector()
     {
         auto cap = save_capacity();
@@ -138,6 +150,35 @@ public:
         for (int i = 0; i < cap; ++i) {
             data_.push_back(0xff);
         }
+        for (auto& e : erases_) {
+            ++e;
+        }
+        ++erase_count_;
+        bytes_erased_ += cap;
+    }
+
+
+    int save_erase_unit()
+    {
+        return erase_unit_;
+    }
+
+
+    void erase_save_range(u32 offset, u32 length)
+    {
+        u32 end = offset + length;
+        offset -= offset % erase_unit_;
+        if (end % erase_unit_) {
+            end += erase_unit_ - end % erase_unit_;
+        }
+
+        for (u32 i = offset; i < end and i < data_.size(); ++i) {
+            data_[i] = 0xff;
+            ++erases_[i];
+        }
+
+        ++erase_count_;
+        bytes_erased_ += end - offset;
     }
 
 
@@ -150,6 +191,12 @@ public:
 
     bool write_save_data(const void* data, u32 data_length, u32 offset)
     {
+        if (writes_until_power_loss_ == 0) {
+            return true;
+        } else if (writes_until_power_loss_ > 0) {
+            --writes_until_power_loss_;
+        }
+
         if (offset % 2 not_eq 0 or data_length % 2 not_eq 0) {
             std::cout << "write size " << data_length << std::endl;
             std::cout << "bad flash write alignment" << std::endl;
@@ -159,15 +206,19 @@ public:
             if (data_[offset + i] not_eq 0xff) {
                 std::cout << "bad flash write to previously-written mem"
                           << std::endl;
+                ++overwrites_;
             }
             data_[offset + i] = ((u8*)data)[i];
         }
+        bytes_written_ += data_length;
         return true;
     }
 
 
     bool read_save_data(void* buffer, u32 data_length, u32 offset)
     {
+        ++reads_;
+        bytes_read_ += data_length;
         for (u32 i = 0; i < data_length; ++i) {
             ((u8*)buffer)[i] = data_[offset + i];
         }
@@ -181,6 +232,27 @@ public:
     }
 
 
+    // Counters, for measuring the cost of filesystem operations.
+    u32 bytes_written_ = 0;
+    u32 bytes_erased_ = 0;
+    u32 erase_count_ = 0;
+
+    // Writes to bytes that weren't blank, which real flash chips don't allow.
+    u32 overwrites_ = 0;
+
+    u32 reads_ = 0;
+    u32 bytes_read_ = 0;
+
+    u32 erase_unit_ = 4096;
+
+    // Erase cycles endured by each byte of the save media.
+    std::vector<u32> erases_;
+
+    // When non-negative, drop all writes after this many, as if someone
+    // switched off the console.
+    int writes_until_power_loss_ = -1;
+
+
 private:
     std::vector<uint8_t> data_;
 };
@@ -217,11 +289,23 @@ namespace flash_filesystem
 
 static BloomFilter<512> file_present_filter;
 
+// Every directory that holds a file, i.e. each prefix of a file's path up to a
+// slash, so that we can tell that a directory is empty without searching.
+static BloomFilter<128> directory_present_filter;
+
 
 
 void __path_cache_insert(const char* path)
 {
-    file_present_filter.insert(path, str_len(path));
+    const u32 length = str_len(path);
+
+    file_present_filter.insert(path, length);
+
+    for (u32 i = 0; i < length; ++i) {
+        if (path[i] == '/') {
+            directory_present_filter.insert(path, i + 1);
+        }
+    }
 }
 
 
@@ -229,6 +313,7 @@ void __path_cache_insert(const char* path)
 void __path_cache_create(Platform& pfrm)
 {
     file_present_filter.clear();
+    directory_present_filter.clear();
 
     walk(pfrm, [&](const char* path) { __path_cache_insert(path); });
 }
@@ -238,6 +323,7 @@ void __path_cache_create(Platform& pfrm)
 void __path_cache_destroy()
 {
     file_present_filter.clear();
+    directory_present_filter.clear();
 }
 
 
@@ -249,6 +335,111 @@ bool __path_cache_file_exists_maybe(const char* file_name)
 
 
 
+// False if no file's path begins with prefix. Only knows about prefixes that
+// end with a slash, and answers true for anything else.
+static bool __path_cache_prefix_exists_maybe(const char* prefix)
+{
+    const u32 length = str_len(prefix);
+    if (length == 0 or prefix[length - 1] not_eq '/') {
+        return true;
+    }
+
+    return directory_present_filter.exists(prefix, length);
+}
+
+
+
+// Read and write counts for the most frequently accessed files. Uses the
+// space-saving algorithm: when the table fills up, the least frequently accessed
+// entry gets replaced, and the new entry inherits its count. So the table may
+// overestimate counts for recently inserted paths, but the hottest paths will
+// always have a slot.
+struct AccessCounter
+{
+    u32 hash_;
+    u16 count_;
+};
+
+
+
+static constexpr const int access_counter_count = FS_ACCESS_COUNTERS;
+
+
+
+using AccessCounters = Buffer<AccessCounter, access_counter_count>;
+
+
+
+static AccessCounters access_counters;
+static AccessCounters write_counters;
+
+
+
+static u32 __access_hash(const char* path)
+{
+    return fnv32(path, str_len(path));
+}
+
+
+
+void __access_count_record(AccessCounters& counters, const char* path)
+{
+    const auto hash = __access_hash(path);
+
+    AccessCounter* min = nullptr;
+
+    for (auto& c : counters) {
+        if (c.hash_ == hash) {
+            if (c.count_ == 0xffff) {
+                // Saturated. Age all of the entries, the relative order of the
+                // counters is all that matters.
+                for (auto& c : counters) {
+                    c.count_ /= 2;
+                }
+            }
+            ++c.count_;
+            return;
+        }
+        if (min == nullptr or c.count_ < min->count_) {
+            min = &c;
+        }
+    }
+
+    if (not counters.full()) {
+        counters.push_back({hash, 1});
+    } else if (min) {
+        min->hash_ = hash;
+        if (min->count_ not_eq 0xffff) {
+            ++min->count_;
+        }
+    }
+}
+
+
+
+u16 __access_count(const AccessCounters& counters, const char* path)
+{
+    const auto hash = __access_hash(path);
+
+    for (auto& c : counters) {
+        if (c.hash_ == hash) {
+            return c.count_;
+        }
+    }
+
+    return 0;
+}
+
+
+
+void __access_count_clear()
+{
+    access_counters.clear();
+    write_counters.clear();
+}
+
+
+
 static const u8 crc8_table[] = {
     0,   49,  98,  83,  196, 245, 166, 151, 185, 136, 219, 234, 125, 76,  31,
     46,  67,  114, 33,  16,  135, 182, 229, 212, 250, 203, 152, 169, 62,  15,
@@ -280,6 +471,60 @@ struct Root
 
 
 
+// Root for the single layout, on save media formatted since we started counting
+// erases. The erase count covers the erase unit holding the root, which every
+// whole-media erase wipes.
+struct CountedRoot
+{
+    static constexpr const char* magic_val = "_FS3_LGC";
+
+    u8 magic_[8];
+    host_u32 erase_count_;
+};
+
+
+
+// Root for the dual layout. Each of the two regions begins with one of these,
+// and the region with the highest generation holds the current log. Compaction
+// copies live records into the other region, and writes its root last, so if we
+// lose power partway through compaction, the old region remains current.
+struct DualRoot
+{
+    static constexpr const char* magic_val = "_FS3_A/B";
+
+    u8 magic_[8];
+    host_u32 generation_;
+
+    // The number of times that the region has been erased.
+    host_u32 erase_count_;
+};
+
+
+
+// Header at the beginning of each segment, for the segmented layout. We write
+// the magic value and the erase count right after erasing a segment, and the
+// sequence number when we open it. The sequence number orders the segments from
+// oldest to newest, and each newly opened segment gets the next one. A free
+// segment has a blank sequence number.
+struct SegmentHeader
+{
+    static constexpr const char* magic_val = "_FS3_SEG";
+
+    u8 magic_[8];
+    host_u32 erase_count_;
+    host_u32 sequence_;
+
+    // See Temperature. Written along with the sequence number.
+    host_u16 temperature_;
+    u8 reserved_[2];
+
+    // Holds ~sequence_, written last, so that we can tell if we lost power
+    // while opening the segment.
+    host_u32 sequence_check_;
+};
+
+
+
 struct Record
 {
     // NOTE: u16 because our flash chip writes in halfwords.
@@ -309,6 +554,56 @@ struct Record
             // Pad the end of the record to bring it's byte count up to an even
             // size, thus aligning the next record at a halfword boundary.
             has_end_padding = (1 << 0),
+
+            // The record holds changes to the file's previous contents, rather
+            // than the contents themselves, see PatchHunk.
+            is_patch = (1 << 1),
+
+            // The record holds data appended to the end of the file, see
+            // append_file().
+            is_extent = (1 << 2),
+
+            // The file is a circular log, see create_circular_log(). Its data
+            // holds a host_u32 capacity, and its contents live in entry
+            // records.
+            is_circular = (1 << 3),
+
+            // The record holds data appended to a circular log.
+            is_entry = (1 << 4),
+
+            // The file is a counter, see add_counter(). Its data holds a
+            // host_u32 base value, and each update slot holds an amount added
+            // to it.
+            is_counter = (1 << 5),
+
+            // The file is a set of flags, see set_flag(). Its data holds a
+            // bitmap, and each update slot holds the number of a flag that we
+            // set after writing the record.
+            is_flag_set = (1 << 6),
+
+            // The file's data holds a host_u16 slot size, followed by slots
+            // for successive versions of the file, see FileSlot.
+            is_slotted = (1 << 7),
+        };
+
+        enum Flags1 {
+            // NOTE: the low bits of flags_[1] hold the number of update slots,
+            // host_u16 values at the end of the record's data that we leave
+            // blank when writing the record, and program one at a time later
+            // on, without writing a new record. The crc doesn't cover them.
+            // For a slotted file, they hold the number of FileSlots instead,
+            // and for a pack, the number of files that it holds.
+            slot_mask = 0x1f,
+
+            // The record holds several small files, see PackEntry.
+            is_pack = (1 << 5),
+
+            // The record's data holds the name of another file with the same
+            // contents, see find_duplicate().
+            is_reference = (1 << 6),
+
+            // The record's data is compressed, see compress().
+            is_compressed = (1 << 7),
         };
 
         u8 flags_[2];
@@ -343,744 +638,8965 @@ struct Record
 
 
 
-static u32 start_offset = 0;
-static u32 end_offset = 0;
-static u32 gap_space = 0;
+// A patch record's data starts with a host_u16 sequence number, which orders
+// the patches for a file, followed by a list of hunks, each one overwriting a
+// range of the file's data. A patch never changes the size of a file, and its
+// hunks keep halfword alignment. The file's original record stays valid until
+// we fold the patches into a new one.
+struct PatchHunk
+{
+    host_u16 offset_;
+    host_u16 length_;
+
+    // NOTE: appended data:
+    //
+    // char data_[length_];
+};
 
 
 
-void destroy(Platform& pfrm)
+// An extent record's data starts with a host_u16 sequence number, like a patch,
+// followed by the bytes appended to the file, and padding, if needed.
+
+
+
+// A slotted file's record holds a fixed number of these, each followed by room
+// for a version of the file, all blank when we write the record. We store the
+// file by programming the next blank slot: the length first, which claims the
+// slot, then the data, and the sequence number last, so that if we lose power
+// partway through, we skip the slot, and read the previous version.
+struct FileSlot
 {
-    pfrm.erase_save_sector();
-}
+    host_u16 length_;
+    host_u16 sequence_;
+
+    // NOTE: appended data:
+    //
+    // char data_[slot size];
+};
 
 
 
-u32 sector_used()
+// A pack record has no name of its own. Its data starts with a host_u16
+// directory size, followed by a PackEntry for each file that it holds, sorted
+// by name, and then the files' data, in the same order. Each entry stores only
+// the part of its name that differs from the previous entry's, as packed files
+// tend to live in the same few directories. The pack's update slots, one per
+// file, mark the files that we've since removed, see unlink_packed().
+struct PackEntry
 {
-    return end_offset - start_offset;
+    u8 length_;
+    u8 shared_;
+    u8 suffix_length_;
+
+    // NOTE: appended data:
+    //
+    // char suffix_[suffix_length_];
+};
+
+
+
+// A circular log's entry records each start with a host_u32 position, the
+// offset of the entry's first byte counting from the first byte ever appended
+// to the log, followed by the entry's bytes, and padding, if needed. As each
+// entry knows where it belongs, compaction can move entries around freely.
+
+
+
+static bool is_patch(const Record& r)
+{
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_patch;
 }
 
 
 
-u32 sector_avail(Platform& pfrm)
+static bool is_extent(const Record& r)
 {
-    return (pfrm.save_capacity() - start_offset) - sector_used();
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_extent;
 }
 
 
 
-Statistics statistics(Platform& pfrm)
+// Whether the record belongs to a chain of records following a file's original
+// record, rather than being a file of its own.
+static bool is_chained(const Record& r)
 {
-    Statistics ret;
-    ret.bytes_used_ = sector_used() - gap_space;
-    ret.bytes_available_ = sector_avail(pfrm) + gap_space;
+    return is_patch(r) or is_extent(r);
+}
 
-    return ret;
+
+
+static bool is_circular(const Record& r)
+{
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_circular;
 }
 
 
 
-Root load_root(Platform& pfrm)
+static bool is_entry(const Record& r)
 {
-    Root root;
-    pfrm.read_save_data(&root, sizeof root, start_offset);
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_entry;
+}
 
-    return root;
+
+
+static bool is_counter(const Record& r)
+{
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_counter;
 }
 
 
 
-Function<8, void(const char*)> log_callback([](const char*) {});
+static bool is_flag_set(const Record& r)
+{
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_flag_set;
+}
 
 
 
-void log(const char* msg)
+static bool is_slotted(const Record& r)
 {
-    log_callback(&*msg);
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::is_slotted;
 }
 
 
 
-void set_log_receiver(Function<8, void(const char*)> callback)
+static u32 slot_count(const Record& r)
 {
-    log_callback = callback;
+    return r.file_info_.flags_[1] & Record::FileInfo::Flags1::slot_mask;
 }
 
 
 
-static void init_root(Platform& pfrm, Root& root)
+static bool is_compressed(const Record& r)
 {
-    memcpy(root.magic_, Root::magic_val, 8);
-    pfrm.write_save_data(&root, sizeof root, start_offset);
+    return r.file_info_.flags_[1] & Record::FileInfo::Flags1::is_compressed;
 }
 
 
 
-static void compact(Platform& pfrm);
+static bool is_reference(const Record& r)
+{
+    return r.file_info_.flags_[1] & Record::FileInfo::Flags1::is_reference;
+}
 
 
 
-InitStatus initialize(Platform& pfrm, u32 offset)
+static bool is_pack(const Record& r)
 {
-    if (offset % 2 not_eq 0) {
-        return failed;
-    }
+    return r.file_info_.flags_[1] & Record::FileInfo::Flags1::is_pack;
+}
 
-    if (pfrm.save_capacity() == 0) {
-        return initialized;
+
+
+// The part of a record's data covered by its crc, i.e. everything but the
+// update slots.
+static u32 checked_length(const Record& r)
+{
+    if (is_slotted(r)) {
+        return sizeof(host_u16);
     }
+    return r.file_info_.data_length_.get() - slot_count(r) * sizeof(host_u16);
+}
 
-    start_offset = offset;
-    auto root = load_root(pfrm);
 
-    if (memcmp(root.magic_, Root::magic_val, 8) not_eq 0) {
-        pfrm.erase_save_sector();
 
-        init_root(pfrm, root);
+static bool is_padded(const Record& r)
+{
+    return r.file_info_.flags_[0] & Record::FileInfo::Flags0::has_end_padding;
+}
 
-        end_offset = start_offset + sizeof root;
 
-        __path_cache_create(pfrm);
 
-        return initialized;
-    }
+static u32 start_offset = 0;
+static u32 end_offset = 0;
+static u32 gap_space = 0;
 
-    log("flash fs found root...");
+// The number of live patch and extent records in the log. Lets us skip looking
+// for them when there aren't any.
+static u32 patch_records = 0;
+static u32 extent_records = 0;
+static u32 entry_records = 0;
+static u32 reference_records = 0;
+static u32 pack_records = 0;
+
+// The space that compression saves among the live records.
+static u32 compressed_savings = 0;
+
+// Offsets of the live slotted files' records, see create_slotted_file(). Kept
+// up to date whenever we move records, so that we never need to search the log
+// for them.
+static Buffer<u32, FS_SLOTTED_FILES> slotted_files;
+
+// The directories that records may refer to by id, see make_directory(). Like
+// slotted_files, kept up to date whenever we move records.
+struct Directory
+{
+    u32 offset_;
+    u32 hash_;
+    u8 id_;
+};
 
-    offset += sizeof(Root);
+static Buffer<Directory, FS_DIRECTORIES> directories;
 
-    bool reformat = false;
+static_assert(FS_DIRECTORIES < 255, "Directory ids must fit in a name byte.");
 
+// The live files, sorted by path, so that lookups and directory listings can
+// binary search for them, rather than reading every name in the log. Each
+// entry holds the offset of a file's record, or for a packed file, the offset
+// of its pack, with the file's index in the pack, plus one, in the top byte.
+// Kept up to date as we write, invalidate and move records. If the index fills
+// up, we fall back to searching the log until we next rebuild the index, see
+// index_records().
+static Buffer<u32, FS_INDEX_SIZE> file_index;
+static bool index_complete = false;
 
-    while (true) {
+static constexpr const u32 index_offset_mask = 0xffffff;
 
-        if (offset % 2 not_eq 0) {
-            log("bad filesystem alignment!");
-        }
+// Counts compactions and cleaned segments, so that code holding on to record
+// offsets across writes, like walk(), can tell when they've gone stale.
+static u32 record_moves = 0;
 
-        Record r;
-        pfrm.read_save_data(&r, sizeof r, offset);
+// Renamed files, see rename_file(). A rename record gives a new name to a file
+// whose record stays where it is, under its old name, which lookups then skip
+// over. Compaction folds the two into a record with the new name.
+struct Rename
+{
+    u32 record_;
+    u32 target_;
+};
 
-        if (r.file_info_.name_length_ == 0xff) {
-            // Uninitialized, as it holds the default flash erase value.
-            // Uninitialzied name length indicates an unwritten record, i.e. the
-            // end of the sector.
-            break;
-        }
+static Buffer<Rename, FS_RENAMED_FILES> renamed_files;
 
-        u8 crc8 = 0;
-        int read_size = r.file_info_.data_length_.get();
 
-        for (int i = 0; i < read_size; ++i) {
-            u8 val;
-            const u32 off = i + offset + (sizeof r) + r.file_info_.name_length_;
-            pfrm.read_save_data(&val, 1, off);
-            crc8 = crc8_table[((u8)val) ^ crc8];
-        }
 
-        if (crc8 not_eq r.file_info_.crc_) {
-            // A record has an invalid crc. We'll try to reformat the filesystem
-            // and maybe it'll be fixed. I don't know how this can even happen
-            // in the first place.
-            // NOTE: The filesystem library should not corrupt memory in this
-            // way. But the filesystem data blob should be considered an
-            // external input to the program and checked for all classes of
-            // errors.
-            info(pfrm,
-                 format(
-                     "bad crc! expected: %, got: %", r.file_info_.crc_, crc8));
-            reformat = true;
-            break;
+// The offset of the record that the rename record at offset renames, or -1.
+static int renamed_target(u32 offset)
+{
+    for (auto& rename : renamed_files) {
+        if (rename.record_ == offset) {
+            return rename.target_;
         }
+    }
+    return -1;
+}
 
-        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid) {
-            gap_space += r.full_size();
-        }
 
-        offset += r.full_size();
-    }
-    end_offset = offset;
 
-    // Now... we want to scan the rest of the unused portion of the flash
-    // filesystem. If any byte is not 0xff, the bit must have been flipped
-    // somehow, by, idk, cosmic radiation or something. A successive write to an
-    // address in some flash controllers will brick the system, so we want to
-    // erase and rewrite the sector in this case.
-    for (int i = end_offset; i < pfrm.save_capacity(); ++i) {
-        u8 val = 0;
-        pfrm.read_save_data(&val, 1, i);
-        if (val not_eq 0xff) {
-            log("trailing bits unexpectedly flipped!");
-            reformat = true;
-            break;
+// The offset of the rename record that renames the record at offset, or -1.
+static int renamed_by(u32 offset)
+{
+    for (auto& rename : renamed_files) {
+        if (rename.target_ == offset) {
+            return rename.record_;
         }
     }
+    return -1;
+}
 
-    if (reformat) {
-        compact(pfrm);
-    }
+// The end of the save memory available to the current log.
+static u32 region_end = 0;
 
-    __path_cache_create(pfrm);
+static u8* scratch_arena = nullptr;
+static u32 scratch_arena_size = 0;
 
-    // log(format("flash fs init, begin, %, end, %, gaps, %",
-    //            start_offset,
-    //            end_offset,
-    //            gap_space).c_str());
+static Layout layout = single_log;
+static u32 media_offset = 0;
+static u32 generation = 0;
 
-    return already_initialized;
-}
+// Save media formatted before we started counting erases.
+static bool legacy_root = false;
 
+// Erase counts for each wear zone, see wear_report().
+static Buffer<u32, FS_MAX_SEGMENTS> erase_counts;
 
+// Stores that we skipped, because the file already held the same data.
+static u32 skipped_writes = 0;
 
-void walk(Platform& pfrm,
-          Function<8 * sizeof(void*), void(const char*)> callback)
+
+
+// Summary of a segment, for the segmented layout. A segment with a zero
+// sequence number is free, i.e. erased. The sequence number, persisted in the
+// segment header, tells us the segment's age. We can't update a header on flash
+// without erasing the segment, so we count the fill and dead bytes when
+// mounting, and keep them up to date in ram. The fill and dead byte counts
+// include the segment header, and are relative to the beginning of the segment.
+struct Segment
 {
-    auto offset = start_offset;
+    u32 sequence_;
+    u16 fill_;
+    u16 dead_;
+};
 
-    offset += sizeof(Root);
 
-    while (true) {
-        Record r;
-        pfrm.read_save_data(&r, sizeof r, offset);
 
-        if (r.file_info_.name_length_ == 0xff) {
-            // uninitialized, as it holds the default flash erase value.
-            break;
-        }
+static Buffer<Segment, FS_MAX_SEGMENTS> segments;
 
-        offset += sizeof r;
+// Indices of the segments holding data, oldest first.
+static Buffer<u8, FS_MAX_SEGMENTS> segment_order;
 
-        char file_name[256];
-        memset(file_name, 0, 256);
+static u32 segment_base = 0;
+static u32 segment_size = 0;
 
-        pfrm.read_save_data(&file_name, r.file_info_.name_length_, offset);
+// The segmented layout appends files that we expect to be rewritten soon to a
+// different segment than everything else, so that segments fill up with either
+// mostly short-lived or mostly long-lived files. Hot segments empty out on
+// their own, and are cheap to clean, while cold segments can sit untouched.
+enum Temperature { cold, hot };
 
 
-        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
-            callback(file_name);
-        } else {
-#ifdef __TEST__
-            callback(("(INVALID)" + std::string(file_name)).c_str());
-#endif
-        }
 
-        offset += r.appended_size();
-    }
-}
+// The segments that we're currently appending to, or -1.
+static int active_segments[2] = {-1, -1};
 
 
 
-int find_file(Platform& pfrm, const char* path, Record& result)
-{
-    auto offset = start_offset;
-    offset += sizeof(Root);
+// Segments that we've cleaned, but not erased yet. See idle().
+static RingBuffer<u8, FS_MAX_SEGMENTS> erase_queue;
 
-    while (true) {
-        Record r;
-        const auto record_offset = offset;
+// Whether we've erased the inactive region of the dual layout ahead of time.
+static bool spare_erased = false;
 
-        pfrm.read_save_data(&r, sizeof r, offset);
 
-        if (r.file_info_.name_length_ == 0xff) {
-            // uninitialized, as it holds the default flash erase value.
-            // i.e. we're at the end of the filesystem storage. Nothing's been
-            // written here. We're using the name_length value as an identity
-            // test for file block presence, so we don't need to store another
-            // field, but obviously this prevents us from storing a file with
-            // name length == 255.
-            break;
+
+static bool erase_pending(int index)
+{
+    for (u32 i = 0; i < erase_queue.size(); ++i) {
+        if (erase_queue[i] == index) {
+            return true;
         }
+    }
+    return false;
+}
 
-        offset += sizeof r;
 
-        char file_name[256];
-        memset(file_name, 0, 256);
 
-        pfrm.read_save_data(&file_name, r.file_info_.name_length_, offset);
+static bool is_active(int index)
+{
+    return index == active_segments[cold] or index == active_segments[hot];
+}
 
-        if (r.invalidate_.get() == Record::InvalidateStatus::valid and
-            str_eq(path, file_name)) {
-            result = r;
-            return record_offset;
-        }
 
-        offset += r.appended_size();
-    }
 
-    return -1;
+static void remove_from_order(int index)
+{
+    for (auto it = segment_order.begin(); it not_eq segment_order.end(); ++it) {
+        if (*it == index) {
+            segment_order.erase(it);
+            break;
+        }
+    }
 }
 
 
 
-bool file_exists(Platform& pfrm, const char* path)
+static u32 segment_begin(int index)
 {
-    if (not __path_cache_file_exists_maybe(path)) {
-        return false;
+    if (index == 0) {
+        // The first segment begins at the offset passed to initialize(), which
+        // may not be aligned to an erase unit.
+        return media_offset;
     }
 
-    Record r;
-    return find_file(pfrm, path, r) not_eq -1;
+    return segment_base + index * segment_size;
 }
 
 
 
-void unlink_file(Platform& pfrm, const char* path)
+static u32 segment_end(int index)
 {
-    if (not __path_cache_file_exists_maybe(path)) {
-        return;
-    }
+    return segment_base + (index + 1) * segment_size;
+}
 
-    Record r;
 
-    bool freed = false;
 
-    auto off = find_file(pfrm, path, r);
-    while (off not_eq -1) {
-        // NOTE: first byte of record holds invalidate bytes.
-        static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
-        auto stat = Record::InvalidateStatus::invalid;
-        pfrm.write_save_data(&stat, 2, off);
+static int segment_of(u32 offset)
+{
+    return (offset - segment_base) / segment_size;
+}
 
-        gap_space += r.full_size();
-        freed = true;
 
-        off = find_file(pfrm, path, r);
-    }
 
-    if (freed) {
-        __path_cache_destroy();
-        __path_cache_create(pfrm);
-        log(format("unlinked %", path).c_str());
-    } else {
-        log(format("did not unlink %", path).c_str());
+static u32 root_size()
+{
+    if (layout == dual_log) {
+        return sizeof(DualRoot);
     }
+    return legacy_root ? sizeof(Root) : sizeof(CountedRoot);
 }
 
 
 
-// Ok, now we need to copy every non-dead chunk in the filesystem into ram,
-// erase the flash sector, and write it back...
-static void compact(Platform& pfrm)
+static u32 log_begin()
 {
-    log("flash fs start compaction...");
+    return start_offset + root_size();
+}
 
-    Vector<char> data;
 
-    // FIXME: do not hard-code this size. file breaks should be some sort of
-    // list?
-    Buffer<u32, 100> breaks;
 
-    auto offset = start_offset;
-    offset += sizeof(Root);
+// Split the save media into two equally sized regions, the second one beginning
+// on an erase unit boundary so that we can erase either without touching the
+// other. Returns false if the media is too small.
+static bool dual_regions(Platform& pfrm, u32 offset, u32 regions[2], u32& size)
+{
+    const u32 unit = pfrm.save_erase_unit();
+    const u32 capacity = pfrm.save_capacity();
 
-    while (true) {
-        Record r;
-        pfrm.read_save_data(&r, sizeof r, offset);
+    if (capacity <= offset) {
+        return false;
+    }
 
-        if (r.file_info_.name_length_ == 0xff or offset >= end_offset) {
-            // uninitialized, as it holds the default flash erase value.
-            break;
-        }
+    u32 second = offset + (capacity - offset) / 2;
+    second -= second % unit;
 
-        offset += sizeof r;
+    if (second <= offset or second - offset < 2 * sizeof(DualRoot)) {
+        return false;
+    }
 
-        char file_name[256];
-        memset(file_name, 0, 256);
+    regions[0] = offset;
+    regions[1] = second;
+    size = second - offset;
 
-        pfrm.read_save_data(&file_name, r.file_info_.name_length_, offset);
+    return true;
+}
 
-        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
 
-            r.invalidate_.set(Record::InvalidateStatus::invalid);
-            static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
-            // NOTE: we don't want to ever write the first byte in the record,
-            // as we use this byte for invalidating entries. Keep track of the
-            // positions to avoid writing back after the erase operation.
-            breaks.push_back(data.size());
-            for (u32 i = 0; i < sizeof r; ++i) {
-                data.push_back(((u8*)&r)[i]);
-            }
-            for (int i = 0; i < r.file_info_.name_length_; ++i) {
-                data.push_back(file_name[i]);
-            }
-            offset += r.file_info_.name_length_;
-            for (u32 i = 0; i < r.file_info_.data_length_.get(); ++i) {
-                u8 val;
-                pfrm.read_save_data(&val, 1, offset++);
-                data.push_back(val);
-            }
-        } else {
-            offset += r.appended_size();
-        }
-    }
 
+void destroy(Platform& pfrm)
+{
     pfrm.erase_save_sector();
+}
 
 
-    const auto start_align = start_offset + sizeof(Root);
-
-    u32 write_offset = start_align;
-    Buffer<u8, 64> buffer;
 
-    auto flush = [&] {
-        if (buffer.empty()) {
-            return;
+u32 sector_used()
+{
+    if (layout == segmented_log) {
+        u32 used = 0;
+        for (auto& s : segments) {
+            if (s.sequence_) {
+                used += s.fill_;
+            }
         }
-        pfrm.write_save_data(buffer.data(), buffer.size(), write_offset);
-        write_offset += buffer.size();
-        buffer.clear();
-    };
+        return used;
+    }
 
+    return end_offset - start_offset;
+}
 
-    for (u32 i = 0; i < data.size(); ++i) {
-        if (i == breaks[0]) {
-            flush();
-            // Bump the write offset past the invalid designator bytes in the
-            // record header.
-            write_offset += 2;
-            breaks.erase(breaks.begin());
-            ++i; // Skip the next byte too.
-            static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
-        } else {
-            auto val = data[i];
-            if (buffer.full()) {
-                flush();
+
+
+u32 sector_avail(Platform& pfrm)
+{
+    if (layout == segmented_log) {
+        // Whatever's left in the current segment, plus the free segments,
+        // minus the one that we keep in reserve for cleaning.
+        u32 avail = 0;
+        for (auto index : active_segments) {
+            if (index not_eq -1) {
+                avail += segment_end(index) - segment_begin(index) -
+                         segments[index].fill_;
+            }
+        }
+        u32 reserve = segment_size - sizeof(SegmentHeader);
+        for (auto& s : segments) {
+            if (s.sequence_ == 0) {
+                avail += segment_size - sizeof(SegmentHeader);
             }
-            buffer.push_back(val);
         }
+        return avail > reserve ? avail - reserve : 0;
     }
 
-    flush();
+    return region_end - end_offset;
+}
 
-    end_offset = write_offset;
-    gap_space = 0;
 
-    Root root;
-    init_root(pfrm, root);
 
-    log("flash fs completed compaction!");
+Statistics statistics(Platform& pfrm)
+{
+    Statistics ret;
+    ret.bytes_used_ = sector_used() - gap_space;
+    ret.bytes_available_ = sector_avail(pfrm) + gap_space;
+    ret.generation_ = generation;
+    ret.skipped_writes_ = skipped_writes;
+    ret.bytes_saved_ = compressed_savings;
+
+    ret.max_erase_count_ = 0;
+    for (auto count : erase_counts) {
+        if (count > ret.max_erase_count_) {
+            ret.max_erase_count_ = count;
+        }
+    }
+
+    return ret;
 }
 
 
 
-static int batch_write(Platform& pfrm,
-                       u32& offset,
-                       Vector<char>::iterator begin,
-                       Vector<char>::iterator end)
+Root load_root(Platform& pfrm)
 {
-    constexpr int batch_size = 64;
+    Root root;
+    pfrm.read_save_data(&root, sizeof root, start_offset);
 
-    Buffer<u8, batch_size> queue;
+    return root;
+}
 
-    int errors = 0;
 
-    auto flush = [&] {
-        if (queue.empty()) {
-            return;
-        }
-        bool success = pfrm.write_save_data(queue.data(), queue.size(), offset);
 
-        if (not success) {
-            ++errors;
-        }
+void set_scratch_arena(void* base, u32 size)
+{
+    scratch_arena = (u8*)base;
+    scratch_arena_size = base ? size : 0;
+}
 
-        offset += queue.size();
-        queue.clear();
-    };
 
-    while (begin not_eq end) {
-        if (queue.full()) {
-            flush();
-        }
 
-        queue.push_back(*begin);
-        ++begin;
-    }
+Function<8, void(const char*)> log_callback([](const char*) {});
 
-    flush();
 
-    return errors;
+
+void log(const char* msg)
+{
+    log_callback(&*msg);
 }
 
 
 
-bool store_file_data(Platform& pfrm, const char* path, Vector<char>& data)
+void set_log_receiver(Function<8, void(const char*)> callback)
 {
-    // Append a new file to the end of the filesystem log.
+    log_callback = callback;
+}
 
-    bool data_padding = false;
-    if (data.size() % 2 not_eq 0) {
-        // On the gameboy advance, commodity flash carts can be written only in
-        // halfwords (two bytes), so we need to pad the data size to a multiple
-        // of two, to ensure that all data has two-byte alignment.
-        data.push_back(0);
-        data_padding = true;
-    }
 
 
-    auto path_len = str_len(path);
-    u8 path_padding = 0;
-    if (path_len % 2 not_eq 0) {
-        // Add an extra null byte to the end, to bring total size up to a
-        // multiple of two.
-        path_padding = 1;
+static void init_root(Platform& pfrm)
+{
+    if (layout == dual_log) {
+        DualRoot root;
+        root.generation_.set(generation);
+        root.erase_count_.set(erase_counts[start_offset not_eq media_offset]);
+        memcpy(root.magic_, DualRoot::magic_val, 8);
+
+        // NOTE: write the generation before the magic value. A region with a
+        // partially written root shouldn't look valid.
+        static_assert(sizeof root.magic_ == 8);
+        pfrm.write_save_data(
+            &root.generation_, sizeof root - 8, start_offset + 8);
+        pfrm.write_save_data(root.magic_, 8, start_offset);
+    } else if (legacy_root) {
+        Root root;
+        memcpy(root.magic_, Root::magic_val, 8);
+        pfrm.write_save_data(&root, sizeof root, start_offset);
+    } else {
+        CountedRoot root;
+        root.erase_count_.set(erase_counts[0]);
+        memcpy(root.magic_, CountedRoot::magic_val, 8);
+        pfrm.write_save_data(
+            &root.erase_count_, sizeof root.erase_count_, start_offset + 8);
+        pfrm.write_save_data(root.magic_, 8, start_offset);
     }
+}
 
-    const auto path_total = path_len + path_padding;
 
-    const u32 required_space = data.size() + path_total + sizeof(Record);
-    const auto avail_space = sector_avail(pfrm) - sizeof(Record);
 
-    auto existing_size = file_size(pfrm, path);
-    // The file already exists. We will unlink it, allowing us to count the
-    // existing size toward the available space.
-    if (existing_size) {
-        existing_size += sizeof(Record) + path_total;
+// Look for a valid dual layout root in either region. Selects the region with
+// the higher generation.
+static bool find_dual_root(Platform& pfrm, u32 offset)
+{
+    u32 regions[2];
+    u32 size;
+    if (not dual_regions(pfrm, offset, regions, size)) {
+        return false;
     }
 
-    const bool insufficient_space_remaining = (required_space >= avail_space);
-    const bool sufficient_space_after_defrag =
-        avail_space + gap_space + existing_size > required_space;
+    bool found = false;
+    u32 counts[2] = {0, 0};
 
-    if (insufficient_space_remaining and sufficient_space_after_defrag) {
-        // We can reclaim enough space to store the file by compacting the
-        // storage data to squeeze out gaps.
+    for (int i = 0; i < 2; ++i) {
+        const auto region = regions[i];
 
-        // We counted the size of the file that we're overwriting toward the
-        // available space total. So we have to unlink it.
-        unlink_file(pfrm, path);
+        DualRoot root;
+        pfrm.read_save_data(&root, sizeof root, region);
 
-        compact(pfrm);
-    } else if (required_space >= avail_space) {
-        // NOTE: don't unlink the existing file, we don't have enough space to
-        // store the replacement.
-        if (data_padding) {
-            data.pop_back();
+        if (memcmp(root.magic_, DualRoot::magic_val, 8) not_eq 0) {
+            continue;
         }
-        return false;
-    }
 
-    unlink_file(pfrm, path);
+        counts[i] = root.erase_count_.get();
 
-    u8 crc8 = 0;
-    for (char c : data) {
-        crc8 = crc8_table[((u8)c) ^ crc8];
+        const auto gen = root.generation_.get();
+        if (not found or (s32)(gen - generation) > 0) {
+            found = true;
+            generation = gen;
+            start_offset = region;
+            region_end = region + size;
+        }
     }
 
-    // log(format("calculated crc %", crc8));
-
-    auto off = end_offset;
-    static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
-    ++off; // Skip the invalid bytes, which we don't want to write yet.
-    ++off;
+    if (found) {
+        layout = dual_log;
 
+        // If we lost the other region's root, it's been erased at least as
+        // many times as the current region, give or take one.
+        erase_counts.clear();
+        const int current = start_offset not_eq regions[0];
+        for (int i = 0; i < 2; ++i) {
+            erase_counts.push_back(counts[i] ? counts[i] : counts[current]);
+        }
+    }
 
-    Record::FileInfo info;
-    info.crc_ = crc8;
-    info.name_length_ = path_total;
-    info.data_length_.set(data.size());
+    return found;
+}
 
-    info.flags_[0] = 0;
-    info.flags_[1] = 0;
 
-    if (data_padding) {
-        info.flags_[0] |= Record::FileInfo::Flags0::has_end_padding;
-    }
 
-    int write_errors = 0;
+static void write_segment_header(Platform& pfrm, int index)
+{
+    SegmentHeader header;
+    memcpy(header.magic_, SegmentHeader::magic_val, 8);
+    header.erase_count_.set(erase_counts[index]);
+
+    // NOTE: write the erase count before the magic value, a partially written
+    // header shouldn't look valid.
+    const auto begin = segment_begin(index);
+    pfrm.write_save_data(
+        &header.erase_count_, sizeof header.erase_count_, begin + 8);
+    pfrm.write_save_data(header.magic_, 8, begin);
+}
 
-    if (not pfrm.write_save_data(&info, sizeof info, off)) {
-        ++write_errors;
-    }
-    off += sizeof info;
 
-    char file_name[256];
-    memset(file_name, 0, 256);
-    memcpy(file_name, path, path_len);
 
-    if (not pfrm.write_save_data(file_name, path_total, off)) {
-        ++write_errors;
-    }
-    off += path_total;
+static void erase_segment(Platform& pfrm, int index)
+{
+    pfrm.erase_save_range(segment_base + index * segment_size, segment_size);
 
+    ++erase_counts[index];
+    write_segment_header(pfrm, index);
+}
 
-    write_errors += batch_write(pfrm, off, data.begin(), data.end());
 
-    end_offset = off;
 
-    __path_cache_insert(path);
+// Work out where the segments go. Returns false if the media is too small to
+// hold three segments: one to keep in reserve for cleaning, and two for data.
+static bool segment_geometry(Platform& pfrm, u32 offset, u32& count)
+{
+    const u32 unit = pfrm.save_erase_unit();
+    const u32 capacity = pfrm.save_capacity();
 
-    if (data_padding) {
-        data.pop_back();
+    segment_size = FS_SEGMENT_SIZE;
+    if (segment_size % unit) {
+        segment_size += unit - segment_size % unit;
     }
 
-    if (write_errors) {
-        // NOTE: write errors indicate that a simultaneous writeback to flash
-        // did not work correctly. The data is still stored correctly in SRAM,
-        // so future calls to Platform::read_save_data() will work correctly.
-        // However, we do want the data to be persisted correctly in flash, so
-        // let's try running a compaction operation, which erases the flash chip
-        // and writes sram contents back to the flash device. Hopefully doing
-        // this will free up any stuck bits.
-
-        log("bad flash checksum detected, rewriting sector...");
+    segment_base = offset - offset % unit;
 
-        compact(pfrm);
+    if (segment_size > 0x8000 or capacity <= segment_base or
+        offset - segment_base >= segment_size / 2) {
+        return false;
     }
 
-    log(format("wrote %", path).c_str());
+    count = (capacity - segment_base) / segment_size;
+    if (count > FS_MAX_SEGMENTS) {
+        count = FS_MAX_SEGMENTS;
+    }
 
-    return true;
+    return count >= 3;
 }
 
 
 
-u32 file_size(Platform& pfrm, const char* path)
+// Open the next free segment after the most recently opened one, so that we
+// cycle through all of the segments in turn.
+static bool open_segment(Platform& pfrm, Temperature temperature)
 {
-    if (not __path_cache_file_exists_maybe(path)) {
-        return 0;
+    const int count = segments.size();
+    const int last = segment_order.empty() ? count - 1 : segment_order.back();
+
+    for (int i = 1; i <= count; ++i) {
+        const int index = (last + i) % count;
+        auto& s = segments[index];
+
+        if (s.sequence_ not_eq 0 or erase_pending(index)) {
+            continue;
+        }
+
+        ++generation;
+
+        SegmentHeader header;
+        header.sequence_.set(generation);
+        header.temperature_.set(temperature);
+        header.sequence_check_.set(~generation);
+
+        const auto begin = segment_begin(index);
+        pfrm.write_save_data(&header.sequence_,
+                             sizeof header.sequence_,
+                             begin + offsetof(SegmentHeader, sequence_));
+        pfrm.write_save_data(&header.temperature_,
+                             sizeof header.temperature_,
+                             begin + offsetof(SegmentHeader, temperature_));
+        pfrm.write_save_data(&header.sequence_check_,
+                             sizeof header.sequence_check_,
+                             begin + offsetof(SegmentHeader, sequence_check_));
+
+        s.sequence_ = generation;
+        s.fill_ = sizeof header;
+        s.dead_ = 0;
+
+        segment_order.push_back(index);
+
+        active_segments[temperature] = index;
+
+        return true;
+    }
+
+    return false;
+}
+
+
+
+static bool blank(Platform& pfrm, u32 begin, u32 end)
+{
+    for (u32 i = begin; i < end; ++i) {
+        u8 val = 0;
+        pfrm.read_save_data(&val, 1, i);
+        if (val not_eq 0xff) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+// Walk the records from offset up to end, checking crcs and adding up the space
+// taken by invalidated records. Leaves offset at the end of the last good
+// record. Returns false if we found a corrupt record.
+static bool scan_log(Platform& pfrm, u32& offset, u32 end, u32& dead)
+{
+    while (true) {
+
+        if (offset % 2 not_eq 0) {
+            log("bad filesystem alignment!");
+        }
+
+        if (offset + sizeof(Record) > end) {
+            break;
+        }
+
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        if (r.file_info_.name_length_ == 0xff) {
+            // Uninitialized, as it holds the default flash erase value.
+            // Uninitialzied name length indicates an unwritten record, i.e. the
+            // end of the sector.
+            break;
+        }
+
+        if (offset + r.full_size() > end) {
+            log("record overruns the end of the log!");
+            return false;
+        }
+
+        u8 crc8 = 0;
+        int read_size = checked_length(r);
+
+        for (int i = 0; i < read_size; ++i) {
+            u8 val;
+            const u32 off = i + offset + (sizeof r) + r.file_info_.name_length_;
+            pfrm.read_save_data(&val, 1, off);
+            crc8 = crc8_table[((u8)val) ^ crc8];
+        }
+
+        if (crc8 not_eq r.file_info_.crc_) {
+            // A record has an invalid crc. We'll try to reformat the filesystem
+            // and maybe it'll be fixed. I don't know how this can even happen
+            // in the first place.
+            // NOTE: The filesystem library should not corrupt memory in this
+            // way. But the filesystem data blob should be considered an
+            // external input to the program and checked for all classes of
+            // errors.
+            info(pfrm,
+                 format(
+                     "bad crc! expected: %, got: %", r.file_info_.crc_, crc8));
+            return false;
+        }
+
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid) {
+            dead += r.full_size();
+        }
+
+        offset += r.full_size();
+    }
+
+    return true;
+}
+
+
+
+// Look for segment headers, and rebuild the segment table from the records in
+// each segment. The newest hot and cold segments become the current ones,
+// unless something went wrong while writing to them, in which case we'll open
+// new ones on the next write.
+static bool mount_segments(Platform& pfrm, u32 offset)
+{
+    u32 count;
+    if (not segment_geometry(pfrm, offset, count)) {
+        return false;
+    }
+
+    segments.clear();
+    segment_order.clear();
+    erase_counts.clear();
+    active_segments[cold] = -1;
+    active_segments[hot] = -1;
+
+    bool found = false;
+    u32 max_erases = 0;
+
+    enum { ok, needs_header, needs_erase };
+    u8 repair[FS_MAX_SEGMENTS];
+
+    // Newest segment of each temperature.
+    int newest[2] = {-1, -1};
+    bool newest_clean[2] = {false, false};
+
+    for (u32 i = 0; i < count; ++i) {
+        Segment s{0, 0, 0};
+        repair[i] = ok;
+
+        const auto begin = segment_begin(i);
+
+        SegmentHeader header;
+        pfrm.read_save_data(&header, sizeof header, begin);
+
+        if (memcmp(header.magic_, SegmentHeader::magic_val, 8) not_eq 0) {
+            // We may have lost power right after erasing the segment, before
+            // writing its header.
+            repair[i] = blank(pfrm, begin, segment_end(i)) ? needs_header
+                                                            : needs_erase;
+            erase_counts.push_back(0);
+            segments.push_back(s);
+            continue;
+        }
+
+        found = true;
+
+        erase_counts.push_back(header.erase_count_.get());
+        if (erase_counts.back() > max_erases) {
+            max_erases = erase_counts.back();
+        }
+
+        const auto sequence = header.sequence_.get();
+        const auto check = header.sequence_check_.get();
+
+        if (sequence == 0xffffffff and check == 0xffffffff) {
+            if (not blank(pfrm, begin + sizeof header, segment_end(i))) {
+                repair[i] = needs_erase;
+            }
+        } else if (check not_eq ~sequence) {
+            // We lost power while opening the segment.
+            repair[i] = needs_erase;
+        } else {
+            s.sequence_ = sequence;
+
+            u32 off = begin + sizeof header;
+            u32 dead = 0;
+            bool clean = scan_log(pfrm, off, segment_end(i), dead);
+            clean = clean and blank(pfrm, off, segment_end(i));
+
+            s.fill_ = off - begin;
+            s.dead_ = dead;
+
+            if (segment_order.empty() or
+                (s32)(s.sequence_ - generation) > 0) {
+                generation = s.sequence_;
+            }
+
+            const auto t = header.temperature_.get() == hot ? hot : cold;
+            if (newest[t] == -1 or
+                (s32)(s.sequence_ - segments[newest[t]].sequence_) > 0) {
+                newest[t] = i;
+                newest_clean[t] = clean;
+            }
+
+            // Keep the list sorted by sequence number.
+            auto pos = segment_order.begin();
+            while (pos not_eq segment_order.end() and
+                   (s32)(segments[*pos].sequence_ - s.sequence_) < 0) {
+                ++pos;
+            }
+            segment_order.insert(pos, i);
+        }
+
+        segments.push_back(s);
+    }
+
+    if (not found) {
+        return false;
+    }
+
+    layout = segmented_log;
+
+    for (u32 i = 0; i < count; ++i) {
+        if (erase_counts[i] == 0) {
+            // We lost this segment's erase count. It's probably been erased
+            // about as many times as the most worn segment.
+            erase_counts[i] = max_erases;
+        }
+
+        if (repair[i] == needs_header) {
+            write_segment_header(pfrm, i);
+        } else if (repair[i] == needs_erase) {
+            log("erasing partially written segment...");
+            erase_segment(pfrm, i);
+        }
+
+        gap_space += segments[i].dead_;
+    }
+
+    for (int t = 0; t < 2; ++t) {
+        if (newest_clean[t]) {
+            active_segments[t] = newest[t];
+        }
+    }
+
+    // We lost power after cleaning a segment, before erasing it.
+    erase_queue.clear();
+    for (u32 i = 0; i < count; ++i) {
+        auto& s = segments[i];
+        if (s.sequence_ and not is_active(i) and
+            s.fill_ == sizeof(SegmentHeader) + s.dead_) {
+            gap_space -= s.dead_;
+            s = {0, 0, 0};
+            remove_from_order(i);
+            erase_queue.push_back(i);
+        }
+    }
+
+    return true;
+}
+
+
+
+void wear_report(Platform& pfrm,
+                 Function<8 * sizeof(void*), void(u32, u32, u32)> callback)
+{
+    for (u32 i = 0; i < erase_counts.size(); ++i) {
+        u32 begin = media_offset;
+        u32 end = pfrm.save_capacity();
+
+        if (layout == dual_log) {
+            u32 regions[2];
+            u32 size;
+            dual_regions(pfrm, media_offset, regions, size);
+            begin = regions[i];
+            end = begin + size;
+        } else if (layout == segmented_log) {
+            begin = segment_begin(i);
+            end = segment_end(i);
+        }
+
+        // NOTE: Function<> only accepts rvalues.
+        callback((u32)begin, end - begin, (u32)erase_counts[i]);
+    }
+}
+
+
+
+static void compact(Platform& pfrm, bool full = false);
+static void index_records(Platform& pfrm);
+
+
+
+InitStatus initialize(Platform& pfrm, u32 offset, Layout requested_layout)
+{
+    if (offset % 2 not_eq 0) {
+        return failed;
+    }
+
+    if (pfrm.save_capacity() == 0) {
+        return initialized;
+    }
+
+    media_offset = offset;
+    start_offset = offset;
+    region_end = pfrm.save_capacity();
+    patch_records = 0;
+    extent_records = 0;
+    entry_records = 0;
+    reference_records = 0;
+    pack_records = 0;
+    compressed_savings = 0;
+    slotted_files.clear();
+    renamed_files.clear();
+    directories.clear();
+    file_index.clear();
+    index_complete = false;
+    layout = single_log;
+    generation = 0;
+    legacy_root = false;
+    erase_counts.clear();
+    skipped_writes = 0;
+
+    CountedRoot root;
+    pfrm.read_save_data(&root, sizeof root, start_offset);
+
+    if (memcmp(root.magic_, Root::magic_val, 8) == 0) {
+        legacy_root = true;
+        erase_counts.push_back(0);
+    } else if (memcmp(root.magic_, CountedRoot::magic_val, 8) == 0) {
+        erase_counts.push_back(root.erase_count_.get());
+    }
+
+    // NOTE: we use whichever layout we find on the save media, regardless of
+    // the requested layout, rather than reformatting and losing data.
+    if (erase_counts.empty() and not find_dual_root(pfrm, offset) and
+        not mount_segments(pfrm, offset)) {
+
+        pfrm.erase_save_sector();
+
+        erase_counts.clear();
+
+        u32 regions[2];
+        u32 size;
+        u32 count;
+        if (requested_layout == dual_log and
+            dual_regions(pfrm, offset, regions, size)) {
+            layout = dual_log;
+            generation = 1;
+            region_end = start_offset + size;
+            erase_counts.push_back(1);
+            erase_counts.push_back(1);
+        } else if (requested_layout == segmented_log and
+                   segment_geometry(pfrm, offset, count)) {
+            layout = segmented_log;
+            segments.clear();
+            segment_order.clear();
+            for (u32 i = 0; i < count; ++i) {
+                segments.push_back({0, 0, 0});
+                erase_counts.push_back(1);
+                write_segment_header(pfrm, i);
+            }
+
+            index_complete = true;
+            __path_cache_create(pfrm);
+
+            return initialized;
+        } else {
+            erase_counts.push_back(1);
+        }
+
+        init_root(pfrm);
+
+        end_offset = log_begin();
+
+        index_complete = true;
+        __path_cache_create(pfrm);
+
+        return initialized;
+    }
+
+    if (layout == segmented_log) {
+        log("flash fs found segments...");
+
+        index_records(pfrm);
+        __path_cache_create(pfrm);
+
+        return already_initialized;
+    }
+
+    log("flash fs found root...");
+
+    offset = log_begin();
+
+    bool reformat = not scan_log(pfrm, offset, region_end, gap_space);
+
+    end_offset = offset;
+
+    // Now... we want to scan the rest of the unused portion of the flash
+    // filesystem. If any byte is not 0xff, the bit must have been flipped
+    // somehow, by, idk, cosmic radiation or something. A successive write to an
+    // address in some flash controllers will brick the system, so we want to
+    // erase and rewrite the sector in this case.
+    if (not reformat and not blank(pfrm, end_offset, region_end)) {
+        log("trailing bits unexpectedly flipped!");
+        reformat = true;
+    }
+
+    if (reformat) {
+        compact(pfrm, true);
+    }
+
+    index_records(pfrm);
+    __path_cache_create(pfrm);
+
+    // log(format("flash fs init, begin, %, end, %, gaps, %",
+    //            start_offset,
+    //            end_offset,
+    //            gap_space).c_str());
+
+    return already_initialized;
+}
+
+
+
+// A compressed record's data starts with the host_u16 length of the file,
+// followed by a stream of tokens, in groups of eight, each group preceded by a
+// control byte. For each set bit in the control byte, starting from the lowest,
+// the token is a match: a byte holding the distance back to an earlier copy of
+// the data, minus one, and a byte holding the length of the copy, minus
+// compress_min_match. For each clear bit, the token is a literal byte. As
+// matches reach back no more than compress_window bytes, we can decompress a
+// file a chunk at a time, with a fixed amount of ram.
+static constexpr const u32 compress_window = 256;
+static constexpr const u32 compress_min_match = 3;
+static constexpr const u32 compress_max_match = 255 + compress_min_match;
+
+
+
+// Compress the first length bytes of data into output, see above. Gives up,
+// and returns false, if the result wouldn't come out smaller.
+static bool compress(Vector<char>& data, u32 length, Vector<char>& output)
+{
+    if (length > 0xffff) {
+        return false;
+    }
+
+    host_u16 header;
+    header.set(length);
+    for (u32 i = 0; i < sizeof header; ++i) {
+        output.push_back(((char*)&header)[i]);
+    }
+
+    // The most recent position, plus one, of a string of compress_min_match
+    // bytes with each hash value. We only look at one candidate for each
+    // match, which keeps compression fast, at some cost to the ratio.
+    u16 recent[128];
+    memset(recent, 0, sizeof recent);
+
+    auto hash = [&](u32 pos) {
+        const u32 h = (u8)data[pos] * 33 * 33 + (u8)data[pos + 1] * 33 +
+                      (u8)data[pos + 2];
+        return h % (sizeof recent / sizeof recent[0]);
+    };
+
+    u32 control = 0;
+    u32 bit = 8;
+
+    u32 pos = 0;
+    while (pos < length) {
+        if (bit == 8) {
+            control = output.size();
+            output.push_back(0);
+            bit = 0;
+        }
+
+        u32 match = 0;
+        u32 distance = 0;
+        if (pos + compress_min_match <= length) {
+            const auto h = hash(pos);
+            const u32 candidate = recent[h];
+            recent[h] = pos + 1;
+
+            if (candidate and pos - (candidate - 1) <= compress_window) {
+                const u32 from = candidate - 1;
+                while (match < compress_max_match and pos + match < length and
+                       data[from + match] == data[pos + match]) {
+                    ++match;
+                }
+                distance = pos - from;
+            }
+        }
+
+        if (match >= compress_min_match) {
+            output[control] |= 1 << bit;
+            output.push_back(distance - 1);
+            output.push_back(match - compress_min_match);
+
+            for (u32 i = 1; i < match; ++i) {
+                if (pos + i + compress_min_match <= length) {
+                    recent[hash(pos + i)] = pos + i + 1;
+                }
+            }
+
+            pos += match;
+        } else {
+            output.push_back(data[pos]);
+            ++pos;
+        }
+
+        ++bit;
+
+        if (output.size() >= length) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+// Invoke callback(buffer, count) for successive chunks of the file compressed
+// into the data of the record at offset.
+template <typename F>
+static void decompress(Platform& pfrm,
+                       u32 offset,
+                       const Record& r,
+                       u8* buffer,
+                       u32 buffer_size,
+                       F&& callback)
+{
+    u32 src = offset + sizeof r + r.file_info_.name_length_;
+
+    host_u16 length;
+    pfrm.read_save_data(&length, sizeof length, src);
+    src += sizeof length;
+
+    // NOTE: don't read past the end of the record, which may be the end of
+    // save memory. A corrupt stream runs out of input, and decodes as zeroes.
+    const u32 stored = r.file_info_.data_length_.get();
+    u32 remaining = stored > sizeof length ? stored - sizeof length : 0;
+
+    u8 input[32];
+    u32 input_pos = 0;
+    u32 input_size = 0;
+
+    auto next = [&]() -> u8 {
+        if (input_pos == input_size) {
+            if (remaining == 0) {
+                return 0;
+            }
+            input_size = remaining < sizeof input ? remaining : sizeof input;
+            pfrm.read_save_data(input, input_size, src);
+            src += input_size;
+            remaining -= input_size;
+            input_pos = 0;
+        }
+        return input[input_pos++];
+    };
+
+    u8 window[compress_window];
+    u32 produced = 0;
+    u32 filled = 0;
+
+    auto emit = [&](u8 c) {
+        window[produced % compress_window] = c;
+        ++produced;
+        buffer[filled++] = c;
+        if (filled == buffer_size) {
+            callback(buffer, filled);
+            filled = 0;
+        }
+    };
+
+    while (produced < length.get()) {
+        const u8 control = next();
+        for (int bit = 0; bit < 8 and produced < length.get(); ++bit) {
+            if (control & (1 << bit)) {
+                const u32 distance = next() + 1;
+                const u32 match = next() + compress_min_match;
+                for (u32 i = 0; i < match and produced < length.get(); ++i) {
+                    emit(window[(produced - distance) % compress_window]);
+                }
+            } else {
+                emit(next());
+            }
+        }
+    }
+
+    if (filled) {
+        callback(buffer, filled);
+    }
+}
+
+
+
+// The size of a record's data, once decompressed, not counting padding.
+static u32 data_length(Platform& pfrm, u32 offset, const Record& r)
+{
+    if (is_compressed(r)) {
+        host_u16 length;
+        pfrm.read_save_data(
+            &length,
+            sizeof length,
+            offset + sizeof r + r.file_info_.name_length_);
+        return length.get();
+    }
+
+    return r.file_info_.data_length_.get() - is_padded(r);
+}
+
+
+
+// The space that compression saves for the record at offset.
+static u32 compression_savings(Platform& pfrm, u32 offset, const Record& r)
+{
+    if (not is_compressed(r)) {
+        return 0;
+    }
+
+    const u32 length = data_length(pfrm, offset, r);
+    const u32 stored = r.file_info_.data_length_.get();
+    return length > stored ? length - stored : 0;
+}
+
+
+
+// Invoke callback(offset, record) for each record in the log, oldest first,
+// until the callback returns false.
+template <typename F> static void visit_log(Platform& pfrm, F&& callback)
+{
+    auto visit = [&](u32 offset, u32 end) {
+        while (offset < end) {
+            Record r;
+            pfrm.read_save_data(&r, sizeof r, offset);
+
+            if (r.file_info_.name_length_ == 0xff) {
+                // uninitialized, as it holds the default flash erase value.
+                // i.e. we're at the end of the filesystem storage. Nothing's
+                // been written here. We're using the name_length value as an
+                // identity test for file block presence, so we don't need to
+                // store another field, but obviously this prevents us from
+                // storing a file with name length == 255.
+                break;
+            }
+
+            if (not callback(offset, r)) {
+                return false;
+            }
+
+            offset += r.full_size();
+        }
+        return true;
+    };
+
+    if (layout == segmented_log) {
+        for (auto index : segment_order) {
+            const auto begin = segment_begin(index);
+            if (not visit(begin + sizeof(SegmentHeader),
+                          begin + segments[index].fill_)) {
+                return;
+            }
+        }
+    } else {
+        visit(log_begin(), end_offset);
+    }
+}
+
+
+
+// Most paths begin with one of a few directories. Rather than repeating the
+// directory in every record's name, we write a directory record holding it,
+// named dir_record_tag followed by an id, and then name records for files in
+// the directory dir_name_tag, followed by the id and the rest of the path.
+// Paths start with a slash, so the tags can't clash with them. NOTE: we store
+// ids plus one, so that they aren't mistaken for the end of the name.
+static constexpr const char dir_record_tag = 1;
+static constexpr const char dir_name_tag = 2;
+
+// Shorter directories aren't worth an id.
+static constexpr const u32 min_directory_length = 4;
+
+
+
+// The length of the directory part of a path, including the trailing slash.
+static u32 directory_length(const char* path)
+{
+    u32 length = 0;
+    for (u32 i = 0; path[i]; ++i) {
+        if (path[i] == '/') {
+            length = i + 1;
+        }
+    }
+    return length;
+}
+
+
+
+static void read_directory(Platform& pfrm, const Directory& d, char* path)
+{
+    Record r;
+    pfrm.read_save_data(&r, sizeof r, d.offset_);
+
+    memset(path, 0, 256);
+    pfrm.read_save_data(path,
+                        r.file_info_.data_length_.get(),
+                        d.offset_ + sizeof r + r.file_info_.name_length_);
+}
+
+
+
+// Find the directory holding path, returning its index in directories, or -1.
+static int find_directory(Platform& pfrm, const char* path)
+{
+    const u32 length = directory_length(path);
+    if (length < min_directory_length) {
+        return -1;
+    }
+
+    const u32 hash = fnv32(path, length);
+
+    for (u32 i = 0; i < directories.size(); ++i) {
+        if (directories[i].hash_ not_eq hash) {
+            continue;
+        }
+
+        char directory[256];
+        read_directory(pfrm, directories[i], directory);
+        if (str_len(directory) == length and
+            memcmp(directory, path, length) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+
+// Write the name that a new record for path should have, i.e. with its
+// directory replaced by an id. Returns false if the directory has no id.
+static bool encode_name(Platform& pfrm, const char* path, char* name)
+{
+    const int index = find_directory(pfrm, path);
+    if (index == -1) {
+        return false;
+    }
+
+    const u32 length = directory_length(path);
+
+    name[0] = dir_name_tag;
+    name[1] = directories[index].id_ + 1;
+    memcpy(name + 2, path + length, str_len(path) - length + 1);
+
+    return true;
+}
+
+
+
+// Read a record's name, replacing its directory id with the directory.
+static void
+read_name(Platform& pfrm, u32 offset, const Record& r, char* file_name)
+{
+    memset(file_name, 0, 256);
+    pfrm.read_save_data(
+        file_name, r.file_info_.name_length_, offset + sizeof r);
+
+    if (file_name[0] not_eq dir_name_tag) {
+        return;
+    }
+
+    for (auto& d : directories) {
+        if (d.id_ + 1 == (u8)file_name[1]) {
+            char rest[256];
+            memcpy(rest, file_name + 2, sizeof rest - 2);
+
+            read_directory(pfrm, d, file_name);
+            const u32 length = str_len(file_name);
+            memcpy(file_name + length, rest, sizeof rest - length);
+            file_name[255] = '\0';
+            return;
+        }
+    }
+}
+
+
+
+// Add the record at offset to directories, if it's a directory record. Called
+// for records with two-byte names, as directory records' names are.
+static void index_directory(Platform& pfrm, u32 offset, const Record& r)
+{
+    char name[2];
+    pfrm.read_save_data(name, sizeof name, offset + sizeof r);
+    if (name[0] not_eq dir_record_tag) {
+        return;
+    }
+
+    const u8 id = (u8)name[1] - 1;
+    for (auto& d : directories) {
+        if (d.id_ == id) {
+            // A second copy, from losing power while relocating it.
+            return;
+        }
+    }
+
+    Directory d{offset, 0, id};
+
+    char path[256];
+    read_directory(pfrm, d, path);
+    d.hash_ = fnv32(path, str_len(path));
+
+    directories.push_back(d);
+}
+
+
+
+// Compares a path to record names, which may refer to its directory by id.
+struct PathKey
+{
+    const char* path_;
+    char name_[256];
+    bool encoded_;
+
+    PathKey(Platform& pfrm, const char* path) : path_(path)
+    {
+        encoded_ = encode_name(pfrm, path, name_);
+    }
+
+    bool matches(const char* name) const
+    {
+        return str_eq(path_, name) or (encoded_ and str_eq(name_, name));
+    }
+};
+
+
+
+// Invoke callback(index, name, data offset, length) for each file in the pack
+// at offset that we haven't removed, until it returns false.
+template <typename F>
+static void
+visit_members(Platform& pfrm, u32 offset, const Record& r, F&& callback)
+{
+    const u32 begin = offset + sizeof r + r.file_info_.name_length_;
+    const u32 removed = begin + checked_length(r);
+
+    host_u16 directory_size;
+    pfrm.read_save_data(&directory_size, sizeof directory_size, begin);
+
+    u32 entry_offset = begin + sizeof directory_size;
+    u32 data_offset = begin + directory_size.get();
+
+    char file_name[256];
+
+    for (u32 i = 0; i < slot_count(r); ++i) {
+        PackEntry entry;
+        pfrm.read_save_data(&entry, sizeof entry, entry_offset);
+        entry_offset += sizeof entry;
+
+        pfrm.read_save_data(
+            file_name + entry.shared_, entry.suffix_length_, entry_offset);
+        file_name[entry.shared_ + entry.suffix_length_] = '\0';
+        entry_offset += entry.suffix_length_;
+
+        host_u16 mark;
+        pfrm.read_save_data(&mark, sizeof mark, removed + i * sizeof mark);
+
+        if (mark.get() == 0xffff and
+            not callback(i, file_name, data_offset, entry.length_)) {
+            return;
+        }
+
+        data_offset += entry.length_;
+    }
+}
+
+
+
+static void index_name(Platform& pfrm, u32 entry, char* file_name)
+{
+    const u32 offset = entry & index_offset_mask;
+
+    Record r;
+    pfrm.read_save_data(&r, sizeof r, offset);
+
+    const u32 member = entry >> 24;
+    if (not member) {
+        read_name(pfrm, offset, r, file_name);
+        return;
+    }
+
+    visit_members(pfrm, offset, r, [&](u32 index, auto& name, u32, u32) {
+        if (index + 1 == member) {
+            memcpy(file_name, name, sizeof name);
+            return false;
+        }
+        return true;
+    });
+}
+
+
+
+// The position of the first entry in the index whose path doesn't sort before
+// path, or, if prefix is set, of the first entry whose path sorts after path
+// and doesn't begin with it.
+static u32
+index_bound(Platform& pfrm, const char* path, bool prefix = false)
+{
+    const u32 length = str_len(path);
+
+    u32 lo = 0;
+    u32 hi = file_index.size();
+    while (lo < hi) {
+        const u32 mid = (lo + hi) / 2;
+
+        char file_name[256];
+        index_name(pfrm, file_index[mid], file_name);
+
+        bool before = str_cmp(file_name, path) < 0;
+        if (prefix and not before) {
+            before = memcmp(file_name, path, length) == 0;
+        }
+
+        if (before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+
+// The position of path in the index, or -1.
+static int index_find(Platform& pfrm, const char* path)
+{
+    const u32 pos = index_bound(pfrm, path);
+    if (pos == file_index.size()) {
+        return -1;
+    }
+
+    char file_name[256];
+    index_name(pfrm, file_index[pos], file_name);
+
+    return str_eq(file_name, path) ? (int)pos : -1;
+}
+
+
+
+// Add an entry to the index. With replace set, the entry takes the place of an
+// older one for the same file, as we're about to invalidate its record.
+// Otherwise, e.g. if we lost power while moving a record, we leave it to
+// searching the log to find the file's first record.
+static void index_insert(Platform& pfrm, u32 entry, bool replace)
+{
+    if (not index_complete) {
+        return;
+    }
+
+    char file_name[256];
+    index_name(pfrm, entry, file_name);
+
+    const u32 pos = index_bound(pfrm, file_name);
+
+    if (pos < file_index.size()) {
+        char existing[256];
+        index_name(pfrm, file_index[pos], existing);
+        if (str_eq(existing, file_name)) {
+            if (replace) {
+                file_index[pos] = entry;
+            } else {
+                index_complete = false;
+            }
+            return;
+        }
+    }
+
+    if (file_index.full()) {
+        index_complete = false;
+        return;
+    }
+
+    file_index.insert(file_index.begin() + pos, entry);
+}
+
+
+
+// Add the record at offset to the index, if it's a file, or the files in it,
+// if it's a pack.
+static void
+index_file(Platform& pfrm, u32 offset, const Record& r, bool replace = true)
+{
+    if (is_chained(r) or is_entry(r) or renamed_by(offset) not_eq -1) {
+        return;
+    }
+
+    if (is_pack(r)) {
+        visit_members(pfrm, offset, r, [&](u32 index, auto&, u32, u32) {
+            index_insert(pfrm, offset | ((index + 1) << 24), replace);
+            return true;
+        });
+        return;
+    }
+
+    char tag;
+    pfrm.read_save_data(&tag, 1, offset + sizeof r);
+    if (tag == dir_record_tag) {
+        return;
+    }
+
+    index_insert(pfrm, offset, replace);
+}
+
+
+
+// Drop an entry from the index, or with member unset, all of the entries for
+// the record at offset.
+static void index_remove(u32 offset, u32 member = 0)
+{
+    for (auto it = file_index.begin(); it not_eq file_index.end();) {
+        if ((*it & index_offset_mask) == offset and
+            (not member or *it >> 24 == member)) {
+            it = file_index.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+
+void walk(Platform& pfrm,
+          Function<8 * sizeof(void*), void(const char*)> callback)
+{
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (is_chained(r) or is_entry(r)) {
+            // The file's original record already told the caller about it.
+            return true;
+        }
+
+        if (renamed_by(offset) not_eq -1) {
+            // The rename record tells the caller about the file's new name.
+            return true;
+        }
+
+        if (is_pack(r)) {
+            if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+                visit_members(pfrm,
+                              offset,
+                              r,
+                              [&](u32, auto& name, u32, u32) {
+                                  callback(name);
+                                  return true;
+                              });
+            }
+            return true;
+        }
+
+        char file_name[256];
+        read_name(pfrm, offset, r, file_name);
+
+        if (file_name[0] == dir_record_tag) {
+            return true;
+        }
+
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            callback(file_name);
+        } else {
+#ifdef __TEST__
+            callback(("(INVALID)" + std::string(file_name)).c_str());
+#endif
+        }
+
+        return true;
+    });
+}
+
+
+
+static bool has_prefix(const char* path, const char* prefix)
+{
+    const u32 length = str_len(prefix);
+    return str_len(path) >= length and memcmp(path, prefix, length) == 0;
+}
+
+
+
+void walk(Platform& pfrm,
+          const char* prefix,
+          Function<8 * sizeof(void*), void(const char*)> callback)
+{
+    if (not __path_cache_prefix_exists_maybe(prefix)) {
+        return;
+    }
+
+    const u32 prefix_len = str_len(prefix);
+
+    // The last path that we passed to the callback, if its writes moved
+    // records around underneath us. We carry on from there.
+    char resume[256];
+    resume[0] = '\0';
+
+    if (index_complete) {
+        // NOTE: copy the range out first, in case the callback writes files.
+        const u32 begin = index_bound(pfrm, prefix);
+        const u32 end = index_bound(pfrm, prefix, true);
+
+        Buffer<u32, FS_INDEX_SIZE> entries;
+        for (u32 i = begin; i < end; ++i) {
+            entries.push_back(file_index[i]);
+        }
+
+        const u32 moves = record_moves;
+
+        for (auto entry : entries) {
+            if (record_moves not_eq moves) {
+                break;
+            }
+            index_name(pfrm, entry, resume);
+            callback(resume);
+        }
+
+        if (record_moves == moves) {
+            return;
+        }
+
+        // NOTE: the offsets that we copied are stale, so look up each of the
+        // remaining files by name, in case the callback moves records again.
+        while (index_complete) {
+            const int found = index_find(pfrm, resume);
+            const u32 pos =
+                found == -1 ? index_bound(pfrm, resume) : found + 1;
+            if (pos >= index_bound(pfrm, prefix, true)) {
+                return;
+            }
+            index_name(pfrm, file_index[pos], resume);
+            callback(resume);
+        }
+    }
+
+    // Whether each directory could hold files with the prefix, so that we can
+    // skip records that refer to a directory by id without reading the rest
+    // of their names.
+    Buffer<bool, FS_DIRECTORIES> candidates;
+    for (auto& d : directories) {
+        char directory[256];
+        read_directory(pfrm, d, directory);
+        const u32 length = str_len(directory);
+        candidates.push_back(memcmp(directory,
+                                    prefix,
+                                    length < prefix_len ? length
+                                                        : prefix_len) == 0);
+    }
+
+    // NOTE: with the index gone, skip the files that we've already listed.
+    auto wanted = [&](const char* name) {
+        return has_prefix(name, prefix) and
+               (not resume[0] or str_cmp(name, resume) > 0);
+    };
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            is_chained(r) or is_entry(r) or renamed_by(offset) not_eq -1) {
+            return true;
+        }
+
+        if (is_pack(r)) {
+            visit_members(pfrm, offset, r, [&](u32, auto& name, u32, u32) {
+                if (wanted(name)) {
+                    callback(name);
+                }
+                return true;
+            });
+            return true;
+        }
+
+        char tag[2];
+        pfrm.read_save_data(tag, sizeof tag, offset + sizeof r);
+
+        if (tag[0] == dir_record_tag) {
+            return true;
+        }
+
+        if (tag[0] == dir_name_tag) {
+            for (u32 i = 0; i < directories.size(); ++i) {
+                if (directories[i].id_ + 1 == (u8)tag[1] and
+                    not candidates[i]) {
+                    return true;
+                }
+            }
+        }
+
+        char file_name[256];
+        read_name(pfrm, offset, r, file_name);
+
+        if (wanted(file_name)) {
+            callback(file_name);
+        }
+
+        return true;
+    });
+}
+
+
+
+u32 count_files(Platform& pfrm, const char* prefix)
+{
+    if (not __path_cache_prefix_exists_maybe(prefix)) {
+        return 0;
+    }
+
+    if (index_complete) {
+        return index_bound(pfrm, prefix, true) - index_bound(pfrm, prefix);
+    }
+
+    u32 count = 0;
+    walk(pfrm, prefix, [&](const char*) { ++count; });
+
+    return count;
+}
+
+
+
+bool directory_exists(Platform& pfrm, const char* directory)
+{
+    return count_files(pfrm, directory);
+}
+
+
+
+// Find a file's record. For a file with patches or extents, finds the original
+// record, see collect_chains(). For a circular log, finds the record holding
+// its capacity.
+int find_file(Platform& pfrm, const char* path, Record& result)
+{
+    int found = -1;
+
+    if (index_complete) {
+        const int pos = index_find(pfrm, path);
+        if (pos == -1 or file_index[pos] >> 24) {
+            // Missing, or in a pack, see find_packed().
+            return found;
+        }
+        found = file_index[pos];
+        pfrm.read_save_data(&result, sizeof result, found);
+        return found;
+    }
+
+    const PathKey key(pfrm, path);
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            is_chained(r) or is_entry(r) or renamed_by(offset) not_eq -1) {
+            return true;
+        }
+
+        char file_name[256];
+        memset(file_name, 0, 256);
+
+        pfrm.read_save_data(
+            &file_name, r.file_info_.name_length_, offset + sizeof r);
+
+        if (key.matches(file_name)) {
+            result = r;
+            found = offset;
+            return false;
+        }
+
+        return true;
+    });
+
+    return found;
+}
+
+
+
+struct PackMember
+{
+    u32 index_;
+    u32 data_offset_;
+    u32 length_;
+};
+
+
+
+// Find a file in a pack, see store_packed_files(). Returns the offset of the
+// pack's record, reading it into r.
+static int
+find_packed(Platform& pfrm, const char* path, Record& result, PackMember& m)
+{
+    int found = -1;
+
+    if (not pack_records) {
+        return found;
+    }
+
+    if (index_complete) {
+        const int pos = index_find(pfrm, path);
+        if (pos == -1 or not(file_index[pos] >> 24)) {
+            return found;
+        }
+
+        const u32 offset = file_index[pos] & index_offset_mask;
+        const u32 member = file_index[pos] >> 24;
+
+        pfrm.read_save_data(&result, sizeof result, offset);
+
+        visit_members(
+            pfrm,
+            offset,
+            result,
+            [&](u32 index, const char*, u32 data_offset, u32 length) {
+                if (index + 1 == member) {
+                    m = {index, data_offset, length};
+                    found = offset;
+                    return false;
+                }
+                return true;
+            });
+
+        return found;
+    }
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            not is_pack(r)) {
+            return true;
+        }
+
+        visit_members(
+            pfrm,
+            offset,
+            r,
+            [&](u32 index, const char* name, u32 data_offset, u32 length) {
+                if (str_eq(path, name)) {
+                    m = {index, data_offset, length};
+                    result = r;
+                    found = offset;
+                    return false;
+                }
+                return true;
+            });
+
+        return found == -1;
+    });
+
+    return found;
+}
+
+
+
+// A rename record is a reference whose data holds a blank name, rather than the
+// name of the file that it refers to, followed by the offset of the renamed
+// file's record, see rename_file().
+static constexpr const u32 rename_length = 6;
+
+
+
+// The offset in the rename record at offset, or -1 if it isn't one.
+static int rename_offset(Platform& pfrm, u32 offset, const Record& r)
+{
+    if (not is_reference(r) or
+        r.file_info_.data_length_.get() not_eq rename_length) {
+        return -1;
+    }
+
+    u8 data[rename_length];
+    pfrm.read_save_data(
+        data, sizeof data, offset + sizeof r + r.file_info_.name_length_);
+
+    if (data[0] not_eq 0) {
+        return -1;
+    }
+
+    return data[2] | (data[3] << 8) | (data[4] << 16) | (data[5] << 24);
+}
+
+
+
+static void invalidate_record(Platform& pfrm, u32 offset, const Record& r);
+
+
+
+// Start keeping track of the rename record at offset. If we lost power while
+// unlinking the file, after invalidating its original record, we finish the
+// job, as compaction will move records around, and the offset in the rename
+// record could end up pointing at some other file. Expects to see rename
+// records in the order that we wrote them.
+static void index_rename(Platform& pfrm, u32 offset, const Record& r)
+{
+    const int target = rename_offset(pfrm, offset, r);
+    if (target == -1 or renamed_files.full()) {
+        return;
+    }
+
+    Record t;
+    pfrm.read_save_data(&t, sizeof t, target);
+    if (t.invalidate_.get() not_eq Record::InvalidateStatus::valid) {
+        invalidate_record(pfrm, offset, r);
+        return;
+    }
+
+    // We lost power while renaming a renamed file, after writing the new
+    // rename record. Finish the job.
+    for (auto it = renamed_files.begin(); it not_eq renamed_files.end(); ++it) {
+        if ((int)it->target_ == target) {
+            const u32 previous = it->record_;
+            renamed_files.erase(it);
+
+            Record p;
+            pfrm.read_save_data(&p, sizeof p, previous);
+            invalidate_record(pfrm, previous, p);
+            break;
+        }
+    }
+
+    renamed_files.push_back({offset, (u32)target});
+}
+
+
+
+// A reference's record holds no contents of its own, only the name of the file
+// that does. Returns the offset of that file's record, reading it into r, or
+// the offset passed in, if r isn't a reference.
+static int resolve_reference(Platform& pfrm, int offset, Record& r)
+{
+    if (offset == -1 or not is_reference(r)) {
+        return offset;
+    }
+
+    const int renamed = renamed_target(offset);
+    if (renamed not_eq -1) {
+        pfrm.read_save_data(&r, sizeof r, renamed);
+        return renamed;
+    }
+
+    char target[256];
+    memset(target, 0, 256);
+    pfrm.read_save_data(target,
+                        r.file_info_.data_length_.get(),
+                        offset + sizeof r + r.file_info_.name_length_);
+
+    // NOTE: a clone may refer to a renamed file, see clone_file().
+    return resolve_reference(pfrm, find_file(pfrm, target, r), r);
+}
+
+
+
+// Find a reference to the file at path, writing its name to file_name.
+static int find_referrer(Platform& pfrm, const char* path, char* file_name)
+{
+    int found = -1;
+
+    if (not reference_records) {
+        return found;
+    }
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            not is_reference(r)) {
+            return true;
+        }
+
+        char target[256];
+        memset(target, 0, 256);
+        pfrm.read_save_data(target,
+                            r.file_info_.data_length_.get(),
+                            offset + sizeof r + r.file_info_.name_length_);
+
+        if (str_eq(path, target)) {
+            read_name(pfrm, offset, r, file_name);
+            found = offset;
+            return false;
+        }
+
+        return true;
+    });
+
+    return found;
+}
+
+
+
+bool file_exists(Platform& pfrm, const char* path)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return false;
+    }
+
+    Record r;
+    PackMember member;
+    return find_file(pfrm, path, r) not_eq -1 or
+           find_packed(pfrm, path, r, member) not_eq -1;
+}
+
+
+
+static void invalidate_record(Platform& pfrm, u32 offset, const Record& r)
+{
+    // NOTE: invalidate a renamed file's record before the rename record, so
+    // that if we lose power in between, the file doesn't get its old name back.
+    for (auto it = renamed_files.begin(); it not_eq renamed_files.end(); ++it) {
+        if (it->record_ == offset) {
+            const u32 target = it->target_;
+            renamed_files.erase(it);
+
+            Record t;
+            pfrm.read_save_data(&t, sizeof t, target);
+            invalidate_record(pfrm, target, t);
+            break;
+        }
+    }
+
+    // NOTE: first byte of record holds invalidate bytes.
+    static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
+    auto stat = Record::InvalidateStatus::invalid;
+    pfrm.write_save_data(&stat, 2, offset);
+
+    gap_space += r.full_size();
+
+    if (layout == segmented_log) {
+        segments[segment_of(offset)].dead_ += r.full_size();
+    }
+
+    compressed_savings -= compression_savings(pfrm, offset, r);
+
+    index_remove(offset);
+
+    if (is_reference(r)) {
+        --reference_records;
+    } else if (is_pack(r)) {
+        --pack_records;
+    }
+
+    if (is_patch(r)) {
+        --patch_records;
+    } else if (is_extent(r)) {
+        --extent_records;
+    } else if (is_entry(r)) {
+        --entry_records;
+    } else if (is_slotted(r)) {
+        for (auto it = slotted_files.begin(); it not_eq slotted_files.end();
+             ++it) {
+            if (*it == offset) {
+                slotted_files.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+
+
+struct Link
+{
+    u16 sequence_;
+    u32 offset_;
+};
+
+
+
+using PatchChain = Buffer<Link, FS_MAX_PATCHES>;
+using ExtentChain = Buffer<Link, FS_MAX_EXTENTS>;
+
+
+
+struct Chains
+{
+    PatchChain patches_;
+    ExtentChain extents_;
+
+    bool empty() const
+    {
+        return patches_.empty() and extents_.empty();
+    }
+};
+
+
+
+// Find the live patches and extents for a file, in the order that they need to
+// be applied. We can't go by their order in the log, as the segmented layout
+// may relocate them.
+static void collect_chains(Platform& pfrm, const char* path, Chains& chains)
+{
+    chains.patches_.clear();
+    chains.extents_.clear();
+
+    if (not patch_records and not extent_records) {
+        return;
+    }
+
+    auto link = [](auto& chain, u16 sequence, u32 offset) {
+        auto pos = chain.begin();
+        while (pos not_eq chain.end() and pos->sequence_ < sequence) {
+            ++pos;
+        }
+        chain.insert(pos, {sequence, offset});
+    };
+
+    const PathKey key(pfrm, path);
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            not is_chained(r)) {
+            return true;
+        }
+
+        char file_name[256];
+        memset(file_name, 0, 256);
+
+        pfrm.read_save_data(
+            &file_name, r.file_info_.name_length_, offset + sizeof r);
+
+        if (key.matches(file_name)) {
+            host_u16 sequence;
+            pfrm.read_save_data(&sequence,
+                                sizeof sequence,
+                                offset + sizeof r + r.file_info_.name_length_);
+
+            if (is_patch(r)) {
+                link(chains.patches_, sequence.get(), offset);
+            } else {
+                link(chains.extents_, sequence.get(), offset);
+            }
+        }
+
+        return true;
+    });
+}
+
+
+
+// Like collect_chains(), for the file whose original record sits at offset.
+static void
+collect_chains(Platform& pfrm, u32 offset, const Record& r, Chains& chains)
+{
+    chains.patches_.clear();
+    chains.extents_.clear();
+
+    if (not patch_records and not extent_records) {
+        return;
+    }
+
+    char file_name[256];
+    read_name(pfrm, offset, r, file_name);
+
+    collect_chains(pfrm, file_name, chains);
+}
+
+
+
+// Find the original record of the file that the patch or extent at offset
+// belongs to. Compaction merges patches and extents into the file's record,
+// except for a compressed file, as it would have to decompress the file, which
+// might then no longer fit. We move those, and their extents, as they are.
+static int find_base(Platform& pfrm, u32 offset, const Record& r, Record& base)
+{
+    char file_name[256];
+    read_name(pfrm, offset, r, file_name);
+
+    return find_file(pfrm, file_name, base);
+}
+
+
+
+// Overwrite a buffer, holding count bytes of file data beginning at position
+// pos, with the hunks from each patch in the chain that fall within it.
+static void apply_patches(Platform& pfrm,
+                          const PatchChain& chain,
+                          u8* buffer,
+                          u32 pos,
+                          u32 count)
+{
+    for (auto& patch : chain) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, patch.offset_);
+
+        u32 offset = patch.offset_ + sizeof r + r.file_info_.name_length_;
+        const u32 end = offset + r.file_info_.data_length_.get();
+
+        offset += sizeof(host_u16);
+
+        while (offset < end) {
+            PatchHunk hunk;
+            pfrm.read_save_data(&hunk, sizeof hunk, offset);
+            offset += sizeof hunk;
+
+            const u32 hunk_begin = hunk.offset_.get();
+            const u32 hunk_end = hunk_begin + hunk.length_.get();
+
+            const u32 lo = hunk_begin > pos ? hunk_begin : pos;
+            const u32 hi = hunk_end < pos + count ? hunk_end : pos + count;
+
+            if (lo < hi) {
+                pfrm.read_save_data(
+                    buffer + (lo - pos), hi - lo, offset + (lo - hunk_begin));
+            }
+
+            offset += hunk.length_.get();
+        }
+    }
+}
+
+
+
+// Read count bytes of a file's data, beginning at position pos, with patches
+// applied. data_offset points to the data of the file's original record.
+static void read_patched(Platform& pfrm,
+                         u32 data_offset,
+                         const PatchChain& chain,
+                         u8* buffer,
+                         u32 pos,
+                         u32 count)
+{
+    pfrm.read_save_data(buffer, count, data_offset + pos);
+    apply_patches(pfrm, chain, buffer, pos, count);
+}
+
+
+
+// The size of a file's data, with its extents, not counting padding.
+static u32 merged_length(Platform& pfrm,
+                         u32 offset,
+                         const Record& r,
+                         const Chains& chains)
+{
+    u32 length = data_length(pfrm, offset, r);
+
+    for (auto& extent : chains.extents_) {
+        Record e;
+        pfrm.read_save_data(&e, sizeof e, extent.offset_);
+        length += e.file_info_.data_length_.get() - sizeof(host_u16) -
+                  is_padded(e);
+    }
+
+    return length;
+}
+
+
+
+// Invoke callback(buffer, count) for successive chunks of the data of the file
+// whose original record sits at offset, with its patches applied and its
+// extents appended, not counting padding.
+template <typename F>
+static void read_chunks(Platform& pfrm,
+                        u32 offset,
+                        const Record& r,
+                        const Chains& chains,
+                        u8* buffer,
+                        u32 buffer_size,
+                        F&& callback)
+{
+    const u32 data_offset = offset + sizeof r + r.file_info_.name_length_;
+    const u32 length = r.file_info_.data_length_.get() - is_padded(r);
+
+    // NOTE: we never patch compressed records, see store_patch().
+    if (is_compressed(r)) {
+        decompress(pfrm, offset, r, buffer, buffer_size, callback);
+    } else {
+        for (u32 pos = 0; pos < length; pos += buffer_size) {
+            const u32 count =
+                length - pos < buffer_size ? length - pos : buffer_size;
+            read_patched(
+                pfrm, data_offset, chains.patches_, buffer, pos, count);
+            callback(buffer, count);
+        }
+    }
+
+    for (auto& extent : chains.extents_) {
+        Record e;
+        pfrm.read_save_data(&e, sizeof e, extent.offset_);
+
+        u32 src = extent.offset_ + sizeof e + e.file_info_.name_length_ +
+                  sizeof(host_u16);
+        u32 remaining =
+            e.file_info_.data_length_.get() - sizeof(host_u16) - is_padded(e);
+
+        while (remaining) {
+            const u32 count =
+                remaining < buffer_size ? remaining : buffer_size;
+            pfrm.read_save_data(buffer, count, src);
+            callback(buffer, count);
+            src += count;
+            remaining -= count;
+        }
+    }
+}
+
+
+
+// Produce a single record holding the file whose original record sits at
+// offset, with its patches applied and its extents appended, passing it to
+// emit(data, length) a piece at a time. Like the records that compaction copies
+// verbatim, the record begins with a blank invalidate field. Returns the size
+// of the record.
+template <typename F>
+static u32 emit_merged(Platform& pfrm,
+                       u32 offset,
+                       const Record& r,
+                       const Chains& chains,
+                       F&& emit)
+{
+    u8 buffer[64];
+
+    u8 crc8 = 0;
+    u32 length = 0;
+    read_chunks(
+        pfrm, offset, r, chains, buffer, sizeof buffer, [&](u8* b, u32 n) {
+            for (u32 i = 0; i < n; ++i) {
+                crc8 = crc8_table[b[i] ^ crc8];
+            }
+            length += n;
+        });
+
+    const u8 padding = 0;
+    Record merged;
+    merged.invalidate_.set(Record::InvalidateStatus::valid);
+    merged.file_info_ = r.file_info_;
+    merged.file_info_.flags_[0] &= ~Record::FileInfo::Flags0::has_end_padding;
+    merged.file_info_.flags_[1] &= ~Record::FileInfo::Flags1::is_compressed;
+    if (length % 2) {
+        crc8 = crc8_table[padding ^ crc8];
+        merged.file_info_.flags_[0] |=
+            Record::FileInfo::Flags0::has_end_padding;
+    }
+    merged.file_info_.crc_ = crc8;
+    merged.file_info_.data_length_.set(length + length % 2);
+
+    emit((const u8*)&merged, sizeof merged);
+
+    char file_name[256];
+    pfrm.read_save_data(
+        file_name, r.file_info_.name_length_, offset + sizeof r);
+    emit((const u8*)file_name, r.file_info_.name_length_);
+
+    read_chunks(pfrm, offset, r, chains, buffer, sizeof buffer, emit);
+
+    if (length % 2) {
+        emit(&padding, 1);
+    }
+
+    return merged.full_size();
+}
+
+
+
+// Produce a copy of the renamed file whose record sits at offset, under the
+// name in the rename record at rename, see rename_file(). Like emit_merged().
+template <typename F>
+static u32 emit_renamed(Platform& pfrm,
+                        u32 offset,
+                        const Record& r,
+                        u32 rename,
+                        F&& emit)
+{
+    Record renamer;
+    pfrm.read_save_data(&renamer, sizeof renamer, rename);
+
+    Record renamed;
+    renamed.invalidate_.set(Record::InvalidateStatus::valid);
+    renamed.file_info_ = r.file_info_;
+    renamed.file_info_.name_length_ = renamer.file_info_.name_length_;
+
+    emit((const u8*)&renamed, sizeof renamed);
+
+    char file_name[256];
+    pfrm.read_save_data(
+        file_name, renamer.file_info_.name_length_, rename + sizeof renamer);
+    emit((const u8*)file_name, renamer.file_info_.name_length_);
+
+    u8 buffer[64];
+    u32 src = offset + sizeof r + r.file_info_.name_length_;
+    u32 remaining = r.appended_size() - r.file_info_.name_length_;
+    while (remaining) {
+        const u32 count = remaining < sizeof buffer ? remaining : sizeof buffer;
+        pfrm.read_save_data(buffer, count, src);
+        emit(buffer, count);
+        src += count;
+        remaining -= count;
+    }
+
+    return renamed.full_size();
+}
+
+
+
+// Recount the live patches, extents, entries, references and packs, find the
+// slotted files and directories, and rebuild the file index, after mounting the
+// filesystem or moving records around.
+static void index_records(Platform& pfrm)
+{
+    patch_records = 0;
+    extent_records = 0;
+    entry_records = 0;
+    reference_records = 0;
+    pack_records = 0;
+    compressed_savings = 0;
+    slotted_files.clear();
+    renamed_files.clear();
+    directories.clear();
+    file_index.clear();
+    index_complete = false;
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            if (is_patch(r)) {
+                ++patch_records;
+            } else if (is_extent(r)) {
+                ++extent_records;
+            } else if (is_entry(r)) {
+                ++entry_records;
+            } else if (is_slotted(r)) {
+                slotted_files.push_back(offset);
+            } else if (r.file_info_.name_length_ == 2) {
+                index_directory(pfrm, offset, r);
+            }
+            if (is_reference(r)) {
+                ++reference_records;
+                index_rename(pfrm, offset, r);
+            } else if (is_pack(r)) {
+                ++pack_records;
+            }
+            compressed_savings += compression_savings(pfrm, offset, r);
+        }
+        return true;
+    });
+
+    // NOTE: in a second pass, as we need to know the directories to read the
+    // names of the files in them.
+    index_complete = true;
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            index_file(pfrm, offset, r, false);
+        }
+        return index_complete;
+    });
+}
+
+
+
+// Invalidate a file's patches and extents.
+static void unlink_chains(Platform& pfrm, const char* path)
+{
+    Chains chains;
+    collect_chains(pfrm, path, chains);
+
+    auto unlink = [&](auto& chain) {
+        for (auto& link : chain) {
+            Record r;
+            pfrm.read_save_data(&r, sizeof r, link.offset_);
+            invalidate_record(pfrm, link.offset_, r);
+        }
+    };
+
+    unlink(chains.patches_);
+    unlink(chains.extents_);
+}
+
+
+
+// Invoke callback(offset, record, position, length) for each live entry of the
+// circular log at path, in no particular order.
+template <typename F>
+static void visit_entries(Platform& pfrm, const char* path, F&& callback)
+{
+    if (not entry_records) {
+        return;
+    }
+
+    const PathKey key(pfrm, path);
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            not is_entry(r)) {
+            return true;
+        }
+
+        char file_name[256];
+        memset(file_name, 0, 256);
+
+        pfrm.read_save_data(
+            &file_name, r.file_info_.name_length_, offset + sizeof r);
+
+        if (key.matches(file_name)) {
+            host_u32 position;
+            pfrm.read_save_data(&position,
+                                sizeof position,
+                                offset + sizeof r + r.file_info_.name_length_);
+
+            callback(offset,
+                     r,
+                     position.get(),
+                     r.file_info_.data_length_.get() - sizeof position -
+                         is_padded(r));
+        }
+
+        return true;
+    });
+}
+
+
+
+// Mark a file in a pack as removed, by programming its update slot. Once we've
+// removed all of a pack's files, we invalidate the pack. Until then, its space
+// stays in use.
+static bool unlink_packed(Platform& pfrm, const char* path)
+{
+    Record r;
+    PackMember member;
+    const auto offset = find_packed(pfrm, path, r, member);
+    if (offset == -1) {
+        return false;
+    }
+
+    const u32 removed =
+        offset + sizeof r + r.file_info_.name_length_ + checked_length(r);
+
+    host_u16 mark;
+    mark.set(0);
+    pfrm.write_save_data(
+        &mark, sizeof mark, removed + member.index_ * sizeof mark);
+
+    index_remove(offset, member.index_ + 1);
+
+    bool empty = true;
+    visit_members(pfrm, offset, r, [&](u32, const char*, u32, u32) {
+        empty = false;
+        return false;
+    });
+
+    if (empty) {
+        invalidate_record(pfrm, offset, r);
+    }
+
+    return true;
+}
+
+
+
+static bool detach_references(Platform& pfrm, const char* path);
+
+
+
+bool unlink_file(Platform& pfrm, const char* path)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return false;
+    }
+
+    if (not detach_references(pfrm, path)) {
+        // NOTE: the files referencing it would read as empty, so we keep it.
+        log(format("failed to detach references to %", path).c_str());
+        return false;
+    }
+
+    // NOTE: drop a circular log's entries before the record that they belong
+    // to. If we lose power in between, we're left with a log missing some of
+    // its entries, rather than with entries that a new file at the same path
+    // could pick up.
+    visit_entries(pfrm, path, [&](u32 offset, const Record& e, u32, u32) {
+        invalidate_record(pfrm, offset, e);
+    });
+
+    Record r;
+
+    bool freed = false;
+
+    auto off = find_file(pfrm, path, r);
+    while (off not_eq -1) {
+        invalidate_record(pfrm, off, r);
+        freed = true;
+
+        off = find_file(pfrm, path, r);
+    }
+
+    unlink_chains(pfrm, path);
+
+    while (unlink_packed(pfrm, path)) {
+        freed = true;
+    }
+
+    if (freed) {
+        __path_cache_destroy();
+        __path_cache_create(pfrm);
+        log(format("unlinked %", path).c_str());
+    } else {
+        log(format("did not unlink %", path).c_str());
+    }
+
+    return freed;
+}
+
+
+
+// Find a reference to a file under prefix, from a file that isn't, writing the
+// name of the file that it refers to to target.
+static bool
+find_prefix_referrer(Platform& pfrm, const char* prefix, char* target)
+{
+    bool found = false;
+
+    if (not reference_records) {
+        return found;
+    }
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            not is_reference(r)) {
+            return true;
+        }
+
+        char file_name[256];
+        read_name(pfrm, offset, r, file_name);
+        if (has_prefix(file_name, prefix)) {
+            return true;
+        }
+
+        memset(target, 0, 256);
+        pfrm.read_save_data(target,
+                            r.file_info_.data_length_.get(),
+                            offset + sizeof r + r.file_info_.name_length_);
+
+        found = has_prefix(target, prefix);
+        return not found;
+    });
+
+    return found;
+}
+
+
+
+RemovedFiles remove_prefix(Platform& pfrm, const char* prefix)
+{
+    RemovedFiles result{0, 0};
+
+    if (not __path_cache_prefix_exists_maybe(prefix)) {
+        return result;
+    }
+
+    char target[256];
+    while (find_prefix_referrer(pfrm, prefix, target)) {
+        if (not detach_references(pfrm, target)) {
+            // NOTE: the files referencing it would read as empty, so we keep
+            // everything, see unlink_file().
+            log(format("failed to detach references to %", target).c_str());
+            return result;
+        }
+    }
+
+    const u32 gaps = gap_space;
+
+    auto matches = [&](u32 offset, const Record& r) {
+        if (renamed_by(offset) not_eq -1) {
+            // Goes along with its rename record, see invalidate_record().
+            return false;
+        }
+
+        char file_name[256];
+        read_name(pfrm, offset, r, file_name);
+        return file_name[0] not_eq dir_record_tag and
+               has_prefix(file_name, prefix);
+    };
+
+    // NOTE: drop circular logs' entries before the records that they belong
+    // to, see unlink_file().
+    if (entry_records) {
+        visit_log(pfrm, [&](u32 offset, const Record& r) {
+            if (r.invalidate_.get() == Record::InvalidateStatus::valid and
+                is_entry(r) and matches(offset, r)) {
+                invalidate_record(pfrm, offset, r);
+            }
+            return true;
+        });
+    }
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid) {
+            return true;
+        }
+
+        if (is_pack(r)) {
+            const u32 removed = offset + sizeof r + r.file_info_.name_length_ +
+                                checked_length(r);
+
+            bool empty = true;
+            auto remove = [&](u32 index, auto& name, u32, u32) {
+                if (not has_prefix(name, prefix)) {
+                    empty = false;
+                    return true;
+                }
+
+                host_u16 mark;
+                mark.set(0);
+                pfrm.write_save_data(
+                    &mark, sizeof mark, removed + index * sizeof mark);
+                index_remove(offset, index + 1);
+                ++result.count_;
+                return true;
+            };
+            visit_members(pfrm, offset, r, remove);
+
+            if (empty) {
+                invalidate_record(pfrm, offset, r);
+            }
+
+            return true;
+        }
+
+        if (matches(offset, r)) {
+            invalidate_record(pfrm, offset, r);
+            if (not is_chained(r) and not is_entry(r)) {
+                ++result.count_;
+            }
+        }
+
+        return true;
+    });
+
+    result.bytes_freed_ = gap_space - gaps;
+
+    if (result.count_) {
+        __path_cache_destroy();
+        __path_cache_create(pfrm);
+    }
+
+    log(format("removed % files under %", result.count_, prefix).c_str());
+
+    return result;
+}
+
+
+
+// Invoke callback(offset, record) for each live record in the log between begin
+// and end, in the order that compaction should write them back: frequently read
+// files first, so that find_file() will reach them sooner, and then everything
+// else in log order.
+template <typename F>
+static void
+visit_relocations(Platform& pfrm, u32 begin, u32 end, F&& callback)
+{
+    struct HotRecord
+    {
+        u16 count_;
+        u32 offset_;
+    };
+    Buffer<HotRecord, access_counter_count> hot;
+
+    auto offset = begin;
+    while (offset < end) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        if (r.file_info_.name_length_ == 0xff) {
+            break;
+        }
+
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            char file_name[256];
+            read_name(pfrm, offset, r, file_name);
+
+            const auto count = __access_count(access_counters, file_name);
+            if (count and not hot.full()) {
+                auto pos = hot.begin();
+                while (pos not_eq hot.end() and pos->count_ >= count) {
+                    ++pos;
+                }
+                hot.insert(pos, {count, offset});
+            }
+        }
+
+        offset += r.full_size();
+    }
+
+    for (auto& h : hot) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, h.offset_);
+
+        // NOTE: the callback may have invalidated the record in the meantime.
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            callback(h.offset_, r);
+        }
+    }
+
+    offset = begin;
+    while (offset < end) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        if (r.file_info_.name_length_ == 0xff) {
+            break;
+        }
+
+        if (r.invalidate_.get() == Record::InvalidateStatus::valid) {
+            bool is_hot = false;
+            for (auto& h : hot) {
+                if (h.offset_ == offset) {
+                    is_hot = true;
+                    break;
+                }
+            }
+
+            if (not is_hot) {
+                callback(offset, r);
+            }
+        }
+
+        offset += r.full_size();
+    }
+}
+
+
+
+// Write data to erased save memory, skipping halfwords equal to 0xffff. An
+// erased halfword already holds that value, and some flash chips do not allow
+// us to write the same address twice, which matters for the invalidate fields
+// of the records that we copy during compaction.
+static void
+write_programmed(Platform& pfrm, const u8* data, u32 length, u32 offset)
+{
+    u32 run = 0;
+    for (u32 i = 0; i < length; i += 2) {
+        if (data[i] == 0xff and data[i + 1] == 0xff) {
+            if (i > run) {
+                pfrm.write_save_data(data + run, i - run, offset + run);
+            }
+            run = i + 2;
+        }
+    }
+    if (length > run) {
+        pfrm.write_save_data(data + run, length - run, offset + run);
+    }
+}
+
+
+
+// Compact the log without staging all of the relocated records at once, using
+// a buffer of at least one erase unit. Because compaction only ever moves
+// records toward the beginning of the log, by the time we erase a chunk of save
+// memory, every live byte that we read from it fits in the erased space behind
+// the write offset. So we read a chunk's live bytes into the buffer, erase the
+// chunk, and write them back out, one chunk at a time. Records stay in log
+// order.
+static void
+compact_streaming(Platform& pfrm, u32 erase_begin, u8* buffer, u32 size)
+{
+    const u32 unit = pfrm.save_erase_unit();
+    const u32 step = size - size % unit;
+
+    // Find the record containing the first erased byte. We know that it's
+    // live, because erase_begin lies in front of the first gap.
+    u32 src = log_begin();
+    u32 record_end = src;
+    while (record_end <= erase_begin and record_end < end_offset) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, record_end);
+        src = record_end;
+        record_end += r.full_size();
+    }
+
+    if (src < erase_begin) {
+        // Record straddles erase_begin. We still need to copy its tail.
+        src = erase_begin;
+    } else {
+        record_end = src;
+    }
+
+    bool live = true;
+
+    u32 write_offset = erase_begin;
+
+    // NOTE: erase_begin may fall partway into an erase unit, if the unit holds
+    // the root. The caller rewrites the root afterwards.
+    for (u32 chunk = erase_begin - erase_begin % unit; chunk < end_offset;
+         chunk += step) {
+        const u32 chunk_end = chunk + step;
+
+        u32 fill = 0;
+        while (src < chunk_end and src < end_offset) {
+            if (src == record_end) {
+                Record r;
+                pfrm.read_save_data(&r, sizeof r, src);
+
+                if (r.file_info_.name_length_ == 0xff) {
+                    src = end_offset;
+                    break;
+                }
+
+                record_end = src + r.full_size();
+                live = r.invalidate_.get() == Record::InvalidateStatus::valid;
+            }
+
+            const u32 count =
+                (record_end < chunk_end ? record_end : chunk_end) - src;
+
+            if (live) {
+                pfrm.read_save_data(buffer + fill, count, src);
+                fill += count;
+            }
+
+            src += count;
+        }
+
+        const u32 erase_end = chunk_end < end_offset ? chunk_end : end_offset;
+        pfrm.erase_save_range(chunk, erase_end - chunk);
+
+        write_programmed(pfrm, buffer, fill, write_offset);
+        write_offset += fill;
+    }
+
+    end_offset = write_offset;
+    gap_space = 0;
+}
+
+
+
+// Compaction only needs to rewrite the log starting from the first dead
+// record. Everything in front of it is already packed, so we leave it alone, and
+// only erase the erase units from the gap onward. The live records behind the
+// first gap get copied into the scratch arena (or ram allocated from the heap,
+// if we weren't given an arena), and written back after the erase. When full is
+// set, we erase the whole save media and rewrite everything, like we used to.
+static void compact_single(Platform& pfrm, bool full)
+{
+    const auto begin = log_begin();
+    const u32 unit = pfrm.save_erase_unit();
+
+    // Find the first dead record. Records in front of it will stay where they
+    // are.
+    auto offset = begin;
+    while (offset < end_offset) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        if (r.file_info_.name_length_ == 0xff or
+            r.invalidate_.get() not_eq Record::InvalidateStatus::valid) {
+            break;
+        }
+
+        offset += r.full_size();
+    }
+
+    const u32 keep_end = offset;
+
+    u32 erase_begin = keep_end - keep_end % unit;
+
+    // If the first gap falls within the erase unit holding the root, we'll
+    // need to write the root back after erasing.
+    const bool rewrite_root = full or erase_begin < begin;
+    if (rewrite_root) {
+        erase_begin = begin;
+    }
+
+    if (not full and keep_end >= end_offset) {
+        log("flash fs compaction found no gaps!");
+        return;
+    }
+
+    // All of the gaps lie behind keep_end, so we know exactly how much we need
+    // to stage.
+    const u32 staged_size = (end_offset - erase_begin) - gap_space;
+
+    const bool use_arena = scratch_arena and scratch_arena_size >= staged_size;
+
+    // NOTE: streaming copies renamed files as they are, and would leave the
+    // rename records pointing at the files' old offsets.
+    if (scratch_arena and not use_arena and not full and
+        scratch_arena_size >= unit and renamed_files.empty()) {
+        // NOTE: streaming copies patches as they are, rather than applying
+        // them. Reads still apply them, and the next store that finds a full
+        // chain of patches will rewrite the file.
+        log("flash fs compaction exceeds scratch arena, streaming...");
+        compact_streaming(pfrm, erase_begin, scratch_arena, scratch_arena_size);
+        if (rewrite_root) {
+            if (not legacy_root) {
+                ++erase_counts[0];
+            }
+            init_root(pfrm);
+        }
+        return;
+    }
+
+    Vector<char> data;
+    u32 staged = 0;
+
+    // NOTE: compaction never grows anything, so the staged records should fit
+    // in the space that they came from. But if we got the size of the gaps
+    // wrong, better to give up than to overrun the arena, or the log.
+    bool overflow = false;
+
+    // Copy a range of save memory to the end of the staged data.
+    auto stage = [&](u32 offset, u32 length) {
+        if (use_arena and staged + length > scratch_arena_size) {
+            overflow = true;
+            return;
+        }
+        if (use_arena) {
+            pfrm.read_save_data(scratch_arena + staged, length, offset);
+        } else {
+            u8 buffer[64];
+            for (u32 i = 0; i < length; i += sizeof buffer) {
+                const u32 count = length - i < sizeof buffer ? length - i
+                                                             : sizeof buffer;
+                pfrm.read_save_data(buffer, count, offset + i);
+                for (u32 j = 0; j < count; ++j) {
+                    data.push_back(buffer[j]);
+                }
+            }
+        }
+        staged += length;
+    };
+
+    offset = begin;
+    while (offset < erase_begin) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        const auto record_end = offset + r.full_size();
+
+        if (record_end > erase_begin) {
+            // The record straddles the start of the first erased unit. Its
+            // header survives the erase, so we only need to copy back the
+            // tail.
+            stage(erase_begin, record_end - erase_begin);
+        }
+
+        offset = record_end;
+    }
+
+    auto stage_bytes = [&](const u8* bytes, u32 length) {
+        if (use_arena and staged + length > scratch_arena_size) {
+            overflow = true;
+            return;
+        }
+        for (u32 i = 0; i < length; ++i) {
+            if (use_arena) {
+                scratch_arena[staged + i] = bytes[i];
+            } else {
+                data.push_back(bytes[i]);
+            }
+        }
+        staged += length;
+    };
+
+    const u32 relocate_begin = offset;
+
+    // NOTE: we copy each record verbatim, including the blank invalidate
+    // field, which write_programmed() will skip over when writing the record
+    // back. Except that we merge patches and extents into the records that
+    // they belong to, and leave them behind, and likewise with renames, unless
+    // the renamed file stays where it is. See find_base() for compressed
+    // files.
+    visit_relocations(pfrm, offset, end_offset, [&](u32 offset, Record r) {
+        if (not renamed_files.empty()) {
+            const int rename = renamed_by(offset);
+            if (rename not_eq -1) {
+                emit_renamed(pfrm, offset, r, rename, stage_bytes);
+                return;
+            }
+
+            const int target = rename_offset(pfrm, offset, r);
+            if (target not_eq -1) {
+                if (target < (int)relocate_begin and
+                    renamed_target(offset) == target) {
+                    stage(offset, r.full_size());
+                }
+                return;
+            }
+        }
+
+        if (not patch_records and not extent_records) {
+            stage(offset, r.full_size());
+            return;
+        }
+
+        if (is_chained(r)) {
+            // We can only merge the record if we're relocating the file's
+            // original record, otherwise we keep it.
+            Record base;
+            const auto base_offset = find_base(pfrm, offset, r, base);
+            if (base_offset not_eq -1 and
+                ((u32)base_offset < relocate_begin or is_compressed(base))) {
+                stage(offset, r.full_size());
+            }
+            return;
+        }
+
+        Chains chains;
+        if (not is_compressed(r)) {
+            collect_chains(pfrm, offset, r, chains);
+        }
+        if (chains.empty()) {
+            stage(offset, r.full_size());
+        } else {
+            emit_merged(pfrm, offset, r, chains, stage_bytes);
+        }
+    });
+
+    if (overflow or erase_begin + staged > region_end) {
+        log("flash fs compaction doesn't fit, giving up!");
+        return;
+    }
+
+    if (full) {
+        pfrm.erase_save_sector();
+    } else {
+        // Bytes past the end of the log are still erased, no need to touch
+        // them.
+        pfrm.erase_save_range(erase_begin, end_offset - erase_begin);
+    }
+
+    if (rewrite_root and not legacy_root) {
+        ++erase_counts[0];
+    }
+
+    u32 write_offset = erase_begin;
+
+    if (use_arena) {
+        write_programmed(pfrm, scratch_arena, staged, write_offset);
+        write_offset += staged;
+    } else {
+        u8 buffer[64];
+        for (u32 i = 0; i < staged; i += sizeof buffer) {
+            const u32 count =
+                staged - i < sizeof buffer ? staged - i : sizeof buffer;
+            for (u32 j = 0; j < count; ++j) {
+                buffer[j] = data[i + j];
+            }
+            write_programmed(pfrm, buffer, count, write_offset);
+            write_offset += count;
+        }
+    }
+
+    end_offset = write_offset;
+    gap_space = 0;
+
+    if (rewrite_root) {
+        init_root(pfrm);
+    }
+}
+
+
+
+// The size of the copy of a live record that copy_record() writes.
+static u32 copied_size(Platform& pfrm,
+                       u32 src,
+                       const Record& r,
+                       const Chains& chains)
+{
+    u32 size = r.full_size();
+    if (not chains.empty()) {
+        const u32 length = merged_length(pfrm, src, r, chains);
+        size = sizeof r + r.file_info_.name_length_ + length + length % 2;
+    }
+
+    // The copy takes the name of the rename record.
+    const int rename = renamed_by(src);
+    if (rename not_eq -1) {
+        Record renamer;
+        pfrm.read_save_data(&renamer, sizeof renamer, rename);
+        size += renamer.file_info_.name_length_;
+        size -= r.file_info_.name_length_;
+    }
+
+    return size;
+}
+
+
+
+// Copy a live record to erased save memory at dest, leaving the invalidate
+// field blank. If the file has patches or extents, we write a copy with them
+// merged in, and the caller should invalidate them afterwards. Likewise, a
+// renamed file gets copied under its new name. Returns the offset following the
+// copy.
+static u32 copy_record(Platform& pfrm,
+                       u32 src,
+                       u32 dest,
+                       const Record& r,
+                       const Chains& chains)
+{
+    const int rename = renamed_by(src);
+
+    if (not chains.empty() or rename not_eq -1) {
+        Buffer<u8, 64> queue;
+
+        auto flush = [&] {
+            write_programmed(pfrm, queue.data(), queue.size(), dest);
+            dest += queue.size();
+            queue.clear();
+        };
+
+        auto emit = [&](const u8* bytes, u32 length) {
+            for (u32 i = 0; i < length; ++i) {
+                if (queue.full()) {
+                    flush();
+                }
+                queue.push_back(bytes[i]);
+            }
+        };
+
+        if (rename not_eq -1) {
+            emit_renamed(pfrm, src, r, rename, emit);
+        } else {
+            emit_merged(pfrm, src, r, chains, emit);
+        }
+
+        flush();
+
+        return dest;
+    }
+
+    static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
+    // Leave the invalidate bytes blank.
+    dest += 2;
+
+    pfrm.write_save_data(&r.file_info_, sizeof r.file_info_, dest);
+    dest += sizeof r.file_info_;
+
+    src += sizeof r;
+
+    u8 local_buffer[64];
+    u8* buffer = local_buffer;
+    u32 buffer_size = sizeof local_buffer;
+    if (scratch_arena_size > buffer_size) {
+        buffer = scratch_arena;
+        // NOTE: write_programmed() works in halfwords.
+        buffer_size = scratch_arena_size - scratch_arena_size % 2;
+    }
+
+    // NOTE: skip blank halfwords, so that we can still program the record's
+    // update slots.
+    u32 remaining = r.appended_size();
+    while (remaining) {
+        const auto count = remaining < buffer_size ? remaining : buffer_size;
+        pfrm.read_save_data(buffer, count, src);
+        write_programmed(pfrm, buffer, count, dest);
+        src += count;
+        dest += count;
+        remaining -= count;
+    }
+
+    return dest;
+}
+
+
+
+// With the dual layout, we never need to stage anything in ram. Erase the
+// inactive region, copy the live records into it, and then write its root with
+// the next generation number, which makes it current. Until the root is
+// written, the old region remains current, so losing power partway through
+// leaves us with the log as it was before compaction.
+static void compact_dual(Platform& pfrm)
+{
+    u32 regions[2];
+    u32 size;
+    dual_regions(pfrm, media_offset, regions, size);
+
+    const auto target = start_offset == regions[0] ? regions[1] : regions[0];
+
+    if (not spare_erased) {
+        pfrm.erase_save_range(target, size);
+        ++erase_counts[target not_eq regions[0]];
+    }
+    spare_erased = false;
+
+    u32 write_offset = target + sizeof(DualRoot);
+
+    bool overflow = false;
+
+    // NOTE: copy_record() merges patches and extents into the records that
+    // they belong to, and renames files, so we leave them and the rename
+    // records behind. See find_base() for compressed files.
+    visit_relocations(
+        pfrm, log_begin(), end_offset, [&](u32 offset, Record r) {
+            if (overflow or rename_offset(pfrm, offset, r) not_eq -1) {
+                return;
+            }
+
+            Chains chains;
+            if (is_chained(r)) {
+                Record base;
+                if (find_base(pfrm, offset, r, base) == -1 or
+                    not is_compressed(base)) {
+                    return;
+                }
+            } else if (not is_compressed(r)) {
+                collect_chains(pfrm, offset, r, chains);
+            }
+
+            if (write_offset + copied_size(pfrm, offset, r, chains) >
+                target + size) {
+                overflow = true;
+                return;
+            }
+
+            write_offset = copy_record(pfrm, offset, write_offset, r, chains);
+        });
+
+    if (overflow) {
+        // The old region is still current, we just can't count on the spare
+        // region being erased anymore.
+        log("flash fs compaction doesn't fit, giving up!");
+        return;
+    }
+
+    start_offset = target;
+    region_end = target + size;
+    end_offset = write_offset;
+    gap_space = 0;
+
+    ++generation;
+    init_root(pfrm);
+}
+
+
+
+// Whether we've seen a file written often enough, compared to the most
+// frequently written file, that we should expect it to be rewritten again soon.
+static Temperature __write_temperature(const char* path)
+{
+    u16 max = 0;
+    for (auto& c : write_counters) {
+        max = c.count_ > max ? c.count_ : max;
+    }
+
+    const auto count = __access_count(write_counters, path);
+
+    return count >= 2 and count * 8 >= max ? hot : cold;
+}
+
+
+
+// Free segments that are ready to write to.
+static int free_segments()
+{
+    int result = 0;
+    for (u32 i = 0; i < segments.size(); ++i) {
+        if (segments[i].sequence_ == 0 and not erase_pending(i)) {
+            ++result;
+        }
+    }
+    return result;
+}
+
+
+
+static bool segment_fits(int index, u32 size)
+{
+    return index not_eq -1 and
+           segment_begin(index) + segments[index].fill_ + size <=
+               segment_end(index);
+}
+
+
+
+// Copy a record to the end of the current cold segment, opening a new segment
+// if it doesn't fit. Like F2FS, we treat files that survive cleaning as cold.
+static bool
+relocate_record(Platform& pfrm, u32 src, const Record& r, const Chains& chains)
+{
+    auto& active = active_segments[cold];
+
+    const u32 size = copied_size(pfrm, src, r, chains);
+
+    // The copy takes the place in the index of the rename record.
+    const int rename = renamed_by(src);
+
+    if (not segment_fits(active, size)) {
+        if (not open_segment(pfrm, cold)) {
+            return false;
+        }
+    }
+
+    auto& s = segments[active];
+    const auto begin = segment_begin(active);
+
+    for (auto& offset : slotted_files) {
+        if (offset == src) {
+            offset = begin + s.fill_;
+        }
+    }
+
+    for (auto& d : directories) {
+        if (d.offset_ == src) {
+            d.offset_ = begin + s.fill_;
+        }
+    }
+
+    for (auto& entry : file_index) {
+        const u32 offset = entry & index_offset_mask;
+        if (offset == src or (int)offset == rename) {
+            entry = (entry & ~index_offset_mask) | (begin + s.fill_);
+        }
+    }
+
+    s.fill_ = copy_record(pfrm, src, begin + s.fill_, r, chains) - begin;
+
+    // NOTE: the caller invalidates the original, which uncounts it, so count
+    // the copy, or searches that skip the log when a count drops to zero won't
+    // find it. A merged copy is never compressed, see find_base().
+    compressed_savings += compression_savings(pfrm, src, r);
+
+    if (is_reference(r)) {
+        ++reference_records;
+    } else if (is_pack(r)) {
+        ++pack_records;
+    }
+
+    if (is_patch(r)) {
+        ++patch_records;
+    } else if (is_extent(r)) {
+        ++extent_records;
+    } else if (is_entry(r)) {
+        ++entry_records;
+    }
+
+    return true;
+}
+
+
+
+// Relocate a live record, and invalidate the original. For a patch or an
+// extent, we rewrite the whole file instead, with everything merged in, except
+// for a compressed file, see find_base().
+static bool relocate_file(Platform& pfrm, u32 offset, Record r)
+{
+    if (rename_offset(pfrm, offset, r) not_eq -1) {
+        const int target = renamed_target(offset);
+        if (target == -1) {
+            // We lost power after invalidating the renamed file.
+            invalidate_record(pfrm, offset, r);
+            return true;
+        }
+        offset = target;
+        pfrm.read_save_data(&r, sizeof r, offset);
+    }
+
+    const int rename = renamed_by(offset);
+    if (rename not_eq -1) {
+        if (not relocate_record(pfrm, offset, r, {})) {
+            return false;
+        }
+
+        // NOTE: takes the renamed file's original record along with it.
+        Record renamer;
+        pfrm.read_save_data(&renamer, sizeof renamer, rename);
+        invalidate_record(pfrm, rename, renamer);
+        return true;
+    }
+
+    char file_name[256];
+    read_name(pfrm, offset, r, file_name);
+
+    if (is_chained(r)) {
+        Record base;
+        const auto base_offset = find_file(pfrm, file_name, base);
+        if (base_offset == -1) {
+            // We lost power while unlinking the file, after invalidating its
+            // original record, but before getting to the rest of the chain.
+            invalidate_record(pfrm, offset, r);
+            return true;
+        }
+        if (not is_compressed(base)) {
+            offset = base_offset;
+            r = base;
+        }
+    }
+
+    if (is_compressed(r) or is_chained(r)) {
+        if (not relocate_record(pfrm, offset, r, {})) {
+            return false;
+        }
+        invalidate_record(pfrm, offset, r);
+        return true;
+    }
+
+    Chains chains;
+    collect_chains(pfrm, file_name, chains);
+
+    if (not relocate_record(pfrm, offset, r, chains)) {
+        return false;
+    }
+
+    invalidate_record(pfrm, offset, r);
+    unlink_chains(pfrm, file_name);
+
+    return true;
+}
+
+
+
+// Copy the live records out of a segment, and queue it to be erased. We
+// invalidate each record after copying it, so if we lose power before erasing
+// the segment, it won't hold any live files, and if we lose power partway
+// through, we'll just have two copies of a file, with identical contents.
+static bool clean_segment(Platform& pfrm, int index)
+{
+    ++record_moves;
+
+    auto& s = segments[index];
+    const auto begin = segment_begin(index);
+
+    for (auto& active : active_segments) {
+        if (active == index) {
+            active = -1;
+        }
+    }
+
+    bool success = true;
+
+    visit_relocations(pfrm,
+                      begin + sizeof(SegmentHeader),
+                      begin + s.fill_,
+                      [&](u32 offset, Record r) {
+                          if (success) {
+                              success = relocate_file(pfrm, offset, r);
+                          }
+                      });
+
+    if (not success) {
+        log("flash fs ran out of segments while cleaning!");
+        return false;
+    }
+
+    gap_space -= s.dead_;
+    s = {0, 0, 0};
+
+    remove_from_order(index);
+
+    erase_queue.push_back(index);
+
+    return true;
+}
+
+
+
+static void erase_next_segment(Platform& pfrm)
+{
+    const auto index = erase_queue.front();
+    erase_queue.pop_front();
+    erase_segment(pfrm, index);
+}
+
+
+
+// Pick a segment to clean. Like LFS, we weigh the space that cleaning a segment
+// would free up against the cost of reading and rewriting its live records, and
+// favor older segments, whose live files have proven less likely to change:
+//
+//   benefit / cost = free * age / (capacity + live)
+//
+// Returns -1 if nothing is worth cleaning.
+static int clean_victim()
+{
+    if (segment_order.empty()) {
+        return -1;
+    }
+
+    // Files that never change would otherwise pin their segments forever, and
+    // the rest of the segments would wear out faster. So once the oldest
+    // segment has sat untouched for two trips around the save media, clean it,
+    // even if everything in it is live, or we're still appending to it.
+    const int oldest = segment_order[0];
+    if (generation - segments[oldest].sequence_ >= 2 * segments.size()) {
+        return oldest;
+    }
+
+    int victim = -1;
+    u64 best = 0;
+
+    for (auto index : segment_order) {
+        const auto& s = segments[index];
+        if (is_active(index) or s.dead_ == 0) {
+            continue;
+        }
+
+        const u32 capacity = segment_end(index) - segment_begin(index);
+        const u32 live = s.fill_ - s.dead_;
+        const u32 age = generation - s.sequence_ + 1;
+
+        const u64 score = u64(capacity - live) * age * 256 / (capacity + live);
+        if (victim == -1 or score > best) {
+            victim = index;
+            best = score;
+        }
+    }
+
+    return victim;
+}
+
+
+
+// Make room for a record of the given size at the end of the current segment
+// for the given temperature, opening and cleaning segments as needed. Points
+// end_offset and region_end at the segment.
+static bool segment_reserve(Platform& pfrm, u32 size, Temperature temperature)
+{
+    // The first segment may be a bit smaller than the others.
+    if (size > segment_end(0) - segment_begin(0) - sizeof(SegmentHeader)) {
+        return false;
+    }
+
+    for (u32 attempts = 0; attempts <= 2 * segments.size(); ++attempts) {
+        const int active = active_segments[temperature];
+        if (segment_fits(active, size)) {
+            end_offset = segment_begin(active) + segments[active].fill_;
+            region_end = segment_end(active);
+            return true;
+        }
+
+        // Keep one free segment in reserve, so that we always have somewhere to
+        // copy live records while cleaning.
+        if (free_segments() > 1) {
+            open_segment(pfrm, temperature);
+            continue;
+        }
+
+        if (not erase_queue.empty()) {
+            // Nobody called idle() since we last cleaned a segment. We'll have
+            // to wait for the erase after all.
+            erase_next_segment(pfrm);
+            continue;
+        }
+
+        const int victim = clean_victim();
+        if (victim == -1 or not clean_segment(pfrm, victim)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+
+
+// Clean every segment holding dead records. If a current segment holds dead
+// records, we close it, so that we can clean it too.
+static void compact_segmented(Platform& pfrm)
+{
+    for (auto& active : active_segments) {
+        if (active not_eq -1 and segments[active].dead_) {
+            active = -1;
+        }
+    }
+
+    // Merge any patches and extents into the files that they belong to.
+    while (patch_records or extent_records) {
+        int found = -1;
+        Record patch;
+        visit_log(pfrm, [&](u32 offset, const Record& r) {
+            Record base;
+            if (r.invalidate_.get() == Record::InvalidateStatus::valid and
+                is_chained(r) and
+                (find_base(pfrm, offset, r, base) == -1 or
+                 not is_compressed(base))) {
+                found = offset;
+                patch = r;
+                return false;
+            }
+            return true;
+        });
+
+        if (found == -1 or not relocate_file(pfrm, found, patch)) {
+            break;
+        }
+    }
+
+    auto order = segment_order;
+    for (auto index : order) {
+        if (not is_active(index) and segments[index].dead_) {
+            clean_segment(pfrm, index);
+        }
+    }
+}
+
+
+
+bool idle(Platform& pfrm)
+{
+    if (layout == dual_log) {
+        if (not spare_erased) {
+            u32 regions[2];
+            u32 size;
+            dual_regions(pfrm, media_offset, regions, size);
+
+            const int spare = start_offset == regions[0];
+            pfrm.erase_save_range(regions[spare], size);
+            ++erase_counts[spare];
+            spare_erased = true;
+        }
+        return false;
+    }
+
+    if (layout not_eq segmented_log) {
+        return false;
+    }
+
+    if (not erase_queue.empty()) {
+        erase_next_segment(pfrm);
+        return true;
+    }
+
+    // We're down to the segment that we keep in reserve, so the next write to
+    // fill up a segment would need to clean one. Get it out of the way now.
+    // Cleaning a segment with nothing dead in it wouldn't get us a free
+    // segment, so leave those to the write path.
+    if (free_segments() <= 1) {
+        const int victim = clean_victim();
+        if (victim not_eq -1 and segments[victim].dead_ and
+            clean_segment(pfrm, victim)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+static void compact(Platform& pfrm, bool full)
+{
+    log("flash fs start compaction...");
+
+    ++record_moves;
+
+    // NOTE: records move around underneath the index while compacting, so
+    // search the log until index_records() rebuilds it.
+    index_complete = false;
+
+    if (layout == dual_log) {
+        compact_dual(pfrm);
+    } else if (layout == segmented_log) {
+        compact_segmented(pfrm);
+    } else {
+        compact_single(pfrm, full);
+    }
+
+    index_records(pfrm);
+
+    log("flash fs completed compaction!");
+}
+
+
+
+static int batch_write(Platform& pfrm,
+                       u32& offset,
+                       Vector<char>::iterator begin,
+                       Vector<char>::iterator end)
+{
+    constexpr int batch_size = 64;
+
+    Buffer<u8, batch_size> queue;
+
+    int errors = 0;
+
+    auto flush = [&] {
+        if (queue.empty()) {
+            return;
+        }
+        bool success = pfrm.write_save_data(queue.data(), queue.size(), offset);
+
+        if (not success) {
+            ++errors;
+        }
+
+        offset += queue.size();
+        queue.clear();
+    };
+
+    while (begin not_eq end) {
+        if (queue.full()) {
+            flush();
+        }
+
+        queue.push_back(*begin);
+        ++begin;
+
+        // NOTE: the log is blank past its end, so we can skip blank halfwords,
+        // which leaves them programmable later on, see fill_slot().
+        const auto size = queue.size();
+        if (size % 2 == 0 and queue[size - 2] == 0xff and
+            queue[size - 1] == 0xff) {
+            queue.pop_back();
+            queue.pop_back();
+            flush();
+            offset += 2;
+        }
+    }
+
+    flush();
+
+    return errors;
+}
+
+
+
+// Whether the file at path already holds data. Expects data padded to a
+// multiple of two, as store_file_data() writes it.
+static bool file_unchanged(Platform& pfrm,
+                           const char* path,
+                           Vector<char>& data,
+                           bool data_padding)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return false;
+    }
+
+    Record r;
+    auto offset = resolve_reference(pfrm, find_file(pfrm, path, r), r);
+
+    PackMember member;
+    if (offset == -1 and find_packed(pfrm, path, r, member) not_eq -1) {
+        if (member.length_ not_eq data.size() - data_padding) {
+            return false;
+        }
+
+        u8 buffer[64];
+        for (u32 pos = 0; pos < member.length_; pos += sizeof buffer) {
+            const u32 count = member.length_ - pos < sizeof buffer
+                                  ? member.length_ - pos
+                                  : sizeof buffer;
+            pfrm.read_save_data(buffer, count, member.data_offset_ + pos);
+            for (u32 i = 0; i < count; ++i) {
+                if (buffer[i] not_eq (u8)data[pos + i]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    if (offset == -1 or is_circular(r) or slot_count(r)) {
+        return false;
+    }
+
+    Chains chains;
+    collect_chains(pfrm, path, chains);
+
+    if (merged_length(pfrm, offset, r, chains) not_eq
+        data.size() - data_padding) {
+        return false;
+    }
+
+    // NOTE: the record's crc doesn't account for patches or extents, and
+    // covers the compressed data of a compressed record.
+    if (chains.empty() and not is_compressed(r)) {
+        u8 crc8 = 0;
+        for (char c : data) {
+            crc8 = crc8_table[((u8)c) ^ crc8];
+        }
+
+        if (crc8 not_eq r.file_info_.crc_) {
+            return false;
+        }
+    }
+
+    // The crc is only eight bits, so we could easily see a collision. Compare
+    // the data to make sure.
+    u8 buffer[64];
+    auto it = data.begin();
+    bool equal = true;
+    read_chunks(
+        pfrm, offset, r, chains, buffer, sizeof buffer, [&](u8* b, u32 n) {
+            for (u32 i = 0; i < n and equal; ++i) {
+                equal = (u8)*it++ == b[i];
+            }
+        });
+
+    return equal;
+}
+
+
+
+// Append a record to the end of the log, where the caller has made room for
+// it. The payload must have an even size, and if flags1 holds a slot count, end
+// with that many blank update slots, or hold that many FileSlots, if flags say
+// it's a slotted file. Returns the number of failed writes.
+static int append_record(Platform& pfrm,
+                         const char* path,
+                         u8 flags,
+                         Vector<char>& payload,
+                         u8 flags1 = 0)
+{
+    char name[256];
+    if (encode_name(pfrm, path, name)) {
+        path = name;
+    }
+
+    const auto path_len = str_len(path);
+    const auto path_total = path_len + path_len % 2;
+
+    Record r;
+    auto& info = r.file_info_;
+    info.name_length_ = path_total;
+    info.data_length_.set(payload.size());
+    info.flags_[0] = flags;
+    info.flags_[1] = flags1;
+
+    u8 crc8 = 0;
+    for (u32 i = 0; i < checked_length(r); ++i) {
+        crc8 = crc8_table[((u8)payload[i]) ^ crc8];
+    }
+    info.crc_ = crc8;
+
+    static_assert(sizeof(Record) == sizeof(Record::FileInfo) + 2);
+    // Skip the invalid bytes, which we don't want to write yet.
+    u32 off = end_offset + 2;
+
+    int write_errors = 0;
+
+    if (not pfrm.write_save_data(&info, sizeof info, off)) {
+        ++write_errors;
+    }
+    off += sizeof info;
+
+    char file_name[256];
+    memset(file_name, 0, 256);
+    memcpy(file_name, path, path_len);
+
+    if (not pfrm.write_save_data(file_name, path_total, off)) {
+        ++write_errors;
+    }
+    off += path_total;
+
+    write_errors += batch_write(pfrm, off, payload.begin(), payload.end());
+
+    compressed_savings += compression_savings(pfrm, end_offset, r);
+
+    if (is_reference(r)) {
+        ++reference_records;
+    } else if (is_pack(r)) {
+        ++pack_records;
+    }
+
+    const u32 offset = end_offset;
+
+    end_offset = off;
+
+    if (layout == segmented_log) {
+        // NOTE: segment_reserve() pointed region_end at the segment.
+        const auto index = segment_of(region_end - 1);
+        segments[index].fill_ = end_offset - segment_begin(index);
+    }
+
+    index_file(pfrm, offset, r);
+
+    return write_errors;
+}
+
+
+
+// Write errors indicate that a simultaneous writeback to flash did not work
+// correctly. The data is still stored correctly in SRAM, so future calls to
+// Platform::read_save_data() will work correctly. However, we do want the data
+// to be persisted correctly in flash, so let's try running a compaction
+// operation, which erases the flash chip and writes sram contents back to the
+// flash device. Hopefully doing this will free up any stuck bits. Call this
+// after append_record(), once we're done updating our own bookkeeping, as
+// compaction moves records around.
+static void recover_write_errors(Platform& pfrm, int write_errors)
+{
+    if (write_errors) {
+        log("bad flash checksum detected, rewriting sector...");
+        compact(pfrm, true);
+    }
+}
+
+
+
+// Make room at the end of the log for a record of the given size: with the
+// segmented layout, in the current segment for the given temperature, see
+// segment_reserve(). Otherwise, if may_compact is set and squeezing out the
+// gaps would make enough room, we compact. When replacing a file, we count the
+// space that its record takes up toward the room that compaction would make,
+// and unlink it before compacting. Returns false if we don't have room.
+static bool reserve_space(Platform& pfrm,
+                          u32 required_space,
+                          Temperature temperature,
+                          bool may_compact = true,
+                          const char* replacing = nullptr)
+{
+    if (layout == segmented_log) {
+        return segment_reserve(pfrm, required_space, temperature);
+    }
+
+    const auto avail_space = sector_avail(pfrm) - sizeof(Record);
+    if (required_space < avail_space) {
+        return true;
+    }
+
+    // NOTE: the record's size in the log, which for a compressed file, or a
+    // reference, is less than the size of the file. A packed file has no
+    // record of its own, and unlinking it from its pack doesn't free up any
+    // space, see unlink_packed().
+    u32 existing_size = 0;
+    Record existing;
+    if (replacing and find_file(pfrm, replacing, existing) not_eq -1) {
+        existing_size = existing.full_size();
+    }
+
+    if (not may_compact or
+        avail_space + gap_space + existing_size <= required_space) {
+        // NOTE: don't unlink the file that we're replacing, we don't have
+        // enough space to store the replacement.
+        return false;
+    }
+
+    if (replacing) {
+        // We counted the size of the file that we're overwriting toward the
+        // available space total. So we have to unlink it.
+        unlink_file(pfrm, replacing);
+    }
+
+    compact(pfrm);
+
+    // NOTE: compaction gives up if its copies wouldn't fit.
+    return required_space < sector_avail(pfrm) - sizeof(Record);
+}
+
+
+
+// Store only the parts of a file that changed, as a patch record. Returns false
+// if the file would be better off rewritten in full: if it doesn't exist yet,
+// its size changed, it already has a full chain of patches, or most of it
+// changed. Expects data padded to a multiple of two.
+static bool store_patch(Platform& pfrm,
+                        const char* path,
+                        Vector<char>& data,
+                        bool data_padding)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return false;
+    }
+
+    // NOTE: before finding the file, as detaching may compact the log.
+    if (not detach_references(pfrm, path)) {
+        return false;
+    }
+
+    Record r;
+    auto offset = find_file(pfrm, path, r);
+    if (offset == -1) {
+        return false;
+    }
+
+    if (r.file_info_.data_length_.get() not_eq data.size() or
+        is_padded(r) not_eq data_padding or is_circular(r) or
+        slot_count(r) or is_compressed(r) or is_reference(r)) {
+        return false;
+    }
+
+    Chains chains;
+    collect_chains(pfrm, path, chains);
+
+    // NOTE: patches only apply to the file's original record, not to its
+    // extents.
+    const auto& chain = chains.patches_;
+    if (chain.full() or not chains.extents_.empty()) {
+        return false;
+    }
+
+    Vector<char> patch;
+
+    auto push_u16 = [&](u16 value) {
+        host_u16 v;
+        v.set(value);
+        for (u32 i = 0; i < sizeof v; ++i) {
+            patch.push_back(((char*)&v)[i]);
+        }
+    };
+
+    push_u16(chain.empty() ? 1 : chain.back().sequence_ + 1);
+
+    const u32 limit = data.size() / 2;
+
+    u32 hunk_begin = 0;
+    u32 hunk_end = 0;
+
+    auto flush = [&] {
+        if (hunk_end == hunk_begin) {
+            return;
+        }
+        push_u16(hunk_begin);
+        push_u16(hunk_end - hunk_begin);
+        for (u32 i = hunk_begin; i < hunk_end; ++i) {
+            patch.push_back(data[i]);
+        }
+    };
+
+    // Compare a halfword at a time, to keep the hunks aligned. Unchanged runs
+    // shorter than a hunk header aren't worth splitting a hunk over.
+    const u32 data_offset = offset + sizeof r + r.file_info_.name_length_;
+
+    u8 buffer[64];
+    for (u32 pos = 0; pos < data.size(); pos += sizeof buffer) {
+        const u32 count = data.size() - pos < sizeof buffer ? data.size() - pos
+                                                            : sizeof buffer;
+        read_patched(pfrm, data_offset, chain, buffer, pos, count);
+
+        for (u32 i = 0; i < count; i += 2) {
+            if (buffer[i] == (u8)data[pos + i] and
+                buffer[i + 1] == (u8)data[pos + i + 1]) {
+                continue;
+            }
+
+            const u32 at = pos + i;
+            if (hunk_end not_eq hunk_begin and
+                at - hunk_end < sizeof(PatchHunk)) {
+                hunk_end = at + 2;
+            } else {
+                flush();
+                hunk_begin = at;
+                hunk_end = at + 2;
+            }
+        }
+
+        if (patch.size() + (hunk_end - hunk_begin) > limit) {
+            return false;
+        }
+    }
+
+    flush();
+
+    if (patch.size() == sizeof(host_u16)) {
+        // Nothing changed after all.
+        return true;
+    }
+
+    const auto path_len = str_len(path);
+    const auto path_total = path_len + path_len % 2;
+
+    const u32 required_space = patch.size() + path_total + sizeof(Record);
+
+    // NOTE: if we need to clean segments to make room, the cleaner may rewrite
+    // the file with its patches applied, but that doesn't change the contents
+    // that we diffed against. Otherwise, we let the caller rewrite the file,
+    // compacting if necessary.
+    if (not reserve_space(
+            pfrm, required_space, __write_temperature(path), false)) {
+        return false;
+    }
+
+    const auto write_errors =
+        append_record(pfrm, path, Record::FileInfo::Flags0::is_patch, patch);
+
+    ++patch_records;
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("patched %", path).c_str());
+
+    return true;
+}
+
+
+
+// Give the directory holding path an id, if it doesn't have one yet, and we
+// have room for it, so that records for files in the directory can refer to it
+// by id.
+static void make_directory(Platform& pfrm, const char* path)
+{
+    const u32 length = directory_length(path);
+    if (length < min_directory_length or directories.full() or
+        find_directory(pfrm, path) not_eq -1) {
+        return;
+    }
+
+    u8 id = 0;
+    for (auto& d : directories) {
+        if (d.id_ >= id) {
+            id = d.id_ + 1;
+        }
+    }
+
+    Vector<char> payload;
+    for (u32 i = 0; i < length; ++i) {
+        payload.push_back(path[i]);
+    }
+
+    u8 flags = 0;
+    if (length % 2) {
+        payload.push_back(0);
+        flags |= Record::FileInfo::Flags0::has_end_padding;
+    }
+
+    const u32 required_space = sizeof(Record) + 2 + payload.size();
+
+    // NOTE: not worth compacting over.
+    if (not reserve_space(pfrm, required_space, cold, false)) {
+        return;
+    }
+
+    const char name[] = {dir_record_tag, (char)(id + 1), '\0'};
+
+    const u32 offset = end_offset;
+    const auto write_errors = append_record(pfrm, name, flags, payload);
+
+    directories.push_back({offset, fnv32(path, length), id});
+
+    recover_write_errors(pfrm, write_errors);
+}
+
+
+
+// Write a file to the end of the log, replacing any existing file at path,
+// compacting first if we need the space. Expects data padded to a multiple of
+// two, with flags to match, see append_record().
+static bool write_file(Platform& pfrm,
+                       const char* path,
+                       Vector<char>& data,
+                       u8 flags,
+                       u8 flags1 = 0)
+{
+    auto path_len = str_len(path);
+    u8 path_padding = 0;
+    if (path_len % 2 not_eq 0) {
+        // Add an extra null byte to the end, to bring total size up to a
+        // multiple of two.
+        path_padding = 1;
+    }
+
+    const auto path_total = path_len + path_padding;
+
+    const u32 required_space = data.size() + path_total + sizeof(Record);
+
+    // NOTE: do these first, as they write records of their own.
+    if (not detach_references(pfrm, path)) {
+        return false;
+    }
+
+    make_directory(pfrm, path);
+
+    // NOTE: with the segmented layout, we need room for the new copy of the
+    // file before we can unlink the old one, so we don't count it toward the
+    // available space.
+    if (not reserve_space(
+            pfrm, required_space, __write_temperature(path), true, path)) {
+        return false;
+    }
+
+    unlink_file(pfrm, path);
+
+    const auto write_errors = append_record(pfrm, path, flags, data, flags1);
+
+    __path_cache_insert(path);
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("wrote %", path).c_str());
+
+    return true;
+}
+
+
+
+// Append a file's name to a reference's payload, padded like a record's name.
+static void push_reference(Vector<char>& payload, const char* file_name)
+{
+    const auto len = str_len(file_name);
+    for (u32 i = 0; i < len + len % 2; ++i) {
+        payload.push_back(i < len ? file_name[i] : 0);
+    }
+}
+
+
+
+// Append the data of the record at offset to payload, as it is in the log.
+static void
+read_payload(Platform& pfrm, u32 offset, const Record& r, Vector<char>& payload)
+{
+    u8 buffer[64];
+    u32 src = offset + sizeof r + r.file_info_.name_length_;
+    u32 remaining = r.file_info_.data_length_.get();
+    while (remaining) {
+        const u32 count = remaining < sizeof buffer ? remaining : sizeof buffer;
+        pfrm.read_save_data(buffer, count, src);
+        for (u32 i = 0; i < count; ++i) {
+            payload.push_back(buffer[i]);
+        }
+        src += count;
+        remaining -= count;
+    }
+}
+
+
+
+// Before we change or unlink the file at path, give the files that reference it
+// contents of their own: the first gets a copy of the file's record, and the
+// rest refer to the first. Returns false if we ran out of space.
+static bool detach_references(Platform& pfrm, const char* path)
+{
+    char first[256];
+    first[0] = '\0';
+
+    char file_name[256];
+    while (find_referrer(pfrm, path, file_name) not_eq -1) {
+        Vector<char> payload;
+        u8 flags = 0;
+        u8 flags1 = Record::FileInfo::Flags1::is_reference;
+
+        if (first[0] == '\0') {
+            Record r;
+            auto offset = find_file(pfrm, path, r);
+            if (offset == -1) {
+                return false;
+            }
+
+            // Copy the renamed file, rather than its rename record.
+            const int renamed = renamed_target(offset);
+            if (renamed not_eq -1) {
+                offset = renamed;
+                pfrm.read_save_data(&r, sizeof r, offset);
+            }
+
+            read_payload(pfrm, offset, r, payload);
+
+            flags = r.file_info_.flags_[0];
+            flags1 = r.file_info_.flags_[1];
+
+            memcpy(first, file_name, sizeof first);
+        } else {
+            push_reference(payload, first);
+        }
+
+        if (not write_file(pfrm, file_name, payload, flags, flags1)) {
+            return false;
+        }
+
+        log(format("detached % from %", file_name, path).c_str());
+    }
+
+    return true;
+}
+
+
+
+// Files smaller than this aren't worth searching the log for a duplicate.
+static constexpr const u32 dedup_min_length = 32;
+
+
+
+// Look for another file whose record holds exactly the payload that we're about
+// to store, flags and all, so that we can store a reference to it instead. Only
+// plain files qualify, without patches or extents. Writes the file's name to
+// file_name.
+static bool find_duplicate(Platform& pfrm,
+                           const char* path,
+                           Vector<char>& payload,
+                           u8 flags,
+                           u8 flags1,
+                           char* file_name)
+{
+    if (payload.size() < dedup_min_length) {
+        return false;
+    }
+
+    u8 crc8 = 0;
+    for (char c : payload) {
+        crc8 = crc8_table[((u8)c) ^ crc8];
+    }
+
+    bool found = false;
+
+    visit_log(pfrm, [&](u32 offset, const Record& r) {
+        const auto& info = r.file_info_;
+        if (r.invalidate_.get() not_eq Record::InvalidateStatus::valid or
+            info.crc_ not_eq crc8 or info.flags_[0] not_eq flags or
+            info.flags_[1] not_eq flags1 or
+            info.data_length_.get() not_eq payload.size() or
+            // NOTE: a reference holds the file's name, so it had better be
+            // smaller than the payload.
+            info.name_length_ >= payload.size() or
+            // NOTE: the file goes by a different name, see rename_file().
+            renamed_by(offset) not_eq -1) {
+            return true;
+        }
+
+        read_name(pfrm, offset, r, file_name);
+
+        if (file_name[0] == dir_record_tag or str_eq(path, file_name)) {
+            return true;
+        }
+
+        // The crc is only eight bits, so compare the data to make sure.
+        u8 buffer[64];
+        const u32 data_offset = offset + sizeof r + info.name_length_;
+        for (u32 pos = 0; pos < payload.size(); pos += sizeof buffer) {
+            const u32 count = payload.size() - pos < sizeof buffer
+                                  ? payload.size() - pos
+                                  : sizeof buffer;
+            pfrm.read_save_data(buffer, count, data_offset + pos);
+            for (u32 i = 0; i < count; ++i) {
+                if (buffer[i] not_eq (u8)payload[pos + i]) {
+                    return true;
+                }
+            }
+        }
+
+        Chains chains;
+        collect_chains(pfrm, file_name, chains);
+        if (not chains.empty()) {
+            return true;
+        }
+
+        found = true;
+        return false;
+    });
+
+    return found;
+}
+
+
+
+// Find a slotted file's record, without searching the log.
+static int find_slotted(Platform& pfrm, const char* path, Record& result)
+{
+    const PathKey key(pfrm, path);
+
+    for (auto offset : slotted_files) {
+        Record r;
+        pfrm.read_save_data(&r, sizeof r, offset);
+
+        char file_name[256];
+        memset(file_name, 0, 256);
+
+        pfrm.read_save_data(
+            &file_name, r.file_info_.name_length_, offset + sizeof r);
+
+        if (key.matches(file_name)) {
+            result = r;
+            return offset;
+        }
+    }
+
+    return -1;
+}
+
+
+
+// The slot size, and offset of the first slot, for the slotted file whose
+// record sits at offset.
+static u32 slot_size(Platform& pfrm, u32 offset, const Record& r, u32& slots)
+{
+    slots = offset + sizeof r + r.file_info_.name_length_;
+
+    host_u16 size;
+    pfrm.read_save_data(&size, sizeof size, slots);
+    slots += sizeof size;
+
+    return size.get();
+}
+
+
+
+// Find the slot holding the newest version of a slotted file, and the first
+// slot that we haven't claimed yet. Returns their offsets, or zero if there's
+// no such slot.
+static void find_slots(Platform& pfrm,
+                       u32 offset,
+                       const Record& r,
+                       u32& newest,
+                       u32& blank,
+                       FileSlot& newest_slot)
+{
+    u32 slots;
+    const u32 size = slot_size(pfrm, offset, r, slots);
+
+    newest = 0;
+    blank = 0;
+
+    for (u32 i = 0; i < slot_count(r); ++i) {
+        const u32 slot_offset = slots + i * (sizeof(FileSlot) + size);
+
+        FileSlot slot;
+        pfrm.read_save_data(&slot, sizeof slot, slot_offset);
+
+        if (slot.length_.get() == 0xffff) {
+            // We claim slots in order, so the rest are blank too.
+            blank = slot_offset;
+            return;
+        }
+
+        if (slot.sequence_.get() not_eq 0xffff and
+            (not newest or
+             slot.sequence_.get() > newest_slot.sequence_.get())) {
+            newest = slot_offset;
+            newest_slot = slot;
+        }
+    }
+}
+
+
+
+// Write a new record for a slotted file, with room for count versions of the
+// file, each up to size bytes, and the file's data in the first slot. Expects
+// data padded to a multiple of two.
+static bool write_slotted_file(Platform& pfrm,
+                               const char* path,
+                               Vector<char>& data,
+                               bool data_padding,
+                               u32 size,
+                               u8 count)
+{
+    if (size < data.size()) {
+        size = data.size();
+    }
+
+    const u32 length = sizeof(host_u16) + count * (sizeof(FileSlot) + size);
+    if (length > 0xffff) {
+        return false;
+    }
+
+    Vector<char> payload;
+
+    auto push = [&](const auto& value) {
+        for (u32 i = 0; i < sizeof value; ++i) {
+            payload.push_back(((const char*)&value)[i]);
+        }
+    };
+
+    host_u16 size_field;
+    size_field.set(size);
+    push(size_field);
+
+    // NOTE: leave the first slot's sequence number blank for now, see below.
+    FileSlot slot;
+    slot.length_.set(data.size() - data_padding);
+    slot.sequence_.set(0xffff);
+    push(slot);
+
+    for (char c : data) {
+        payload.push_back(c);
+    }
+
+    while (payload.size() < length) {
+        payload.push_back((char)0xff);
+    }
+
+    __access_count_record(write_counters, path);
+
+    const auto flags = Record::FileInfo::Flags0::is_slotted;
+    if (not write_file(pfrm, path, payload, flags, count)) {
+        return false;
+    }
+
+    Record r;
+    auto offset = find_slotted(pfrm, path, r);
+    if (offset == -1) {
+        const auto path_len = str_len(path);
+        offset = end_offset - (sizeof r + path_len + path_len % 2 + length);
+        slotted_files.push_back(offset);
+        pfrm.read_save_data(&r, sizeof r, offset);
+    }
+
+    // Now that the data made it to the save media, mark the slot complete.
+    u32 slots;
+    slot_size(pfrm, offset, r, slots);
+    host_u16 sequence;
+    sequence.set(1);
+    pfrm.write_save_data(
+        &sequence, sizeof sequence, slots + sizeof(FileSlot::length_));
+
+    return true;
+}
+
+
+
+// Store data in the next blank slot of the slotted file whose record sits at
+// offset, without searching the log, or invalidating anything. Once we run out
+// of slots, we write a new record. Expects data padded to a multiple of two.
+static bool store_slot(Platform& pfrm,
+                       const char* path,
+                       u32 offset,
+                       const Record& r,
+                       Vector<char>& data,
+                       bool data_padding)
+{
+    u32 slots;
+    const u32 size = slot_size(pfrm, offset, r, slots);
+
+    u32 newest;
+    u32 blank;
+    FileSlot newest_slot;
+    find_slots(pfrm, offset, r, newest, blank, newest_slot);
+
+    const u32 length = data.size() - data_padding;
+
+    if (newest and newest_slot.length_.get() == length) {
+        u8 buffer[64];
+        u32 src = newest + sizeof newest_slot;
+        auto it = data.begin();
+        bool equal = true;
+        for (u32 pos = 0; pos < length and equal; pos += sizeof buffer) {
+            const u32 count =
+                length - pos < sizeof buffer ? length - pos : sizeof buffer;
+            pfrm.read_save_data(buffer, count, src + pos);
+            for (u32 i = 0; i < count and equal; ++i) {
+                equal = (u8)*it++ == buffer[i];
+            }
+        }
+
+        if (equal) {
+            ++skipped_writes;
+            return true;
+        }
+    }
+
+    if (not blank or data.size() > size) {
+        return write_slotted_file(
+            pfrm, path, data, data_padding, size, slot_count(r));
+    }
+
+    int write_errors = 0;
+
+    FileSlot slot;
+    slot.length_.set(length);
+    slot.sequence_.set(newest ? newest_slot.sequence_.get() + 1 : 1);
+
+    if (not pfrm.write_save_data(
+            &slot.length_, sizeof slot.length_, blank)) {
+        ++write_errors;
+    }
+
+    u32 off = blank + sizeof slot;
+    write_errors += batch_write(pfrm, off, data.begin(), data.end());
+
+    if (not pfrm.write_save_data(&slot.sequence_,
+                                 sizeof slot.sequence_,
+                                 blank + sizeof slot.length_)) {
+        ++write_errors;
+    }
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("wrote %", path).c_str());
+
+    return true;
+}
+
+
+
+bool create_slotted_file(Platform& pfrm,
+                         const char* path,
+                         u16 size,
+                         u8 count)
+{
+    if (count == 0 or count > Record::FileInfo::Flags1::slot_mask) {
+        return false;
+    }
+
+    Record r;
+    if (find_slotted(pfrm, path, r) == -1 and slotted_files.full()) {
+        return false;
+    }
+
+    Vector<char> data;
+    read_file_data(pfrm, path, data);
+
+    bool data_padding = false;
+    if (data.size() % 2 not_eq 0) {
+        data.push_back(0);
+        data_padding = true;
+    }
+
+    return write_slotted_file(
+        pfrm, path, data, data_padding, size + size % 2, count);
+}
+
+
+
+bool store_file_data(Platform& pfrm, const char* path, Vector<char>& data)
+{
+    // Append a new file to the end of the filesystem log.
+
+    bool data_padding = false;
+    if (data.size() % 2 not_eq 0) {
+        // On the gameboy advance, commodity flash carts can be written only in
+        // halfwords (two bytes), so we need to pad the data size to a multiple
+        // of two, to ensure that all data has two-byte alignment.
+        data.push_back(0);
+        data_padding = true;
+    }
+
+    bool result = true;
+
+    Record r;
+    const auto slotted = find_slotted(pfrm, path, r);
+
+    // Games tend to autosave whether or not anything changed. Rewriting the
+    // same data would just wear out the flash and bring us closer to the next
+    // compaction.
+    if (slotted not_eq -1) {
+        result = store_slot(pfrm, path, slotted, r, data, data_padding);
+    } else if (file_unchanged(pfrm, path, data, data_padding)) {
+        ++skipped_writes;
+    } else {
+        __access_count_record(write_counters, path);
+
+        if (not store_patch(pfrm, path, data, data_padding)) {
+            // Store the file compressed, if that saves any space.
+            Vector<char> compressed;
+            Vector<char>* payload = &data;
+            u8 flags = 0;
+            u8 flags1 = 0;
+            if (compress(data, data.size() - data_padding, compressed)) {
+                if (compressed.size() % 2) {
+                    compressed.push_back(0);
+                    flags |= Record::FileInfo::Flags0::has_end_padding;
+                }
+                payload = &compressed;
+                flags1 = Record::FileInfo::Flags1::is_compressed;
+            } else if (data_padding) {
+                flags |= Record::FileInfo::Flags0::has_end_padding;
+            }
+
+            // If another file already holds the same contents, store a
+            // reference to it, rather than another copy.
+            char file_name[256];
+            if (find_duplicate(
+                    pfrm, path, *payload, flags, flags1, file_name)) {
+                Vector<char> reference;
+                push_reference(reference, file_name);
+                result = write_file(pfrm,
+                                    path,
+                                    reference,
+                                    0,
+                                    Record::FileInfo::Flags1::is_reference);
+            } else {
+                result = write_file(pfrm, path, *payload, flags, flags1);
+            }
+        }
+    }
+
+    if (data_padding) {
+        data.pop_back();
+    }
+
+    return result;
+}
+
+
+
+// The largest file that we'll put in a pack, see PackEntry.
+static constexpr const u32 max_packed_length = 255;
+
+
+
+// The most space that a file could take up in a pack.
+static u32 packed_size(const PackedFile& file)
+{
+    return sizeof(PackEntry) + str_len(file.path_) + file.data_->size() +
+           sizeof(host_u16);
+}
+
+
+
+// Write a pack record holding count files, replacing any existing files at the
+// same paths.
+static bool write_pack(Platform& pfrm, const PackedFile* files, u32 count)
+{
+    Buffer<const PackedFile*, Record::FileInfo::Flags1::slot_mask> sorted;
+    for (u32 i = 0; i < count; ++i) {
+        auto pos = sorted.begin();
+        while (pos not_eq sorted.end() and
+               str_cmp((*pos)->path_, files[i].path_) < 0) {
+            ++pos;
+        }
+        sorted.insert(pos, &files[i]);
+    }
+
+    Vector<char> payload;
+
+    // Room for the directory size, which we fill in below.
+    payload.push_back(0);
+    payload.push_back(0);
+
+    const char* prev = "";
+    for (auto file : sorted) {
+        u32 shared = 0;
+        while (prev[shared] and prev[shared] == file->path_[shared]) {
+            ++shared;
+        }
+
+        const u32 suffix_length = str_len(file->path_) - shared;
+
+        payload.push_back(file->data_->size());
+        payload.push_back(shared);
+        payload.push_back(suffix_length);
+        for (u32 i = 0; i < suffix_length; ++i) {
+            payload.push_back(file->path_[shared + i]);
+        }
+
+        prev = file->path_;
+    }
+
+    host_u16 directory_size;
+    directory_size.set(payload.size());
+    memcpy(&payload[0], &directory_size, sizeof directory_size);
+
+    for (auto file : sorted) {
+        for (char c : *file->data_) {
+            payload.push_back(c);
+        }
+    }
+
+    if (payload.size() % 2) {
+        payload.push_back(0);
+    }
+
+    // The update slots that mark removed files, left blank.
+    for (u32 i = 0; i < count; ++i) {
+        payload.push_back((char)0xff);
+        payload.push_back((char)0xff);
+    }
+
+    // NOTE: do this first, as it writes files of its own.
+    for (u32 i = 0; i < count; ++i) {
+        if (not detach_references(pfrm, files[i].path_)) {
+            return false;
+        }
+    }
+
+    const u32 required_space = payload.size() + sizeof(Record);
+
+    // NOTE: unlike write_file(), we don't count the space taken up by the
+    // files that we're replacing, which may well live in packs themselves.
+    if (not reserve_space(pfrm, required_space, cold)) {
+        return false;
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        unlink_file(pfrm, files[i].path_);
+    }
+
+    const auto write_errors = append_record(
+        pfrm, "", 0, payload, Record::FileInfo::Flags1::is_pack | count);
+
+    for (u32 i = 0; i < count; ++i) {
+        __path_cache_insert(files[i].path_);
+    }
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("wrote a pack of % files", count).c_str());
+
+    return true;
+}
+
+
+
+bool store_packed_files(Platform& pfrm, const PackedFile* files, u32 count)
+{
+    u32 limit = 0xffff;
+    if (layout == segmented_log) {
+        const u32 segment_space = segment_end(0) - segment_begin(0) -
+                                  sizeof(SegmentHeader) - sizeof(Record);
+        if (segment_space < limit) {
+            limit = segment_space;
+        }
+    }
+
+    Buffer<PackedFile, Record::FileInfo::Flags1::slot_mask> pack;
+    u32 size = sizeof(host_u16);
+
+    auto flush = [&] {
+        bool result = true;
+        if (pack.size() == 1) {
+            // Not worth a pack.
+            result = store_file_data(pfrm, pack[0].path_, *pack[0].data_);
+        } else if (not pack.empty()) {
+            result = write_pack(pfrm, pack.data(), pack.size());
+        }
+        pack.clear();
+        size = sizeof(host_u16);
+        return result;
+    };
+
+    for (u32 i = 0; i < count; ++i) {
+        // NOTE: a later file replaces an earlier one at the same path, as if
+        // we'd stored them one after the other. A pack holding both would list
+        // the path twice, and so would the file index rebuilt from it.
+        for (auto it = pack.begin(); it not_eq pack.end(); ++it) {
+            if (str_eq(it->path_, files[i].path_)) {
+                size -= packed_size(*it);
+                pack.erase(it);
+                break;
+            }
+        }
+
+        if (files[i].data_->size() > max_packed_length) {
+            if (not store_file_data(pfrm, files[i].path_, *files[i].data_)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (pack.full() or size + packed_size(files[i]) > limit) {
+            if (not flush()) {
+                return false;
+            }
+        }
+
+        pack.push_back(files[i]);
+        size += packed_size(files[i]);
+    }
+
+    return flush();
+}
+
+
+
+bool create_circular_log(Platform& pfrm, const char* path, u32 capacity)
+{
+    if (capacity == 0) {
+        return false;
+    }
+
+    host_u32 value;
+    value.set(capacity);
+
+    Vector<char> data;
+    for (u32 i = 0; i < sizeof value; ++i) {
+        data.push_back(((char*)&value)[i]);
+    }
+
+    __access_count_record(write_counters, path);
+
+    return write_file(pfrm, path, data, Record::FileInfo::Flags0::is_circular);
+}
+
+
+
+static u32 ring_capacity(Platform& pfrm, u32 offset, const Record& r)
+{
+    host_u32 capacity;
+    pfrm.read_save_data(
+        &capacity,
+        sizeof capacity,
+        offset + sizeof r + r.file_info_.name_length_);
+
+    return capacity.get();
+}
+
+
+
+// The number of bytes ever appended to a circular log, i.e. the position
+// following its newest entry.
+static u32 ring_end(Platform& pfrm, const char* path)
+{
+    u32 end = 0;
+    visit_entries(
+        pfrm, path, [&](u32, const Record&, u32 position, u32 length) {
+            if (position + length > end) {
+                end = position + length;
+            }
+        });
+
+    return end;
+}
+
+
+
+// Read the last capacity bytes appended to a circular log.
+static void read_ring(Platform& pfrm,
+                      const char* path,
+                      u32 offset,
+                      const Record& r,
+                      Vector<char>& output)
+{
+    const u32 capacity = ring_capacity(pfrm, offset, r);
+    const u32 end = ring_end(pfrm, path);
+    const u32 size = end < capacity ? end : capacity;
+    const u32 begin = end - size;
+
+    const u32 base = output.size();
+    for (u32 i = 0; i < size; ++i) {
+        output.push_back(0);
+    }
+
+    visit_entries(
+        pfrm, path, [&](u32 offset, const Record& e, u32 position, u32 length) {
+            u32 src = offset + sizeof e + e.file_info_.name_length_ +
+                      sizeof(host_u32);
+
+            if (position + length <= begin) {
+                return;
+            }
+
+            if (position < begin) {
+                src += begin - position;
+                length -= begin - position;
+                position = begin;
+            }
+
+            u8 buffer[64];
+            u32 dest = base + (position - begin);
+            while (length) {
+                const u32 count =
+                    length < sizeof buffer ? length : sizeof buffer;
+                pfrm.read_save_data(buffer, count, src);
+                for (u32 i = 0; i < count; ++i) {
+                    output[dest++] = buffer[i];
+                }
+                src += count;
+                length -= count;
+            }
+        });
+}
+
+
+
+// Append data to the circular log whose record sits at offset, as a new entry,
+// and invalidate the entries that fall out of the log, so that the segmented
+// layout can reclaim the space that they took up.
+static bool append_entry(Platform& pfrm,
+                         const char* path,
+                         u32 offset,
+                         const Record& r,
+                         const char* data,
+                         u32 length)
+{
+    const u32 capacity = ring_capacity(pfrm, offset, r);
+    const u32 end = ring_end(pfrm, path) + length;
+
+    // Anything older than the last capacity bytes would fall out of the log
+    // right away.
+    if (length > capacity) {
+        data += length - capacity;
+        length = capacity;
+    }
+
+    const auto path_len = str_len(path);
+    const auto path_total = path_len + path_len % 2;
+
+    const u32 payload_size = sizeof(host_u32) + length + length % 2;
+    const u32 required_space = sizeof(Record) + path_total + payload_size;
+
+    if (payload_size > 0xffff or
+        (layout == segmented_log and
+         required_space >
+             segment_end(0) - segment_begin(0) - sizeof(SegmentHeader))) {
+        return false;
+    }
+
+    // NOTE: invalidate the old entries before writing the new one. If we lose
+    // power in between, we only lose entries that were on their way out.
+    if (end > capacity) {
+        const u32 window_begin = end - capacity;
+        visit_entries(pfrm,
+                      path,
+                      [&](u32 offset, const Record& e, u32 position, u32 len) {
+                          if (position + len <= window_begin) {
+                              invalidate_record(pfrm, offset, e);
+                          }
+                      });
+    }
+
+    __access_count_record(write_counters, path);
+
+    if (not reserve_space(pfrm, required_space, __write_temperature(path))) {
+        return false;
+    }
+
+    host_u32 position;
+    position.set(end - length);
+
+    Vector<char> entry;
+    for (u32 i = 0; i < sizeof position; ++i) {
+        entry.push_back(((char*)&position)[i]);
+    }
+    for (u32 i = 0; i < length; ++i) {
+        entry.push_back(data[i]);
+    }
+
+    u8 flags = Record::FileInfo::Flags0::is_entry;
+    if (length % 2) {
+        entry.push_back(0);
+        flags |= Record::FileInfo::Flags0::has_end_padding;
+    }
+
+    const auto write_errors = append_record(pfrm, path, flags, entry);
+
+    ++entry_records;
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("appended to %", path).c_str());
+
+    return true;
+}
+
+
+
+u32 file_size(Platform& pfrm, const char* path)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return 0;
+    }
+
+    Record r;
+
+    auto offset = find_slotted(pfrm, path, r);
+    if (offset not_eq -1) {
+        u32 newest;
+        u32 blank;
+        FileSlot slot;
+        find_slots(pfrm, offset, r, newest, blank, slot);
+        return newest ? slot.length_.get() : 0;
+    }
+
+    offset = resolve_reference(pfrm, find_file(pfrm, path, r), r);
+    if (offset == -1) {
+        PackMember member;
+        if (find_packed(pfrm, path, r, member) not_eq -1) {
+            return member.length_;
+        }
+        return 0;
+    }
+
+    if (is_circular(r)) {
+        const u32 capacity = ring_capacity(pfrm, offset, r);
+        const u32 end = ring_end(pfrm, path);
+        return end < capacity ? end : capacity;
+    }
+
+    u32 size = data_length(pfrm, offset, r);
+
+    if (extent_records) {
+        // NOTE: only needs the extents' headers.
+        Chains chains;
+        collect_chains(pfrm, path, chains);
+        for (auto& extent : chains.extents_) {
+            Record e;
+            pfrm.read_save_data(&e, sizeof e, extent.offset_);
+            size += e.file_info_.data_length_.get() - sizeof(host_u16) -
+                    is_padded(e);
+        }
+    }
+
+    return size;
+}
+
+
+
+u32 read_file_data(Platform& pfrm, const char* path, Vector<char>& output)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return 0;
+    }
+
+    Record r;
+
+    // NOTE: we don't need to search the log for slotted files.
+    auto offset = find_slotted(pfrm, path, r);
+    if (offset == -1) {
+        offset = resolve_reference(pfrm, find_file(pfrm, path, r), r);
+    }
+
+    PackMember member;
+    if (offset == -1 and find_packed(pfrm, path, r, member) not_eq -1) {
+        __access_count_record(access_counters, path);
+
+        u8 buffer[64];
+        u32 src = member.data_offset_;
+        u32 remaining = member.length_;
+        while (remaining) {
+            const u32 count =
+                remaining < sizeof buffer ? remaining : sizeof buffer;
+            pfrm.read_save_data(buffer, count, src);
+            for (u32 i = 0; i < count; ++i) {
+                output.push_back(buffer[i]);
+            }
+            src += count;
+            remaining -= count;
+        }
+        return output.size();
+    }
+
+    if (offset == -1) {
+        return 0;
+    }
+
+    __access_count_record(access_counters, path);
+
+    if (is_slotted(r)) {
+        u32 newest;
+        u32 blank;
+        FileSlot slot;
+        find_slots(pfrm, offset, r, newest, blank, slot);
+        if (newest) {
+            u8 buffer[64];
+            u32 src = newest + sizeof slot;
+            u32 remaining = slot.length_.get();
+            while (remaining) {
+                const u32 count =
+                    remaining < sizeof buffer ? remaining : sizeof buffer;
+                pfrm.read_save_data(buffer, count, src);
+                for (u32 i = 0; i < count; ++i) {
+                    output.push_back(buffer[i]);
+                }
+                src += count;
+                remaining -= count;
+            }
+        }
+        return output.size();
+    }
+
+    if (is_circular(r)) {
+        read_ring(pfrm, path, offset, r, output);
+        return output.size();
+    }
+
+    Chains chains;
+    collect_chains(pfrm, path, chains);
+
+    // Read in the largest chunks that we can, rather than a byte at a time.
+    u8 local_buffer[64];
+    u8* buffer = local_buffer;
+    u32 buffer_size = sizeof local_buffer;
+    if (scratch_arena_size > buffer_size) {
+        buffer = scratch_arena;
+        buffer_size = scratch_arena_size;
+    }
+
+    read_chunks(
+        pfrm, offset, r, chains, buffer, buffer_size, [&](u8* b, u32 n) {
+            for (u32 i = 0; i < n; ++i) {
+                output.push_back(b[i]);
+            }
+        });
+
+    return output.size();
+}
+
+
+
+bool rename_file(Platform& pfrm, const char* from, const char* to)
+{
+    if (str_eq(from, to)) {
+        return file_exists(pfrm, from);
+    }
+
+    if (not __path_cache_file_exists_maybe(from)) {
+        return false;
+    }
+
+    Record r;
+    auto offset = find_file(pfrm, from, r);
+    if (offset not_eq -1 and
+        (is_circular(r) or is_counter(r) or is_flag_set(r) or
+         is_slotted(r))) {
+        // NOTE: these update their records in place, and would find the rename
+        // record instead.
+        return false;
+    }
+
+    Chains chains;
+    if (offset not_eq -1 and (patch_records or extent_records)) {
+        collect_chains(pfrm, from, chains);
+    }
+
+    const bool renamed = offset not_eq -1 and renamed_target(offset) not_eq -1;
+
+    // A packed file, a file with patches or extents, or a reference, which
+    // we'd have to find by its old name. Small, or soon to be rewritten, so we
+    // copy it instead.
+    if (offset == -1 or not chains.empty() or
+        (is_reference(r) and not renamed) or
+        (renamed_files.full() and not renamed)) {
+        if (offset == -1 and not file_exists(pfrm, from)) {
+            return false;
+        }
+        // NOTE: first, so that we can count on unlinking the old copy.
+        if (not detach_references(pfrm, from)) {
+            return false;
+        }
+        Vector<char> data;
+        if (offset not_eq -1 and chains.empty() and not is_reference(r)) {
+            // Copy the record as it is. Storing its contents would find the
+            // file itself as a duplicate, and leave us with a reference to the
+            // file that we're about to unlink.
+            read_payload(pfrm, offset, r, data);
+            if (not write_file(pfrm,
+                               to,
+                               data,
+                               r.file_info_.flags_[0],
+                               r.file_info_.flags_[1])) {
+                return false;
+            }
+        } else {
+            read_file_data(pfrm, from, data);
+            if (not store_file_data(pfrm, to, data)) {
+                return false;
+            }
+        }
+        unlink_file(pfrm, from);
+        return true;
+    }
+
+    // NOTE: do these first, as they write records of their own.
+    if (not detach_references(pfrm, from) or
+        not detach_references(pfrm, to)) {
+        return false;
+    }
+
+    make_directory(pfrm, to);
+
+    const u32 path_len = str_len(to);
+    const u32 required_space =
+        sizeof(Record) + path_len + path_len % 2 + rename_length;
+
+    if (not reserve_space(pfrm, required_space, __write_temperature(to))) {
+        return false;
+    }
+
+    // NOTE: not until we know that we have room for the rename record.
+    unlink_file(pfrm, to);
+
+    // NOTE: making room may have moved the file.
+    offset = find_file(pfrm, from, r);
+    if (offset == -1) {
+        return false;
+    }
+
+    // For a file that we already renamed, we replace its rename record.
+    int previous = -1;
+    int target = offset;
+    for (auto it = renamed_files.begin(); it not_eq renamed_files.end(); ++it) {
+        if ((int)it->record_ == offset) {
+            previous = offset;
+            target = it->target_;
+            renamed_files.erase(it);
+            break;
+        }
+    }
+
+    Vector<char> payload;
+    for (u32 i = 0; i < 2; ++i) {
+        payload.push_back(0);
+    }
+    for (u32 i = 0; i < 4; ++i) {
+        payload.push_back((u32)target >> (8 * i));
+    }
+
+    index_remove(target);
+    renamed_files.push_back({end_offset, (u32)target});
+
+    const auto write_errors = append_record(
+        pfrm, to, 0, payload, Record::FileInfo::Flags1::is_reference);
+
+    if (previous not_eq -1) {
+        invalidate_record(pfrm, previous, r);
+    }
+
+    __path_cache_insert(to);
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("renamed % to %", from, to).c_str());
+
+    return true;
+}
+
+
+
+bool clone_file(Platform& pfrm, const char* src, const char* dst)
+{
+    if (str_eq(src, dst)) {
+        return file_exists(pfrm, src);
+    }
+
+    if (not __path_cache_file_exists_maybe(src)) {
+        return false;
+    }
+
+    Record r;
+    const auto offset = find_file(pfrm, src, r);
+    if (offset not_eq -1 and
+        (is_circular(r) or is_counter(r) or is_flag_set(r) or
+         is_slotted(r))) {
+        // NOTE: these update their records in place, which would change the
+        // clone too.
+        return false;
+    }
+
+    Chains chains;
+    if (offset not_eq -1 and (patch_records or extent_records)) {
+        collect_chains(pfrm, src, chains);
+    }
+
+    // A packed file, or a file with patches or extents, which a reference
+    // can't share. Small, or soon to be rewritten, so we copy it instead.
+    if (offset == -1 or not chains.empty()) {
+        if (offset == -1 and not file_exists(pfrm, src)) {
+            return false;
+        }
+        Vector<char> data;
+        read_file_data(pfrm, src, data);
+        return store_file_data(pfrm, dst, data);
+    }
+
+    // Refer to the file that a reference refers to, rather than to the
+    // reference, so that references don't pile up on each other.
+    char target[256];
+    memset(target, 0, 256);
+    if (is_reference(r) and renamed_target(offset) == -1) {
+        pfrm.read_save_data(target,
+                            r.file_info_.data_length_.get(),
+                            offset + sizeof r + r.file_info_.name_length_);
+    } else {
+        memcpy(target, src, str_len(src));
+    }
+
+    if (str_eq(target, dst)) {
+        // The file already has the same contents.
+        return true;
+    }
+
+    Vector<char> payload;
+    push_reference(payload, target);
+
+    if (not write_file(
+            pfrm, dst, payload, 0, Record::FileInfo::Flags1::is_reference)) {
+        return false;
+    }
+
+    log(format("cloned % to %", src, dst).c_str());
+
+    return true;
+}
+
+
+
+bool append_file(Platform& pfrm,
+                 const char* path,
+                 const char* data,
+                 u32 length)
+{
+    Record r;
+    int offset = -1;
+    if (__path_cache_file_exists_maybe(path)) {
+        // NOTE: before finding the file, as detaching may compact the log.
+        if (not detach_references(pfrm, path)) {
+            return false;
+        }
+        offset = find_file(pfrm, path, r);
+    }
+
+    PackMember member;
+    if (offset == -1 and __path_cache_file_exists_maybe(path) and
+        find_packed(pfrm, path, r, member) not_eq -1) {
+        // Move the file out of its pack, into a record of its own.
+        Vector<char> contents;
+        read_file_data(pfrm, path, contents);
+        for (u32 i = 0; i < length; ++i) {
+            contents.push_back(data[i]);
+        }
+        return store_file_data(pfrm, path, contents);
+    }
+
+    if (offset == -1) {
+        return store_file_data(pfrm, path, data, length);
+    }
+
+    if (length == 0) {
+        return true;
+    }
+
+    if (is_circular(r)) {
+        return append_entry(pfrm, path, offset, r, data, length);
+    }
+
+    Chains chains;
+    collect_chains(pfrm, path, chains);
+
+    const u32 current = merged_length(pfrm, offset, r, chains);
+
+    const auto path_len = str_len(path);
+    const auto path_total = path_len + path_len % 2;
+
+    // Compaction needs to be able to merge the extents into one record.
+    u32 merged_size = current + length;
+    merged_size += merged_size % 2;
+    if (merged_size > 0xffff or
+        (layout == segmented_log and
+         sizeof(Record) + path_total + merged_size >
+             segment_end(0) - segment_begin(0) - sizeof(SegmentHeader))) {
+        return false;
+    }
+
+    Vector<char> extent;
+
+    const u32 required_space =
+        sizeof(Record) + path_total + sizeof(host_u16) + length + length % 2;
+
+    // NOTE: we can't program a record's update slots once it has extents, and
+    // a reference has no contents of its own to extend.
+    bool merge = chains.extents_.full() or slot_count(r) or is_reference(r);
+
+    if (not merge and layout not_eq segmented_log and
+        not reserve_space(pfrm, required_space, cold, false)) {
+        // Rewriting the file will compact the log, if needed.
+        merge = true;
+    }
+
+    if (merge) {
+        Vector<char> contents;
+        read_file_data(pfrm, path, contents);
+        for (u32 i = 0; i < length; ++i) {
+            contents.push_back(data[i]);
+        }
+        return store_file_data(pfrm, path, contents);
+    }
+
+    __access_count_record(write_counters, path);
+
+    if (not reserve_space(
+            pfrm, required_space, __write_temperature(path), false)) {
+        return false;
+    }
+
+    const auto& extents = chains.extents_;
+
+    host_u16 sequence;
+    sequence.set(extents.empty() ? 1 : extents.back().sequence_ + 1);
+    for (u32 i = 0; i < sizeof sequence; ++i) {
+        extent.push_back(((char*)&sequence)[i]);
+    }
+    for (u32 i = 0; i < length; ++i) {
+        extent.push_back(data[i]);
+    }
+
+    u8 flags = Record::FileInfo::Flags0::is_extent;
+    if (length % 2) {
+        extent.push_back(0);
+        flags |= Record::FileInfo::Flags0::has_end_padding;
+    }
+
+    const auto write_errors = append_record(pfrm, path, flags, extent);
+
+    ++extent_records;
+
+    recover_write_errors(pfrm, write_errors);
+
+    log(format("appended to %", path).c_str());
+
+    return true;
+}
+
+
+
+// Invoke callback(value) for each programmed update slot of the record at
+// offset.
+template <typename F>
+static void
+visit_slots(Platform& pfrm, u32 offset, const Record& r, F&& callback)
+{
+    const u32 slots =
+        offset + sizeof r + r.file_info_.name_length_ + checked_length(r);
+
+    for (u32 i = 0; i < slot_count(r); ++i) {
+        host_u16 slot;
+        pfrm.read_save_data(&slot, sizeof slot, slots + i * sizeof slot);
+        if (slot.get() not_eq 0xffff) {
+            callback(slot.get());
+        }
+    }
+}
+
+
+
+// Program value into the first blank update slot of the record at offset, in
+// place. Returns false if the record has no blank slots left.
+static bool fill_slot(Platform& pfrm, u32 offset, const Record& r, u16 value)
+{
+    const u32 slots =
+        offset + sizeof r + r.file_info_.name_length_ + checked_length(r);
+
+    for (u32 i = 0; i < slot_count(r); ++i) {
+        host_u16 slot;
+        pfrm.read_save_data(&slot, sizeof slot, slots + i * sizeof slot);
+        if (slot.get() == 0xffff) {
+            slot.set(value);
+            pfrm.write_save_data(&slot, sizeof slot, slots + i * sizeof slot);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
+// Write a new record for a counter or a flag set, holding the fixed part of
+// its data, followed by a full set of blank update slots.
+static bool
+write_slotted(Platform& pfrm, const char* path, Vector<char>& data, u8 flags)
+{
+    static_assert(FS_UPDATE_SLOTS > 0 and
+                  FS_UPDATE_SLOTS <= Record::FileInfo::Flags1::slot_mask);
+
+    for (u32 i = 0; i < FS_UPDATE_SLOTS * sizeof(host_u16); ++i) {
+        data.push_back((char)0xff);
+    }
+
+    __access_count_record(write_counters, path);
+
+    return write_file(pfrm, path, data, flags, FS_UPDATE_SLOTS);
+}
+
+
+
+static u32 counter_value(Platform& pfrm, u32 offset, const Record& r)
+{
+    host_u32 base;
+    pfrm.read_save_data(
+        &base, sizeof base, offset + sizeof r + r.file_info_.name_length_);
+
+    u32 value = base.get();
+    visit_slots(pfrm, offset, r, [&](u16 amount) { value += amount; });
+
+    return value;
+}
+
+
+
+u32 read_counter(Platform& pfrm, const char* path)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return 0;
+    }
+
+    Record r;
+    auto offset = find_file(pfrm, path, r);
+    if (offset == -1 or not is_counter(r)) {
+        return 0;
+    }
+
+    return counter_value(pfrm, offset, r);
+}
+
+
+
+bool add_counter(Platform& pfrm, const char* path, u16 amount)
+{
+    if (amount == 0) {
+        return true;
+    }
+
+    Record r;
+    int offset = -1;
+    if (__path_cache_file_exists_maybe(path)) {
+        offset = find_file(pfrm, path, r);
+    }
+
+    u32 value = 0;
+
+    if (offset not_eq -1 and is_counter(r)) {
+        // NOTE: a blank slot reads as 0xffff, so we can't store that amount.
+        if (amount not_eq 0xffff and fill_slot(pfrm, offset, r, amount)) {
+            return true;
+        }
+        value = counter_value(pfrm, offset, r);
+    }
+
+    // Out of slots, fold them into a new record.
+    host_u32 base;
+    base.set(value + amount);
+
+    Vector<char> data;
+    for (u32 i = 0; i < sizeof base; ++i) {
+        data.push_back(((char*)&base)[i]);
+    }
+
+    return write_slotted(
+        pfrm, path, data, Record::FileInfo::Flags0::is_counter);
+}
+
+
+
+// Read a flag set's bitmap, with the flags from its update slots folded in.
+static void
+read_flags(Platform& pfrm, u32 offset, const Record& r, Vector<char>& bitmap)
+{
+    const u32 src = offset + sizeof r + r.file_info_.name_length_;
+    for (u32 i = 0; i < checked_length(r); ++i) {
+        char c;
+        pfrm.read_save_data(&c, 1, src + i);
+        bitmap.push_back(c);
+    }
+
+    visit_slots(pfrm, offset, r, [&](u16 flag) {
+        while (bitmap.size() <= flag / 8u) {
+            bitmap.push_back(0);
+        }
+        bitmap[flag / 8] |= 1 << (flag % 8);
+    });
+}
+
+
+
+static bool test_flag(Platform& pfrm, u32 offset, const Record& r, u16 flag)
+{
+    if (flag / 8u < checked_length(r)) {
+        u8 byte;
+        pfrm.read_save_data(&byte,
+                            1,
+                            offset + sizeof r + r.file_info_.name_length_ +
+                                flag / 8);
+        if (byte & (1 << (flag % 8))) {
+            return true;
+        }
+    }
+
+    bool found = false;
+    visit_slots(pfrm, offset, r, [&](u16 value) { found |= value == flag; });
+
+    return found;
+}
+
+
+
+bool test_flag(Platform& pfrm, const char* path, u16 flag)
+{
+    if (not __path_cache_file_exists_maybe(path)) {
+        return false;
+    }
+
+    Record r;
+    auto offset = find_file(pfrm, path, r);
+    if (offset == -1 or not is_flag_set(r)) {
+        return false;
+    }
+
+    return test_flag(pfrm, offset, r, flag);
+}
+
+
+
+// Rewrite a flag set, with its update slots folded into its bitmap, and with
+// one of its flags changed.
+static bool
+rewrite_flags(Platform& pfrm, const char* path, u16 flag, bool value)
+{
+    Vector<char> bitmap;
+
+    Record r;
+    auto offset = find_file(pfrm, path, r);
+    if (offset not_eq -1 and is_flag_set(r)) {
+        read_flags(pfrm, offset, r, bitmap);
+    }
+
+    while (bitmap.size() <= flag / 8u or bitmap.size() % 2) {
+        bitmap.push_back(0);
+    }
+
+    if (value) {
+        bitmap[flag / 8] |= 1 << (flag % 8);
+    } else {
+        bitmap[flag / 8] &= ~(1 << (flag % 8));
+    }
+
+    return write_slotted(
+        pfrm, path, bitmap, Record::FileInfo::Flags0::is_flag_set);
+}
+
+
+
+bool set_flag(Platform& pfrm, const char* path, u16 flag)
+{
+    if (flag == 0xffff) {
+        return false;
+    }
+
+    Record r;
+    int offset = -1;
+    if (__path_cache_file_exists_maybe(path)) {
+        offset = find_file(pfrm, path, r);
+    }
+
+    if (offset not_eq -1 and is_flag_set(r)) {
+        if (test_flag(pfrm, offset, r, flag) or
+            fill_slot(pfrm, offset, r, flag)) {
+            return true;
+        }
+    }
+
+    return rewrite_flags(pfrm, path, flag, true);
+}
+
+
+
+bool clear_flag(Platform& pfrm, const char* path, u16 flag)
+{
+    if (not test_flag(pfrm, path, flag)) {
+        return true;
+    }
+
+    // We can't unprogram a bit, so this one takes a new record.
+    return rewrite_flags(pfrm, path, flag, false);
+}
+
+
+
+} // namespace flash_filesystem
+
+
+
+#ifdef __TEST__
+
+
+
+namespace flash_filesystem
+{
+
+
+
+void reset()
+{
+    start_offset = 0;
+    end_offset = 0;
+    gap_space = 0;
+    region_end = 0;
+    layout = single_log;
+    media_offset = 0;
+    generation = 0;
+    segments.clear();
+    segment_order.clear();
+    segment_base = 0;
+    segment_size = 0;
+    active_segments[cold] = -1;
+    active_segments[hot] = -1;
+    erase_queue.clear();
+    spare_erased = false;
+    legacy_root = false;
+    erase_counts.clear();
+    skipped_writes = 0;
+    patch_records = 0;
+    extent_records = 0;
+    entry_records = 0;
+    reference_records = 0;
+    pack_records = 0;
+    compressed_savings = 0;
+    slotted_files.clear();
+    renamed_files.clear();
+    directories.clear();
+    file_index.clear();
+    index_complete = false;
+    set_scratch_arena(nullptr, 0);
+    __access_count_clear();
+}
+
+
+
+// Fill data with bytes that don't compress, so that a test can predict how much
+// space the data will take up.
+template <typename T> void scramble(T& data, u32 seed)
+{
+    for (auto& c : data) {
+        seed = seed * 1103515245 + 12345;
+        c = seed >> 16;
+    }
+}
+
+
+
+bool basic_readwrite()
+{
+    Platform pfrm(".regr_input", ".regr_output");
+    initialize(pfrm, 8);
+
+    Vector<char> v1;
+    for (int i = 0; i < 21; ++i) {
+        v1.push_back('a');
+    }
+
+    flash_filesystem::store_file_data(pfrm, "/tmp/rwtest.dat", v1);
+
+    Vector<char> v2;
+
+    flash_filesystem::read_file_data(pfrm, "/tmp/rwtest.dat", v2);
+
+    if (v1.size() not_eq v2.size()) {
+        return false;
+    }
+
+    for (u32 i = 0; i < v1.size(); ++i) {
+        if (v1[i] not_eq v2[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+bool persistence()
+{
+    Vector<char> v1;
+    for (int i = 0; i < 21; ++i) {
+        v1.push_back('a');
+    }
+
+    Vector<char> v2;
+    for (int i = 0; i < 20; ++i) {
+        v1.push_back('b');
+    }
+
+    {
+        Platform pfrm(".regr_input", ".regr_output");
+        initialize(pfrm, 8);
+
+        flash_filesystem::store_file_data(pfrm, "/tmp/ptest.dat", v1);
+        flash_filesystem::store_file_data(pfrm, "/tmp/ptest2.dat", v2);
+    }
+
+    {
+        reset();
+        Platform pfrm(".regr_output", ".regr_output2");
+        initialize(pfrm, 8);
+
+        Vector<char> v1_1;
+        Vector<char> v2_1;
+
+        flash_filesystem::read_file_data(pfrm, "/tmp/ptest.dat", v1_1);
+        flash_filesystem::read_file_data(pfrm, "/tmp/ptest2.dat", v2_1);
+
+        if (v1_1.size() not_eq v1.size() or v2_1.size() not_eq v2.size()) {
+            return false;
+        }
+
+        for (u32 i = 0; i < v1.size(); ++i) {
+            if (v1_1[i] not_eq v1[i]) {
+                return false;
+            }
+        }
+
+        for (u32 i = 0; i < v2.size(); ++i) {
+            if (v2_1[i] not_eq v2[i]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool compaction()
+{
+    Buffer<std::pair<StringBuffer<68>, Vector<char>>, 9> files;
+
+    {
+        Platform pfrm(".regr_input", ".regr_output");
+        initialize(pfrm, 8);
+
+        walk(pfrm, [&files, &pfrm](const char* path) {
+            Vector<char> file_data;
+            read_file_data(pfrm, path, file_data);
+            files.push_back({path, file_data});
+        });
+
+        compact(pfrm);
+
+        for (auto& kvp : files) {
+            Vector<char> data;
+            read_file_data(pfrm, kvp.first.c_str(), data);
+
+            if (data.size() not_eq kvp.second.size()) {
+                return false;
+            }
+
+            for (u32 i = 0; i < data.size(); ++i) {
+                if (data[i] not_eq kvp.second[i]) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    // Persistence test: make sure everything comes up ok after a restart
+    // following compaction.
+    reset();
+    Platform pfrm(".regr_output", ".regr_output2");
+    initialize(pfrm, 8);
+
+    if (end_offset not_eq 5396) {
+        return false;
+    }
+
+    if (gap_space not_eq 0) {
+        return false;
+    }
+
+    for (auto& kvp : files) {
+        Vector<char> data;
+        read_file_data(pfrm, kvp.first.c_str(), data);
+
+        if (data.size() not_eq kvp.second.size()) {
+            return false;
+        }
+
+        for (u32 i = 0; i < data.size(); ++i) {
+            if (data[i] not_eq kvp.second[i]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool write_triggered_compaction()
+{
+    Buffer<std::pair<StringBuffer<68>, Vector<char>>, 9> files;
+
+    Vector<char> test;
+    for (int i = 0; i < 9999; ++i) {
+        test.push_back('A');
+    }
+    scramble(test, 1);
+
+    {
+        Platform pfrm(".regr_input", ".regr_output");
+        initialize(pfrm, 8);
+
+        walk(pfrm, [&files, &pfrm](const char* path) {
+            Vector<char> file_data;
+            read_file_data(pfrm, path, file_data);
+            files.push_back({path, file_data});
+        });
+
+        // trigger compaction
+        store_file_data(pfrm, "/stuff.dat", test);
+
+        for (auto& kvp : files) {
+            Vector<char> data;
+            read_file_data(pfrm, kvp.first.c_str(), data);
+
+            if (data.size() not_eq kvp.second.size()) {
+                return false;
+            }
+
+            for (u32 i = 0; i < data.size(); ++i) {
+                if (data[i] not_eq kvp.second[i]) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    // Persistence test: make sure everything comes up ok after a restart
+    // following compaction.
+    reset();
+    Platform pfrm(".regr_output", ".regr_output2");
+    initialize(pfrm, 8);
+
+    if (end_offset not_eq 15414) {
+        return false;
+    }
+
+    if (gap_space not_eq 0) {
+        return false;
+    }
+
+    for (auto& kvp : files) {
+        Vector<char> data;
+        read_file_data(pfrm, kvp.first.c_str(), data);
+
+        if (data.size() not_eq kvp.second.size()) {
+            return false;
+        }
+
+        for (u32 i = 0; i < data.size(); ++i) {
+            if (data[i] not_eq kvp.second[i]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool partial_compaction()
+{
+    Buffer<std::pair<StringBuffer<68>, Vector<char>>, 9> files;
+
+    Vector<char> small;
+    for (int i = 0; i < 32; ++i) {
+        small.push_back('x');
+    }
+
+    {
+        Platform pfrm(".regr_input", ".regr_output");
+        // Erase granularity of sram.
+        pfrm.erase_unit_ = 2;
+        initialize(pfrm, 8);
+
+        // Start from a gap-free log.
+        compact(pfrm);
+
+        walk(pfrm, [&files, &pfrm](const char* path) {
+            Vector<char> file_data;
+            read_file_data(pfrm, path, file_data);
+            files.push_back({path, file_data});
+        });
+
+        const auto used = sector_used();
+
+        store_file_data(pfrm, "/partial.dat", small);
+        store_file_data(pfrm, "/partial.dat", small);
+
+        const auto written = pfrm.bytes_written_;
+        compact(pfrm);
+        const auto compaction_writes = pfrm.bytes_written_ - written;
+
+        if (gap_space not_eq 0) {
+            return false;
+        }
+
+        // Only the records behind the gap should have been rewritten, rather
+        // than the whole log.
+        if (compaction_writes * 10 > used) {
+            return false;
+        }
+
+        // With flash-sized erase units, the record straddling the first erased
+        // unit needs to be partially rewritten.
+        pfrm.erase_unit_ = 4096;
+        store_file_data(pfrm, "/partial.dat", small);
+        compact(pfrm);
+
+        if (gap_space not_eq 0) {
+            return false;
+        }
+    }
+
+    reset();
+    Platform pfrm(".regr_output", ".regr_output2");
+    initialize(pfrm, 8);
+
+    if (gap_space not_eq 0) {
+        return false;
+    }
+
+    Vector<char> data;
+    read_file_data(pfrm, "/partial.dat", data);
+    if (data.size() not_eq small.size()) {
+        return false;
+    }
+
+    for (auto& kvp : files) {
+        Vector<char> data;
+        read_file_data(pfrm, kvp.first.c_str(), data);
+
+        if (data.size() not_eq kvp.second.size()) {
+            return false;
+        }
+
+        for (u32 i = 0; i < data.size(); ++i) {
+            if (data[i] not_eq kvp.second[i]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool skip_unchanged_writes()
+{
+    Platform pfrm(32 * 1024, ".regr_output");
+    initialize(pfrm, 8);
+
+    Vector<char> data;
+    for (int i = 0; i < 300; ++i) {
+        data.push_back(i);
+    }
+
+    store_file_data(pfrm, "/save.dat", data);
+
+    const auto written = pfrm.bytes_written_;
+    const auto used = statistics(pfrm).bytes_used_;
+
+    store_file_data(pfrm, "/save.dat", data);
+
+    if (pfrm.bytes_written_ not_eq written or
+        statistics(pfrm).bytes_used_ not_eq used or
+        statistics(pfrm).skipped_writes_ not_eq 1) {
+        return false;
+    }
+
+    // A different payload with the same crc still needs to be written.
+    auto crc = [](Vector<char>& v) {
+        u8 crc8 = 0;
+        for (char c : v) {
+            crc8 = crc8_table[((u8)c) ^ crc8];
+        }
+        return crc8;
+    };
+
+    // NOTE: a crc catches any single byte change, so try changing two.
+    Vector<char> other = data;
+    for (int i = 1; i < 256 * 256; ++i) {
+        other[0] = i % 256;
+        other[1] = i / 256;
+        if (crc(other) == crc(data)) {
+            break;
+        }
+    }
+
+    if (other == data or crc(other) not_eq crc(data)) {
+        return false;
+    }
+
+    store_file_data(pfrm, "/save.dat", other);
+
+    Vector<char> out;
+    read_file_data(pfrm, "/save.dat", out);
+
+    return pfrm.bytes_written_ not_eq written and
+           statistics(pfrm).skipped_writes_ == 1 and out == other;
+}
+
+
+
+bool delta_records()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data;
+        for (int i = 0; i < 3000; ++i) {
+            data.push_back('a' + i % 26);
+        }
+        scramble(data, 1);
+
+        auto matches = [&](Platform& pfrm) {
+            Vector<char> out;
+            read_file_data(pfrm, "/save.dat", out);
+            return out == data;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save.dat", data);
+            store_file_data(pfrm, "/other.dat", "hello", 5);
+
+            // A few small edits should only cost a few small records.
+            for (int i = 0; i < FS_MAX_PATCHES; ++i) {
+                data[i * 100] = 'A' + i;
+                data[2999 - i] = 'Z';
+
+                const auto written = pfrm.bytes_written_;
+                store_file_data(pfrm, "/save.dat", data);
+
+                if (pfrm.bytes_written_ - written > 64 or not matches(pfrm)) {
+                    return false;
+                }
+            }
+
+            if (patch_records not_eq FS_MAX_PATCHES) {
+                return false;
+            }
+
+            // The chain is full, so the next edit rewrites the whole file.
+            data[1500] = '!';
+            auto written = pfrm.bytes_written_;
+            store_file_data(pfrm, "/save.dat", data);
+
+            if (pfrm.bytes_written_ - written < data.size() or
+                patch_records not_eq 0 or not matches(pfrm)) {
+                return false;
+            }
+
+            // Compaction applies patches to the files that they belong to.
+            data[10] = '?';
+            store_file_data(pfrm, "/save.dat", data);
+            data[20] = '?';
+            store_file_data(pfrm, "/save.dat", data);
+
+            if (patch_records not_eq 2) {
+                return false;
+            }
+
+            compact(pfrm);
+
+            if (patch_records not_eq 0 or not matches(pfrm)) {
+                return false;
+            }
+
+            // Leave a patch for remounting.
+            data[30] = '?';
+            store_file_data(pfrm, "/save.dat", data);
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            int count = 0;
+            walk(pfrm, [&](const char*) { ++count; });
+
+            if (patch_records not_eq 1 or count not_eq 2 or
+                not matches(pfrm)) {
+                return false;
+            }
+
+            Vector<char> other;
+            read_file_data(pfrm, "/other.dat", other);
+            if (other.size() not_eq 5) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/save.dat");
+
+            if (patch_records not_eq 0 or file_exists(pfrm, "/save.dat")) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool append_extents()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> expected;
+
+        auto append = [&](Platform& pfrm, int length) {
+            char data[64];
+            for (int i = 0; i < length; ++i) {
+                data[i] = 'a' + (expected.size() % 26);
+                expected.push_back(data[i]);
+            }
+            return append_file(pfrm, "/log.txt", data, length);
+        };
+
+        auto matches = [&](Platform& pfrm) {
+            Vector<char> out;
+            read_file_data(pfrm, "/log.txt", out);
+            return out == expected;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            append(pfrm, 33);
+
+            // Appending shouldn't cost more than the appended data and a
+            // record header, or a segment header, if it opens a segment.
+            for (int i = 0; i < FS_MAX_EXTENTS; ++i) {
+                const auto written = pfrm.bytes_written_;
+                append(pfrm, 7 + i);
+
+                const u32 limit = 7 + i + 24 + sizeof(SegmentHeader);
+                if (pfrm.bytes_written_ - written > limit or
+                    not matches(pfrm) or
+                    file_size(pfrm, "/log.txt") not_eq expected.size()) {
+                    return false;
+                }
+            }
+
+            int count = 0;
+            walk(pfrm, [&](const char*) { ++count; });
+
+            if (extent_records not_eq FS_MAX_EXTENTS or count not_eq 1) {
+                return false;
+            }
+
+            // Out of extents, so this one rewrites the file.
+            append(pfrm, 5);
+
+            if (extent_records not_eq 0 or not matches(pfrm)) {
+                return false;
+            }
+
+            append(pfrm, 3);
+            append(pfrm, 4);
+            compact(pfrm);
+
+            // The rewrite compressed the file, so compaction keeps its extents
+            // as they are, rather than decompressing the file to merge them.
+            Record r;
+            if (find_file(pfrm, "/log.txt", r) == -1 or not is_compressed(r) or
+                extent_records not_eq 2 or not matches(pfrm)) {
+                return false;
+            }
+
+            append(pfrm, 9);
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (extent_records not_eq 3 or not matches(pfrm)) {
+                return false;
+            }
+
+            // The file's original record is the same size as the new data,
+            // but that doesn't make the new data a patch.
+            Vector<char> data;
+            for (int i = 0; i < 48; ++i) {
+                data.push_back('z');
+            }
+            store_file_data(pfrm, "/log.txt", data);
+            expected = data;
+
+            if (extent_records not_eq 0 or not matches(pfrm)) {
+                return false;
+            }
+
+            append(pfrm, 2);
+            unlink_file(pfrm, "/log.txt");
+
+            if (extent_records not_eq 0 or file_exists(pfrm, "/log.txt")) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool circular_log()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    const u32 capacity = 100;
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> appended;
+
+        auto expected = [&] {
+            Vector<char> result;
+            const u32 begin =
+                appended.size() > capacity ? appended.size() - capacity : 0;
+            for (u32 i = begin; i < appended.size(); ++i) {
+                result.push_back(appended[i]);
+            }
+            return result;
+        };
+
+        auto matches = [&](Platform& pfrm) {
+            Vector<char> out;
+            read_file_data(pfrm, "/debug.log", out);
+            return out == expected() and
+                   file_size(pfrm, "/debug.log") == out.size();
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save.dat", "hello", 5);
+            create_circular_log(pfrm, "/debug.log", capacity);
+
+            if (not file_exists(pfrm, "/debug.log") or not matches(pfrm)) {
+                return false;
+            }
+
+            // Enough to fill the save media several times over, if we kept
+            // everything.
+            u32 record_bytes = 0;
+            const auto written = pfrm.bytes_written_;
+            for (int i = 0; i < 4000; ++i) {
+                char data[64];
+                const int length = 5 + i % 40;
+                for (int j = 0; j < length; ++j) {
+                    data[j] = 'a' + (appended.size() % 26);
+                    appended.push_back(data[j]);
+                }
+
+                const auto before = pfrm.bytes_written_;
+                if (not append_file(pfrm, "/debug.log", data, length)) {
+                    return false;
+                }
+
+                // An entry costs about as much as its data, unless writing it
+                // needed compaction.
+                const u32 entry = 16 + length + length % 2;
+                if (i < 50 and pfrm.bytes_written_ - before >
+                                   entry + sizeof(SegmentHeader)) {
+                    return false;
+                }
+                record_bytes += entry;
+
+                if (entry_records > capacity / 5 + 1) {
+                    return false;
+                }
+
+                if (i % 97 == 0 and not matches(pfrm)) {
+                    return false;
+                }
+            }
+
+            // Reclaiming dropped entries shouldn't copy much.
+            if (pfrm.bytes_written_ - written > record_bytes * 5 / 4) {
+                return false;
+            }
+
+            int count = 0;
+            walk(pfrm, [&](const char*) { ++count; });
+
+            if (count not_eq 2 or not matches(pfrm)) {
+                return false;
+            }
+
+            compact(pfrm);
+
+            if (not matches(pfrm)) {
+                return false;
+            }
+
+            // Bigger than the log, so we only keep the end of it.
+            char big[150];
+            for (auto& c : big) {
+                c = 'A' + (appended.size() % 26);
+                appended.push_back(c);
+            }
+            append_file(pfrm, "/debug.log", big, sizeof big);
+
+            if (entry_records not_eq 1 or not matches(pfrm)) {
+                return false;
+            }
+
+            append_file(pfrm, "/debug.log", "xyz", 3);
+            appended.push_back('x');
+            appended.push_back('y');
+            appended.push_back('z');
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (entry_records not_eq 2 or not matches(pfrm)) {
+                return false;
+            }
+
+            Vector<char> save;
+            read_file_data(pfrm, "/save.dat", save);
+            if (save.size() not_eq 5) {
+                return false;
+            }
+
+            // Overwriting the log turns it back into a normal file.
+            store_file_data(pfrm, "/debug.log", "abcd", 4);
+
+            Vector<char> out;
+            read_file_data(pfrm, "/debug.log", out);
+            if (entry_records not_eq 0 or out.size() not_eq 4) {
+                return false;
+            }
+
+            create_circular_log(pfrm, "/debug.log", capacity);
+            append_file(pfrm, "/debug.log", "abc", 3);
+            unlink_file(pfrm, "/debug.log");
+
+            if (entry_records not_eq 0 or file_exists(pfrm, "/debug.log")) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool update_slots()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        u32 expected = 0;
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            add_counter(pfrm, "/playtime", 3);
+            expected += 3;
+
+            // Each update programs one halfword in place, until we run out of
+            // slots.
+            for (int i = 1; i < FS_UPDATE_SLOTS + 1; ++i) {
+                const auto written = pfrm.bytes_written_;
+                add_counter(pfrm, "/playtime", i);
+                expected += i;
+
+                if (pfrm.bytes_written_ - written not_eq sizeof(host_u16) or
+                    read_counter(pfrm, "/playtime") not_eq expected) {
+                    return false;
+                }
+            }
+
+            // Out of slots, so this one writes a new record.
+            const auto written = pfrm.bytes_written_;
+            add_counter(pfrm, "/playtime", 0xffff);
+            expected += 0xffff;
+
+            if (pfrm.bytes_written_ - written <= sizeof(host_u16) or
+                read_counter(pfrm, "/playtime") not_eq expected) {
+                return false;
+            }
+
+            // Enough to compact a few times, with other files in the mix.
+            for (int i = 0; i < 3000; ++i) {
+                add_counter(pfrm, "/playtime");
+                ++expected;
+
+                if (i % 7 == 0) {
+                    char data[200];
+                    scramble(data, i);
+                    store_file_data(pfrm, "/save.dat", data, sizeof data);
+                }
+            }
+
+            for (int i = 0; i < 40; i += 3) {
+                set_flag(pfrm, "/unlocks", i);
+            }
+            set_flag(pfrm, "/unlocks", 300);
+
+            const auto before = pfrm.bytes_written_;
+            set_flag(pfrm, "/unlocks", 0);
+            if (pfrm.bytes_written_ not_eq before) {
+                return false;
+            }
+
+            clear_flag(pfrm, "/unlocks", 9);
+            compact(pfrm);
+
+            if (read_counter(pfrm, "/playtime") not_eq expected or
+                pfrm.overwrites_) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (read_counter(pfrm, "/playtime") not_eq expected) {
+                return false;
+            }
+
+            for (int i = 0; i < 320; ++i) {
+                const bool set = (i % 3 == 0 and i < 40 and i not_eq 9) or
+                                 i == 300;
+                if (test_flag(pfrm, "/unlocks", i) not_eq set) {
+                    return false;
+                }
+            }
+
+            // Counters and flag sets are still files, which we can replace.
+            store_file_data(pfrm, "/playtime", "abcd", 4);
+            if (read_counter(pfrm, "/playtime") not_eq 0 or
+                file_size(pfrm, "/playtime") not_eq 4 or pfrm.overwrites_) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool slotted_file_stores()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> expected;
+
+        auto store = [&](Platform& pfrm, int length, int seed) {
+            expected.clear();
+            for (int i = 0; i < length; ++i) {
+                expected.push_back(seed + i);
+            }
+            return store_file_data(pfrm, "/settings", expected);
+        };
+
+        auto matches = [&](Platform& pfrm) {
+            Vector<char> out;
+            read_file_data(pfrm, "/settings", out);
+            return out == expected and
+                   file_size(pfrm, "/settings") == expected.size();
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            for (int i = 0; i < 40; ++i) {
+                store_file_data(pfrm, format("/file%", i).c_str(), "data", 4);
+            }
+
+            store(pfrm, 101, 0);
+            if (not create_slotted_file(pfrm, "/settings", 128, 8) or
+                not matches(pfrm)) {
+                return false;
+            }
+
+            // Each store costs the data and a slot header, without searching
+            // the log, or invalidating anything.
+            for (int i = 1; i < 8; ++i) {
+                const auto written = pfrm.bytes_written_;
+                const auto reads = pfrm.reads_;
+                store(pfrm, 90 + i, i);
+
+                if (pfrm.bytes_written_ - written not_eq
+                        expected.size() + expected.size() % 2 +
+                            sizeof(FileSlot) or
+                    pfrm.reads_ - reads > 16 or not matches(pfrm)) {
+                    return false;
+                }
+            }
+
+            // Unchanged, so we don't need a slot.
+            const auto skipped = statistics(pfrm).skipped_writes_;
+            store_file_data(pfrm, "/settings", expected);
+            if (statistics(pfrm).skipped_writes_ not_eq skipped + 1) {
+                return false;
+            }
+
+            // Out of slots, so this one writes a new record.
+            const auto written = pfrm.bytes_written_;
+            store(pfrm, 100, 8);
+            if (pfrm.bytes_written_ - written < sizeof(Record) or
+                not matches(pfrm)) {
+                return false;
+            }
+
+            // Too big for the slots.
+            store(pfrm, 200, 9);
+            if (not matches(pfrm)) {
+                return false;
+            }
+
+            // Enough to compact a few times, with other files in the mix.
+            for (int i = 0; i < 1000; ++i) {
+                store(pfrm, 50 + i % 100, i);
+
+                if (i % 5 == 0) {
+                    char data[300];
+                    scramble(data, i);
+                    store_file_data(pfrm, "/save.dat", data, sizeof data);
+                }
+
+                if (i % 97 == 0 and not matches(pfrm)) {
+                    return false;
+                }
+            }
+
+            compact(pfrm);
+
+            if (not matches(pfrm) or slotted_files.size() not_eq 1) {
+                return false;
+            }
+
+            // If we lose power partway through writing a slot, we keep the
+            // previous version.
+            const auto previous = expected;
+            pfrm.writes_until_power_loss_ = 1;
+            store(pfrm, 60, 42);
+            pfrm.writes_until_power_loss_ = -1;
+            expected = previous;
+
+            reset();
+            initialize(pfrm, 8);
+
+            if (not matches(pfrm)) {
+                return false;
+            }
+
+            store(pfrm, 61, 43);
+
+            if (not matches(pfrm) or pfrm.overwrites_) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (not matches(pfrm) or slotted_files.size() not_eq 1) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/settings");
+
+            if (file_exists(pfrm, "/settings") or slotted_files.size()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool compressed_files()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    // Mostly zeroes, with some repeated tiles and text mixed in.
+    auto tile_map = [](int seed) {
+        Vector<char> result;
+        for (int i = 0; i < 4000; ++i) {
+            char c = 0;
+            if (i % 64 < 8) {
+                c = (i / 64 + seed) % 7;
+            } else if (i > 3000 and i < 3100) {
+                c = "the quick brown fox "[i % 20];
+            }
+            result.push_back(c);
+        }
+        return result;
+    };
+
+    // Reads have to come out right no matter how the matches line up with
+    // the chunks that we decompress into.
+    for (int size = 1; size < 700; size += 37) {
+        reset();
+        Platform pfrm(32 * 1024, ".regr_output");
+        initialize(pfrm, 8);
+
+        Vector<char> data;
+        for (int i = 0; i < size; ++i) {
+            data.push_back(i % 300 < 150 ? 'a' + i % 3 : i * 7);
+        }
+        store_file_data(pfrm, "/codec.dat", data);
+
+        Vector<char> out;
+        read_file_data(pfrm, "/codec.dat", out);
+        if (out not_eq data or file_size(pfrm, "/codec.dat") < data.size()) {
+            return false;
+        }
+    }
+
+    for (auto l : layouts) {
+        reset();
+
+        auto map = tile_map(0);
+
+        auto matches = [&](Platform& pfrm) {
+            Vector<char> out;
+            read_file_data(pfrm, "/map.dat", out);
+            return out == map;
+        };
+
+        u32 saved = 0;
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            const auto written = pfrm.bytes_written_;
+            store_file_data(pfrm, "/map.dat", map);
+
+            saved = statistics(pfrm).bytes_saved_;
+            if (pfrm.bytes_written_ - written > map.size() / 4 or
+                saved < map.size() * 3 / 4 or not matches(pfrm) or
+                file_size(pfrm, "/map.dat") not_eq map.size()) {
+                return false;
+            }
+
+            // Doesn't compress, so we store it as is.
+            Vector<char> noise(1000);
+            scramble(noise, 1);
+            store_file_data(pfrm, "/noise.dat", noise);
+
+            Vector<char> out;
+            read_file_data(pfrm, "/noise.dat", out);
+            if (out not_eq noise or
+                statistics(pfrm).bytes_saved_ not_eq saved) {
+                return false;
+            }
+
+            const auto skipped = statistics(pfrm).skipped_writes_;
+            store_file_data(pfrm, "/map.dat", map);
+            if (statistics(pfrm).skipped_writes_ not_eq skipped + 1) {
+                return false;
+            }
+
+            // Rewrite the map enough times to need compaction.
+            for (int i = 0; i < 200; ++i) {
+                map = tile_map(i);
+                store_file_data(pfrm, "/map.dat", map);
+            }
+
+            saved = statistics(pfrm).bytes_saved_;
+            if (not matches(pfrm) or saved < map.size() * 3 / 4) {
+                return false;
+            }
+
+            // Extents follow the compressed data, and compaction leaves them
+            // that way, rather than decompressing the file to merge them in.
+            append_file(pfrm, "/map.dat", "abc", 3);
+            map.push_back('a');
+            map.push_back('b');
+            map.push_back('c');
+
+            if (not matches(pfrm) or
+                file_size(pfrm, "/map.dat") < map.size()) {
+                return false;
+            }
+
+            compact(pfrm);
+
+            if (not matches(pfrm) or extent_records not_eq 1 or
+                statistics(pfrm).bytes_saved_ not_eq saved) {
+                return false;
+            }
+
+            store_file_data(pfrm, "/map.dat", map);
+            saved = statistics(pfrm).bytes_saved_;
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (not matches(pfrm) or
+                statistics(pfrm).bytes_saved_ not_eq saved) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/map.dat");
+
+            if (statistics(pfrm).bytes_saved_ not_eq 0) {
+                return false;
+            }
+        }
+    }
+
+    // Decompressed, the file wouldn't fit, so compacting a full log has to
+    // leave its extents unmerged. And overwriting it only frees up the space
+    // that it takes up compressed.
+    for (auto l : layouts) {
+        reset();
+
+        Platform pfrm(64 * 1024, ".regr_output");
+        initialize(pfrm, 8, l);
+
+        Vector<char> zeroes(30000);
+        store_file_data(pfrm, "/zeroes.dat", zeroes);
+        // NOTE: segments are too small to hold the file decompressed, so
+        // appending to it fails there.
+        if (append_file(pfrm, "/zeroes.dat", "abcd", 4)) {
+            for (char c : {'a', 'b', 'c', 'd'}) {
+                zeroes.push_back(c);
+            }
+        }
+
+        Vector<char> block(1024);
+        int count = 0;
+        while (count < 64) {
+            scramble(block, count);
+            const auto name = format("/fill/%.dat", count);
+            if (not store_file_data(pfrm, name.c_str(), block)) {
+                break;
+            }
+            ++count;
+        }
+
+        compact(pfrm);
+
+        // The next store of an incompressible file doesn't fit.
+        Vector<char> noise(30000);
+        scramble(noise, 1);
+        if (store_file_data(pfrm, "/zeroes.dat", noise) or
+            pfrm.overwrites_) {
+            return false;
+        }
+
+        Vector<char> out;
+        read_file_data(pfrm, "/zeroes.dat", out);
+        if (out not_eq zeroes) {
+            return false;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            scramble(block, i);
+            Vector<char> out;
+            read_file_data(pfrm, format("/fill/%.dat", i).c_str(), out);
+            if (out not_eq block) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool deduplicated_files()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data(600);
+        scramble(data, 1);
+        data.push_back('x');
+
+        auto matches = [&](Platform& pfrm, const char* path) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            return out == data and file_size(pfrm, path) >= data.size();
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/a.dat", data);
+
+            // Copies of the file cost only a header and a name.
+            const auto written = pfrm.bytes_written_;
+            store_file_data(pfrm, "/b.dat", data);
+            store_file_data(pfrm, "/c.dat", data);
+            if (pfrm.bytes_written_ - written > 64 or
+                reference_records not_eq 2) {
+                return false;
+            }
+
+            for (auto path : {"/a.dat", "/b.dat", "/c.dat"}) {
+                if (not matches(pfrm, path)) {
+                    return false;
+                }
+            }
+
+            const auto skipped = statistics(pfrm).skipped_writes_;
+            store_file_data(pfrm, "/c.dat", data);
+            if (statistics(pfrm).skipped_writes_ not_eq skipped + 1) {
+                return false;
+            }
+
+            // Changing the original gives the first copy the contents, and the
+            // other copy refers to it instead.
+            Vector<char> other(600);
+            scramble(other, 2);
+            store_file_data(pfrm, "/a.dat", other);
+
+            Vector<char> out;
+            read_file_data(pfrm, "/a.dat", out);
+            if (out not_eq other or reference_records not_eq 1 or
+                not matches(pfrm, "/b.dat") or not matches(pfrm, "/c.dat")) {
+                return false;
+            }
+
+            // Patching a file detaches its references first.
+            Vector<char> patched = data;
+            patched[10] = 'p';
+            store_file_data(pfrm, "/b.dat", patched);
+            out.clear();
+            read_file_data(pfrm, "/b.dat", out);
+            if (out not_eq patched or reference_records not_eq 0 or
+                not matches(pfrm, "/c.dat")) {
+                return false;
+            }
+
+            // As does unlinking it. Compressed files deduplicate too.
+            Vector<char> tiles(2000);
+            for (u32 i = 0; i < tiles.size(); ++i) {
+                tiles[i] = data[i % 100];
+            }
+            store_file_data(pfrm, "/z1.dat", tiles);
+            store_file_data(pfrm, "/z2.dat", tiles);
+            if (reference_records not_eq 1) {
+                return false;
+            }
+            unlink_file(pfrm, "/z1.dat");
+            out.clear();
+            read_file_data(pfrm, "/z2.dat", out);
+            if (out not_eq tiles or reference_records not_eq 0 or
+                file_exists(pfrm, "/z1.dat")) {
+                return false;
+            }
+
+            // Appending to a reference rewrites it with its own contents.
+            store_file_data(pfrm, "/d.dat", data);
+            append_file(pfrm, "/d.dat", "yz", 2);
+            out.clear();
+            read_file_data(pfrm, "/d.dat", out);
+            if (reference_records not_eq 0 or
+                out.size() not_eq data.size() + 2 or
+                out[data.size() + 1] not_eq 'z' or
+                not matches(pfrm, "/c.dat")) {
+                return false;
+            }
+
+            store_file_data(pfrm, "/e.dat", data);
+            compact(pfrm);
+
+            if (reference_records not_eq 1 or not matches(pfrm, "/e.dat")) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (reference_records not_eq 1 or not matches(pfrm, "/c.dat") or
+                not matches(pfrm, "/e.dat") or pfrm.overwrites_) {
+                return false;
+            }
+        }
+    }
+
+    // With the save media full, there's no room to copy a file to the file
+    // referencing it, so we can't unlink it. And overwriting the reference
+    // only frees up the space of the reference itself.
+    for (auto l : layouts) {
+        reset();
+
+        Platform pfrm(64 * 1024, ".regr_output");
+        initialize(pfrm, 8, l);
+
+        Vector<char> data(3000);
+        scramble(data, 1);
+        store_file_data(pfrm, "/big.dat", data);
+        store_file_data(pfrm, "/ref.dat", data);
+
+        Vector<char> block(1024);
+        for (int i = 0; i < 64; ++i) {
+            scramble(block, i + 2);
+            if (not store_file_data(
+                    pfrm, format("/fill/%.dat", i).c_str(), block)) {
+                break;
+            }
+        }
+
+        Vector<char> other(2000);
+        scramble(other, 99);
+        if (unlink_file(pfrm, "/big.dat") or
+            store_file_data(pfrm, "/ref.dat", other) or pfrm.overwrites_) {
+            return false;
+        }
+
+        for (auto path : {"/big.dat", "/ref.dat"}) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            if (out not_eq data) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool packed_files()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    static const int count = 70;
+
+    auto contents = [](int i) {
+        Vector<char> data(4 + i % 37);
+        scramble(data, i);
+        return data;
+    };
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<StringBuffer<32>> paths;
+        Vector<Vector<char>> data;
+        for (int i = 0; i < count; ++i) {
+            paths.push_back(format("/cfg/%.txt", i).c_str());
+            data.push_back(contents(i));
+        }
+
+        auto matches = [&](Platform& pfrm, int i) {
+            Vector<char> out;
+            read_file_data(pfrm, paths[i].c_str(), out);
+            return out == data[i] and
+                   file_size(pfrm, paths[i].c_str()) >= data[i].size() and
+                   file_exists(pfrm, paths[i].c_str());
+        };
+
+        auto listed = [&](Platform& pfrm) {
+            int result = 0;
+            walk(pfrm, [&](const char* path) {
+                if (starts_with("/cfg/", StringBuffer<32>(path))) {
+                    ++result;
+                }
+            });
+            return result;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            // An existing file gets replaced.
+            store_file_data(pfrm, paths[0].c_str(), "old", 3);
+
+            Vector<PackedFile> files;
+            u32 unpacked_size = 0;
+            for (int i = 0; i < count; ++i) {
+                files.push_back({paths[i].c_str(), &data[i]});
+                unpacked_size += sizeof(Record) + paths[i].length() +
+                                 paths[i].length() % 2 + data[i].size() +
+                                 data[i].size() % 2;
+            }
+
+            const auto written = pfrm.bytes_written_;
+            if (not store_packed_files(pfrm, files.data(), count) or
+                pack_records not_eq 3 or
+                pfrm.bytes_written_ - written > unpacked_size * 3 / 4) {
+                return false;
+            }
+
+            if (listed(pfrm) not_eq count) {
+                return false;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                if (not matches(pfrm, i)) {
+                    return false;
+                }
+            }
+
+            const auto skipped = statistics(pfrm).skipped_writes_;
+            store_file_data(pfrm, paths[1].c_str(), data[1]);
+            if (statistics(pfrm).skipped_writes_ not_eq skipped + 1) {
+                return false;
+            }
+
+            // Stores and appends move files out of their packs.
+            data[2] = contents(1000);
+            store_file_data(pfrm, paths[2].c_str(), data[2]);
+            append_file(pfrm, paths[3].c_str(), "xyz", 3);
+            data[3].push_back('x');
+            data[3].push_back('y');
+            data[3].push_back('z');
+            unlink_file(pfrm, paths[4].c_str());
+
+            if (not matches(pfrm, 2) or not matches(pfrm, 3) or
+                file_exists(pfrm, paths[4].c_str()) or
+                not matches(pfrm, 5)) {
+                return false;
+            }
+
+            // Removing the last files from a pack frees it.
+            for (int i = 62; i < count; ++i) {
+                unlink_file(pfrm, paths[i].c_str());
+            }
+            if (pack_records not_eq 2) {
+                return false;
+            }
+
+            // Of two files with the same path, the later one wins, and the
+            // pack only lists it once.
+            Vector<char> dup[] = {contents(2000), contents(2001)};
+            PackedFile dups[] = {{"/cfg/dup.txt", &dup[0]},
+                                 {paths[5].c_str(), &data[5]},
+                                 {"/cfg/dup.txt", &dup[1]}};
+            store_packed_files(pfrm, dups, 3);
+
+            Vector<char> out;
+            read_file_data(pfrm, "/cfg/dup.txt", out);
+            if (out not_eq dup[1] or listed(pfrm) not_eq 62 or
+                count_files(pfrm, "/cfg/") not_eq 62) {
+                return false;
+            }
+
+            compact(pfrm);
+
+            if (listed(pfrm) not_eq 62 or
+                count_files(pfrm, "/cfg/") not_eq 62) {
+                return false;
+            }
+
+            for (int i = 5; i < 62; ++i) {
+                if (not matches(pfrm, i)) {
+                    return false;
+                }
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (pack_records not_eq 3 or pfrm.overwrites_ or
+                listed(pfrm) not_eq 62 or
+                count_files(pfrm, "/cfg/") not_eq 62) {
+                return false;
+            }
+
+            for (int i = 0; i < 62; ++i) {
+                if (i == 4 ? file_exists(pfrm, paths[i].c_str())
+                           : not matches(pfrm, i)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool directory_ids()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        // NOTE: too small to be worth deduplicating.
+        Vector<char> data(20);
+        scramble(data, 1);
+
+        Vector<char> slot2;
+        Vector<char> lisp;
+
+        auto matches = [&](Platform& pfrm, const char* path, auto& expect) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            return out == expect;
+        };
+
+        // In sorted order, as the order of the log depends on the layout.
+        auto list = [&](Platform& pfrm, const char* directory) {
+            std::vector<std::string> names;
+            walk_directory(pfrm, directory, [&](const char* name) {
+                names.push_back(name);
+            });
+            std::sort(names.begin(), names.end());
+            std::string result;
+            for (auto& name : names) {
+                result += name + ";";
+            }
+            return result;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save/slot1.dat", data);
+
+            // The second file in the directory doesn't repeat the directory.
+            auto used = statistics(pfrm).bytes_used_;
+            store_file_data(pfrm, "/save/slot2.dat", data);
+            if (directories.size() not_eq 1 or
+                u32(statistics(pfrm).bytes_used_ - used) not_eq
+                    sizeof(Record) + 12 + data.size()) {
+                return false;
+            }
+
+            store_file_data(pfrm, "/mods/a.lisp", data);
+            store_file_data(pfrm, "/b.dat", data);
+            append_file(pfrm, "/save/slot2.dat", "ab", 2);
+            slot2 = data;
+            slot2.push_back('a');
+            slot2.push_back('b');
+
+            lisp = data;
+            lisp[4] = 'x';
+            store_file_data(pfrm, "/mods/a.lisp", lisp);
+
+            if (not matches(pfrm, "/mods/a.lisp", lisp) or
+                not file_exists(pfrm, "/save/slot1.dat") or
+                list(pfrm, "/save/") not_eq "slot1.dat;slot2.dat;" or
+                list(pfrm, "/mods/") not_eq "a.lisp;" or
+                list(pfrm, "/save/slot2") not_eq ".dat;" or
+                list(pfrm, "/") not_eq
+                    "b.dat;mods/a.lisp;save/slot1.dat;save/slot2.dat;") {
+                return false;
+            }
+
+            // Listing a directory that doesn't hold anything shouldn't have
+            // to read the names of files elsewhere.
+            const auto read = pfrm.bytes_read_;
+            if (list(pfrm, "/dlc/") not_eq "") {
+                return false;
+            }
+            const auto listing = pfrm.bytes_read_ - read;
+            list(pfrm, "/");
+            if (listing >= pfrm.bytes_read_ - read - listing) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/save/slot1.dat");
+            compact(pfrm);
+
+            if (file_exists(pfrm, "/save/slot1.dat") or
+                not matches(pfrm, "/save/slot2.dat", slot2) or
+                list(pfrm, "/save/") not_eq "slot2.dat;") {
+                return false;
+            }
+
+            // Once we run out of ids, names hold the whole path.
+            for (int i = 0; i < FS_DIRECTORIES + 2; ++i) {
+                store_file_data(pfrm, format("/dir%/file", i).c_str(), data);
+            }
+            const auto last = format("/dir%/file", FS_DIRECTORIES + 1);
+            if (not directories.full() or
+                not matches(pfrm, last.c_str(), data)) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (not directories.full() or
+                not matches(pfrm, "/mods/a.lisp", lisp) or
+                list(pfrm, "/save/") not_eq "slot2.dat;" or
+                not matches(pfrm, "/dir0/file", data) or pfrm.overwrites_) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool indexed_lookups()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data(20);
+
+        // The files under prefix, as listed with and without the index.
+        auto list = [&](Platform& pfrm, const char* prefix, bool indexed) {
+            const bool complete = index_complete;
+            index_complete = complete and indexed;
+
+            std::vector<std::string> names;
+            walk(pfrm, prefix, [&](const char* name) {
+                names.push_back(name);
+            });
+            if (not indexed) {
+                std::sort(names.begin(), names.end());
+            }
+
+            index_complete = complete;
+
+            std::string result;
+            for (auto& name : names) {
+                result += name + ";";
+            }
+            return result;
+        };
+
+        auto consistent = [&](Platform& pfrm) {
+            return index_complete and
+                   list(pfrm, "/", true) == list(pfrm, "/", false);
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            for (int i = 0; i < 30; ++i) {
+                scramble(data, i);
+                store_file_data(pfrm, format("/save/%.dat", i).c_str(), data);
+            }
+            for (int i = 0; i < 10; ++i) {
+                scramble(data, 100 + i);
+                store_file_data(pfrm, format("/mods/%.lisp", i).c_str(), data);
+            }
+
+            Vector<char> cfg[3];
+            const char* cfg_paths[] = {"/cfg/c", "/cfg/a", "/cfg/b"};
+            Vector<PackedFile> files;
+            for (int i = 0; i < 3; ++i) {
+                cfg[i].push_back('0' + i);
+                files.push_back({cfg_paths[i], &cfg[i]});
+            }
+            store_packed_files(pfrm, files.data(), 3);
+
+            if (not consistent(pfrm) or file_index.size() not_eq 43 or
+                count_files(pfrm, "/save/") not_eq 30 or
+                count_files(pfrm, "/save/1") not_eq 11 or
+                count_files(pfrm, "/mods/") not_eq 10 or
+                count_files(pfrm, "/") not_eq 43 or
+                count_files(pfrm, "/dlc/") not_eq 0 or
+                list(pfrm, "/cfg/", true) not_eq "/cfg/a;/cfg/b;/cfg/c;") {
+                return false;
+            }
+
+            // Finding the last file written shouldn't have to read every name
+            // in the log.
+            auto read = pfrm.bytes_read_;
+            Vector<char> out;
+            file_size(pfrm, "/mods/9.lisp");
+            const auto indexed = pfrm.bytes_read_ - read;
+
+            index_complete = false;
+            read = pfrm.bytes_read_;
+            file_size(pfrm, "/mods/9.lisp");
+            const auto scanned = pfrm.bytes_read_ - read;
+            index_complete = true;
+
+            scramble(data, 109);
+            read_file_data(pfrm, "/mods/9.lisp", out);
+            if (out not_eq data or indexed * 2 > scanned) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/save/3.dat");
+            unlink_file(pfrm, "/cfg/b");
+            scramble(data, 200);
+            store_file_data(pfrm, "/save/4.dat", data);
+            store_file_data(pfrm, "/cfg/a", data);
+            append_file(pfrm, "/mods/0.lisp", "ab", 2);
+
+            if (not consistent(pfrm) or file_exists(pfrm, "/save/3.dat") or
+                count_files(pfrm, "/save/") not_eq 29 or
+                count_files(pfrm, "/cfg/") not_eq 2 or
+                not file_exists(pfrm, "/cfg/c")) {
+                return false;
+            }
+
+            Vector<char> rewritten;
+            read_file_data(pfrm, "/save/4.dat", rewritten);
+            if (rewritten not_eq data) {
+                return false;
+            }
+
+            compact(pfrm);
+
+            if (not consistent(pfrm) or count_files(pfrm, "/") not_eq 41) {
+                return false;
+            }
+
+            // Past FS_INDEX_SIZE files, we search the log instead.
+            for (int i = 0; i < FS_INDEX_SIZE; ++i) {
+                scramble(data, 300 + i);
+                store_file_data(pfrm, format("/dlc/%", i).c_str(), data);
+            }
+
+            if (index_complete or
+                count_files(pfrm, "/dlc/") not_eq FS_INDEX_SIZE or
+                not file_exists(pfrm, "/dlc/0") or
+                not file_exists(pfrm, "/save/0.dat")) {
+                return false;
+            }
+
+            for (int i = 0; i < FS_INDEX_SIZE; ++i) {
+                unlink_file(pfrm, format("/dlc/%", i).c_str());
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            scramble(data, 200);
+            Vector<char> out;
+            read_file_data(pfrm, "/cfg/a", out);
+
+            if (not consistent(pfrm) or out not_eq data or
+                count_files(pfrm, "/") not_eq 41 or
+                count_files(pfrm, "/dlc/") not_eq 0 or pfrm.overwrites_) {
+                return false;
+            }
+        }
+
+        reset();
+
+        // A callback that writes files may move the records that we're about
+        // to list, which shouldn't garble the names that we pass it.
+        {
+            Platform pfrm(8 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            // Leave a gap in front of the files, so that compaction moves them.
+            Vector<char> junk(sector_avail(pfrm) - 600);
+            scramble(junk, 1);
+            store_file_data(pfrm, "/junk.dat", junk);
+
+            for (int i = 0; i < 6; ++i) {
+                scramble(data, i);
+                store_file_data(pfrm, format("/save/%.dat", i).c_str(), data);
+            }
+
+            unlink_file(pfrm, "/junk.dat");
+
+            const auto moves = record_moves;
+
+            std::string names;
+            walk(pfrm, "/save/", [&](const char* name) {
+                if (names.empty()) {
+                    Vector<char> big(1000);
+                    scramble(big, 2);
+                    store_file_data(pfrm, "/big.dat", big);
+                }
+                names += std::string(name) + ";";
+            });
+
+            if (record_moves == moves or
+                names not_eq "/save/0.dat;/save/1.dat;/save/2.dat;"
+                              "/save/3.dat;/save/4.dat;/save/5.dat;") {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool directory_filter()
+{
+    reset();
+
+    Vector<char> data(20);
+    scramble(data, 1);
+
+    {
+        Platform pfrm(64 * 1024, ".regr_output");
+        initialize(pfrm, 8);
+
+        store_file_data(pfrm, "/save/slot2/a.dat", data);
+        store_file_data(pfrm, "/save/slot2/b.dat", data);
+        store_file_data(pfrm, "/config.ini", data);
+
+        if (not directory_exists(pfrm, "/save/") or
+            not directory_exists(pfrm, "/save/slot2/") or
+            not directory_exists(pfrm, "/") or
+            not directory_exists(pfrm, "/sa") or
+            directory_exists(pfrm, "/save/slot1/")) {
+            return false;
+        }
+
+        // Probing for optional directories shouldn't touch the save media.
+        const auto read = pfrm.bytes_read_;
+        int listed = 0;
+        walk_directory(pfrm, "/dlc/", [&](const char*) { ++listed; });
+        if (directory_exists(pfrm, "/mods/") or
+            count_files(pfrm, "/dlc/") or listed or
+            pfrm.bytes_read_ not_eq read) {
+            return false;
+        }
+
+        // Nor should it, after we search the log instead of the file index.
+        index_complete = false;
+        if (directory_exists(pfrm, "/mods/") or
+            pfrm.bytes_read_ not_eq read or
+            not directory_exists(pfrm, "/save/slot2/")) {
+            return false;
+        }
+        index_complete = true;
+
+        unlink_file(pfrm, "/save/slot2/a.dat");
+        if (not directory_exists(pfrm, "/save/slot2/")) {
+            return false;
+        }
+
+        unlink_file(pfrm, "/save/slot2/b.dat");
+        if (directory_exists(pfrm, "/save/slot2/") or
+            directory_exists(pfrm, "/save/") or
+            not directory_exists(pfrm, "/")) {
+            return false;
+        }
+
+        store_file_data(pfrm, "/mods/a.lisp", data);
+    }
+
+    reset();
+
+    {
+        Platform pfrm(".regr_output", ".regr_output2");
+        initialize(pfrm, 8);
+
+        if (not directory_exists(pfrm, "/mods/") or
+            directory_exists(pfrm, "/save/")) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+bool prefix_removal()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data(40);
+        scramble(data, 1);
+
+        auto matches = [&](Platform& pfrm, const char* path, auto& expect) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            return out == expect;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            for (auto slot : {"/save/slot1/", "/save/slot2/"}) {
+                for (auto file : {"a.dat", "b.dat", "c.dat"}) {
+                    store_file_data(
+                        pfrm, format("%%", slot, file).c_str(), data);
+                    scramble(data, data[0]);
+                }
+            }
+
+            // Something of every kind of record.
+            auto patched = data;
+            store_file_data(pfrm, "/save/slot2/b.dat", data);
+            patched[3] = 'x';
+            store_file_data(pfrm, "/save/slot2/b.dat", patched);
+            append_file(pfrm, "/save/slot2/c.dat", "ab", 2);
+            create_circular_log(pfrm, "/save/slot2/log.txt", 64);
+            append_file(pfrm, "/save/slot2/log.txt", "entry", 5);
+            add_counter(pfrm, "/save/slot2/time", 5);
+
+            Vector<char> cfg[2];
+            cfg[0].push_back('1');
+            cfg[1].push_back('2');
+            PackedFile files[] = {{"/save/slot2/cfg", &cfg[0]},
+                                  {"/settings", &cfg[1]}};
+            store_packed_files(pfrm, files, 2);
+
+            // A file elsewhere sharing the contents of one being removed.
+            Vector<char> shared;
+            read_file_data(pfrm, "/save/slot2/a.dat", shared);
+            store_file_data(pfrm, "/backup.dat", shared);
+            if (not reference_records) {
+                return false;
+            }
+
+            const auto gaps = gap_space;
+            const auto r = remove_prefix(pfrm, "/save/slot2/");
+
+            if (r.count_ not_eq 6 or r.bytes_freed_ == 0 or
+                r.bytes_freed_ > gap_space - gaps or
+                count_files(pfrm, "/save/slot2/") or
+                directory_exists(pfrm, "/save/slot2/") or
+                file_exists(pfrm, "/save/slot2/time") or
+                file_exists(pfrm, "/save/slot2/cfg") or
+                count_files(pfrm, "/save/slot1/") not_eq 3 or
+                not matches(pfrm, "/backup.dat", shared) or
+                not matches(pfrm, "/settings", cfg[1]) or patch_records or
+                extent_records or entry_records) {
+                return false;
+            }
+
+            const auto again = remove_prefix(pfrm, "/save/slot2/");
+            if (again.count_ or again.bytes_freed_) {
+                return false;
+            }
+
+            compact(pfrm);
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            int listed = 0;
+            walk(pfrm, [&](const char* path) {
+                if (starts_with("/save/slot2/", StringBuffer<32>(path))) {
+                    ++listed;
+                }
+            });
+
+            if (listed or count_files(pfrm, "/save/slot1/") not_eq 3 or
+                not file_exists(pfrm, "/backup.dat") or pfrm.overwrites_) {
+                return false;
+            }
+        }
+    }
+
+    // With the save media full, there's no room to give a file elsewhere a
+    // copy of the file under the prefix that it references, so we have to
+    // keep all of them. NOTE: the segmented layout fills hot and cold files
+    // into segments of their own, so it usually has room left in one of them.
+    for (auto l : {single_log, dual_log}) {
+        reset();
+
+        Platform pfrm(64 * 1024, ".regr_output");
+        initialize(pfrm, 8, l);
+
+        Vector<char> data(3000);
+        scramble(data, 1);
+        for (int i = 0; i < 8; ++i) {
+            scramble(data, i);
+            store_file_data(pfrm, format("/x/f%.txt", i).c_str(), data);
+        }
+        store_file_data(pfrm, "/y/ref.txt", data);
+
+        int count = 0;
+        for (int size : {1024, 256, 64}) {
+            Vector<char> block(size);
+            for (; count < 256; ++count) {
+                scramble(block, count + 100);
+                if (not store_file_data(
+                        pfrm, format("/fill/%.dat", count).c_str(), block)) {
+                    break;
+                }
+            }
+        }
+
+        const auto removed = remove_prefix(pfrm, "/x/");
+        if (removed.count_ or removed.bytes_freed_ or
+            count_files(pfrm, "/x/") not_eq 8) {
+            return false;
+        }
+
+        for (auto path : {"/x/f7.txt", "/y/ref.txt"}) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            if (out not_eq data) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+
+bool metadata_renames()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data(200);
+        scramble(data, 1);
+
+        Vector<char> other(100);
+        scramble(other, 2);
+
+        auto matches = [&](Platform& pfrm, const char* path, auto& expect) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            return out == expect;
+        };
+
+        // Both with and without the file index.
+        auto list = [&](Platform& pfrm) {
+            std::string result[2];
+            for (auto& r : result) {
+                std::vector<std::string> names;
+                walk(pfrm, [&](const char* name) {
+                    if (name[0] not_eq '(') {
+                        names.push_back(name);
+                    }
+                });
+                std::sort(names.begin(), names.end());
+                for (auto& name : names) {
+                    r += name + ";";
+                }
+                index_complete = not index_complete;
+            }
+            return result[0] == result[1] ? result[0] : "mismatch";
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save/a.dat", data);
+            store_file_data(pfrm, "/other.dat", other);
+
+            // Costs a small header, rather than a copy of the file.
+            auto written = pfrm.bytes_written_;
+            if (not rename_file(pfrm, "/save/a.dat", "/save/b.dat") or
+                pfrm.bytes_written_ - written > 32 or
+                file_exists(pfrm, "/save/a.dat") or
+                not matches(pfrm, "/save/b.dat", data) or
+                file_size(pfrm, "/save/b.dat") not_eq data.size() or
+                list(pfrm) not_eq "/other.dat;/save/b.dat;" or
+                count_files(pfrm, "/save/") not_eq 1) {
+                return false;
+            }
+
+            // Renaming it again replaces the rename record.
+            written = pfrm.bytes_written_;
+            if (not rename_file(pfrm, "/save/b.dat", "/c.dat") or
+                pfrm.bytes_written_ - written > 32 or
+                renamed_files.size() not_eq 1 or
+                file_exists(pfrm, "/save/b.dat") or
+                not matches(pfrm, "/c.dat", data)) {
+                return false;
+            }
+
+            // The old name is free to use.
+            store_file_data(pfrm, "/save/a.dat", other);
+            if (not matches(pfrm, "/save/a.dat", other) or
+                not matches(pfrm, "/c.dat", data)) {
+                return false;
+            }
+
+            // Replaces an existing file.
+            if (not rename_file(pfrm, "/c.dat", "/other.dat") or
+                file_exists(pfrm, "/c.dat") or
+                not matches(pfrm, "/other.dat", data) or
+                list(pfrm) not_eq "/other.dat;/save/a.dat;") {
+                return false;
+            }
+
+            // Unlinking a renamed file unlinks its original record.
+            rename_file(pfrm, "/save/a.dat", "/d.dat");
+            const auto gaps = gap_space;
+            unlink_file(pfrm, "/d.dat");
+            if (file_exists(pfrm, "/d.dat") or
+                file_exists(pfrm, "/save/a.dat") or
+                gap_space - gaps < other.size() or
+                renamed_files.size() not_eq 1) {
+                return false;
+            }
+
+            // Packed files get copied.
+            Vector<char> cfg(10);
+            scramble(cfg, 3);
+            PackedFile files[] = {{"/cfg/x", &cfg}, {"/cfg/y", &cfg}};
+            store_packed_files(pfrm, files, 2);
+            add_counter(pfrm, "/time", 5);
+
+            if (not rename_file(pfrm, "/cfg/x", "/cfg/z") or
+                file_exists(pfrm, "/cfg/x") or
+                not matches(pfrm, "/cfg/z", cfg) or
+                rename_file(pfrm, "/time", "/clock") or
+                rename_file(pfrm, "/missing", "/found") or
+                file_exists(pfrm, "/found")) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (renamed_files.size() not_eq 1 or
+                not matches(pfrm, "/other.dat", data) or
+                list(pfrm) not_eq "/cfg/y;/cfg/z;/other.dat;/time;") {
+                return false;
+            }
+
+            // Compaction folds the rename into a record of its own. Segments
+            // only get cleaned when they hold dead records, so clean the
+            // renamed file's segment by hand.
+            compact(pfrm);
+            if (l == segmented_log and not renamed_files.empty()) {
+                clean_segment(pfrm, segment_of(renamed_files[0].target_));
+            }
+
+            if (not renamed_files.empty() or
+                not matches(pfrm, "/other.dat", data) or
+                list(pfrm) not_eq "/cfg/y;/cfg/z;/other.dat;/time;" or
+                pfrm.overwrites_) {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output2", ".regr_output3");
+            initialize(pfrm, 8);
+
+            if (not matches(pfrm, "/other.dat", data) or
+                read_counter(pfrm, "/time") not_eq 5 or
+                list(pfrm) not_eq "/cfg/y;/cfg/z;/other.dat;/time;") {
+                return false;
+            }
+        }
+
+        if (l not_eq segmented_log) {
+            continue;
+        }
+
+        // Leave it to the cleaner to move renamed files and their rename
+        // records, including a name too long for emit_renamed's data buffer.
+        const std::string long_name = "/save/" + std::string(100, 'x');
+
+        reset();
+
+        {
+            Platform pfrm(32 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/a.dat", data);
+            store_file_data(pfrm, "/b.dat", other);
+
+            if (not rename_file(pfrm, "/a.dat", long_name.c_str()) or
+                not rename_file(pfrm, "/b.dat", "/c.dat") or
+                not rename_file(pfrm, "/c.dat", "/d.dat") or
+                renamed_files.size() not_eq 2) {
+                return false;
+            }
+
+            Vector<char> save(1000);
+            for (int i = 0; i < 200; ++i) {
+                scramble(save, i);
+                store_file_data(pfrm, "/save.dat", save);
+
+                for (int j = 0; j < 64 and idle(pfrm); ++j)
+                    ;
+            }
+
+            const auto expect = "/d.dat;/save.dat;" + long_name + ";";
+            if (not renamed_files.empty() or
+                not matches(pfrm, long_name.c_str(), data) or
+                not matches(pfrm, "/d.dat", other) or
+                file_exists(pfrm, "/a.dat") or file_exists(pfrm, "/c.dat") or
+                list(pfrm) not_eq expect or count_files(pfrm, "/") not_eq 3) {
+                return false;
+            }
+
+            // And once more, now that the renames have been folded away.
+            if (not rename_file(pfrm, long_name.c_str(), "/e.dat") or
+                not matches(pfrm, "/e.dat", data) or
+                list(pfrm) not_eq "/d.dat;/e.dat;/save.dat;") {
+                return false;
+            }
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (not matches(pfrm, "/e.dat", data) or
+                not matches(pfrm, "/d.dat", other) or
+                list(pfrm) not_eq "/d.dat;/e.dat;/save.dat;" or
+                count_files(pfrm, "/") not_eq 3) {
+                return false;
+            }
+        }
     }
 
-    Record r;
+    return true;
+}
 
-    auto offset = find_file(pfrm, path, r);
-    if (offset == -1) {
-        return 0;
+
+
+bool cloned_files()
+{
+    static const Layout layouts[] = {single_log, dual_log, segmented_log};
+
+    for (auto l : layouts) {
+        reset();
+
+        Vector<char> data(300);
+        scramble(data, 1);
+
+        Vector<char> changed(300);
+        scramble(changed, 2);
+
+        auto matches = [&](Platform& pfrm, const char* path, auto& expect) {
+            Vector<char> out;
+            read_file_data(pfrm, path, out);
+            return out == expect;
+        };
+
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save/slot1.dat", data);
+
+            // Costs a header and a name, rather than a copy of the file.
+            const auto written = pfrm.bytes_written_;
+            if (not clone_file(pfrm, "/save/slot1.dat", "/save/slot3.dat") or
+                pfrm.bytes_written_ - written > 48 or
+                not matches(pfrm, "/save/slot3.dat", data) or
+                file_size(pfrm, "/save/slot3.dat") not_eq data.size() or
+                count_files(pfrm, "/save/") not_eq 2) {
+                return false;
+            }
+
+            // Rewriting the source leaves the clone as it was.
+            store_file_data(pfrm, "/save/slot1.dat", changed);
+            if (not matches(pfrm, "/save/slot1.dat", changed) or
+                not matches(pfrm, "/save/slot3.dat", data)) {
+                return false;
+            }
+
+            // And the other way around.
+            clone_file(pfrm, "/save/slot1.dat", "/save/slot2.dat");
+            store_file_data(pfrm, "/save/slot2.dat", data);
+            if (not matches(pfrm, "/save/slot1.dat", changed) or
+                not matches(pfrm, "/save/slot2.dat", data)) {
+                return false;
+            }
+
+            // A clone of a clone refers to the original.
+            clone_file(pfrm, "/save/slot1.dat", "/a.dat");
+            clone_file(pfrm, "/a.dat", "/b.dat");
+            unlink_file(pfrm, "/save/slot1.dat");
+            if (not matches(pfrm, "/a.dat", changed) or
+                not matches(pfrm, "/b.dat", changed)) {
+                return false;
+            }
+
+            // Clones of renamed files.
+            rename_file(pfrm, "/save/slot3.dat", "/renamed.dat");
+            clone_file(pfrm, "/renamed.dat", "/c.dat");
+            if (not matches(pfrm, "/c.dat", data) or
+                file_size(pfrm, "/c.dat") not_eq data.size()) {
+                return false;
+            }
+
+            unlink_file(pfrm, "/renamed.dat");
+            if (file_exists(pfrm, "/renamed.dat") or
+                not matches(pfrm, "/c.dat", data)) {
+                return false;
+            }
+
+            add_counter(pfrm, "/time", 5);
+            if (clone_file(pfrm, "/time", "/clock") or
+                clone_file(pfrm, "/missing", "/found") or
+                file_exists(pfrm, "/found")) {
+                return false;
+            }
+
+            clone_file(pfrm, "/c.dat", "/d.dat");
+            compact(pfrm);
+        }
+
+        reset();
+
+        {
+            Platform pfrm(".regr_output", ".regr_output2");
+            initialize(pfrm, 8);
+
+            if (not reference_records or
+                not matches(pfrm, "/save/slot2.dat", data) or
+                not matches(pfrm, "/a.dat", changed) or
+                not matches(pfrm, "/b.dat", changed) or
+                not matches(pfrm, "/c.dat", data) or
+                not matches(pfrm, "/d.dat", data) or pfrm.overwrites_) {
+                return false;
+            }
+        }
+
+        reset();
+
+        // With the save media full, there's no room to give the clone a copy
+        // of its source, so unlinking the source has to fail. NOTE: the
+        // segmented layout fills hot and cold files into segments of their
+        // own, so it may have room left for the copy.
+        {
+            Platform pfrm(64 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
+
+            store_file_data(pfrm, "/save/slot1.dat", data);
+            clone_file(pfrm, "/save/slot1.dat", "/save/slot2.dat");
+
+            int count = 0;
+            for (int size : {1024, 256, 64}) {
+                Vector<char> block(size);
+                for (; count < 256; ++count) {
+                    scramble(block, count + 100);
+                    const auto path = format("/fill/%.dat", count);
+                    if (not store_file_data(pfrm, path.c_str(), block)) {
+                        break;
+                    }
+                }
+            }
+
+            const bool unlinked = unlink_file(pfrm, "/save/slot1.dat");
+            if ((unlinked and l not_eq segmented_log) or
+                not matches(pfrm, "/save/slot2.dat", data) or
+                count_files(pfrm, "/save/") not_eq (unlinked ? 1u : 2u) or
+                (not unlinked and
+                 not matches(pfrm, "/save/slot1.dat", data))) {
+                return false;
+            }
+        }
     }
 
-    return r.file_info_.data_length_.get();
+    return true;
 }
 
 
 
-u32 read_file_data(Platform& pfrm, const char* path, Vector<char>& output)
+bool hot_first_compaction()
 {
-    if (not __path_cache_file_exists_maybe(path)) {
-        return 0;
+    Platform pfrm(".regr_input", ".regr_output");
+    initialize(pfrm, 8);
+
+    Vector<char> data;
+    for (int i = 0; i < 64; ++i) {
+        data.push_back('h');
     }
 
-    Record r;
+    store_file_data(pfrm, "/cold1.dat", data);
+    store_file_data(pfrm, "/cold2.dat", data);
+    store_file_data(pfrm, "/hot.dat", data);
 
-    auto offset = find_file(pfrm, path, r);
-    if (offset == -1) {
-        return 0;
+    for (int i = 0; i < 5; ++i) {
+        Vector<char> out;
+        read_file_data(pfrm, "/hot.dat", out);
+    }
+
+    // Leave a gap in front of the hot file.
+    store_file_data(pfrm, "/cold1.dat", data);
+
+    compact(pfrm);
+
+    int index = 0;
+    int hot_index = -1;
+    int cold_index = -1;
+    walk(pfrm, [&](const char* path) {
+        if (str_eq(path, "/hot.dat")) {
+            hot_index = index;
+        } else if (str_eq(path, "/cold2.dat")) {
+            cold_index = index;
+        }
+        ++index;
+    });
+
+    if (hot_index == -1 or cold_index == -1 or hot_index > cold_index) {
+        return false;
     }
 
-    offset += sizeof r;
-    offset += r.file_info_.name_length_;
+    Vector<char> out;
+    read_file_data(pfrm, "/hot.dat", out);
+
+    return out.size() == data.size() and gap_space == 0;
+}
+
 
-    for (int i = 0; i < r.file_info_.data_length_.get(); ++i) {
-        char val;
-        pfrm.read_save_data(&val, 1, offset++);
-        output.push_back(val);
+
+bool dual_layout()
+{
+    Vector<char> v1;
+    for (int i = 0; i < 3000; ++i) {
+        v1.push_back('a' + i % 26);
     }
 
-    if (r.file_info_.flags_[0] & Record::FileInfo::Flags0::has_end_padding) {
-        output.pop_back();
+    Vector<char> v2;
+    for (int i = 0; i < 501; ++i) {
+        v2.push_back('z');
     }
 
-    return output.size();
+    auto check = [](Platform& pfrm, const char* path, Vector<char>& expected) {
+        Vector<char> data;
+        read_file_data(pfrm, path, data);
+        if (data.size() not_eq expected.size()) {
+            return false;
+        }
+        for (u32 i = 0; i < data.size(); ++i) {
+            if (data[i] not_eq expected[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    {
+        Platform pfrm(64 * 1024, ".regr_output");
+        if (initialize(pfrm, 8, dual_log) not_eq initialized) {
+            return false;
+        }
+
+        // Fill up the first region, to trigger compaction.
+        for (int i = 0; i < 20; ++i) {
+            scramble(v1, i);
+            scramble(v2, i + 1000);
+            store_file_data(pfrm, "/a.dat", v1);
+            store_file_data(pfrm, "/b.dat", v2);
+        }
+
+        if (generation < 2 or not check(pfrm, "/a.dat", v1) or
+            not check(pfrm, "/b.dat", v2)) {
+            return false;
+        }
+    }
+
+    const auto gen = generation;
+
+    {
+        // Lose power partway through compaction.
+        reset();
+        Platform pfrm(".regr_output", ".regr_output2");
+        initialize(pfrm, 8, dual_log);
+
+        if (layout not_eq dual_log or generation not_eq gen) {
+            return false;
+        }
+
+        pfrm.writes_until_power_loss_ = 4;
+        compact(pfrm);
+    }
+
+    reset();
+    Platform pfrm(".regr_output2", ".regr_output3");
+    initialize(pfrm, 8, dual_log);
+
+    if (generation not_eq gen) {
+        return false;
+    }
+
+    return check(pfrm, "/a.dat", v1) and check(pfrm, "/b.dat", v2);
 }
 
 
 
-} // namespace flash_filesystem
+bool segmented_layout()
+{
+    auto contents = [](int seed, int size) {
+        Vector<char> result;
+        for (int i = 0; i < size; ++i) {
+            result.push_back('a' + (seed + i) % 26);
+        }
+        scramble(result, seed);
+        return result;
+    };
+
+    auto check = [](Platform& pfrm, const char* path, Vector<char> expected) {
+        Vector<char> data;
+        read_file_data(pfrm, path, data);
+        if (data.size() not_eq expected.size()) {
+            return false;
+        }
+        for (u32 i = 0; i < data.size(); ++i) {
+            if (data[i] not_eq expected[i]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    static const int rounds = 400;
 
+    {
+        Platform pfrm(32 * 1024, ".regr_output");
+        if (initialize(pfrm, 8, segmented_log) not_eq initialized or
+            layout not_eq segmented_log) {
+            return false;
+        }
 
+        // A file that never changes, followed by lots of autosaves.
+        auto static_data = contents(0, 1000);
+        store_file_data(pfrm, "/static.dat", static_data);
 
-#ifdef __TEST__
+        for (int i = 0; i < rounds; ++i) {
+            auto save = contents(i, 700);
+            auto log = contents(i, 301);
+            if (not store_file_data(pfrm, "/save.dat", save) or
+                not store_file_data(pfrm, "/log.dat", log)) {
+                return false;
+            }
+        }
+
+        if (not check(pfrm, "/static.dat", contents(0, 1000)) or
+            not check(pfrm, "/save.dat", contents(rounds - 1, 700)) or
+            not check(pfrm, "/log.dat", contents(rounds - 1, 301))) {
+            return false;
+        }
+
+        // Every segment should have been erased about as many times as the
+        // others, including the one that held the static file.
+        u32 min = 0xffffffff;
+        u32 max = 0;
+        for (u32 i = 0; i < segments.size(); ++i) {
+            const auto erases = pfrm.erases_[segment_base + i * segment_size];
+            min = erases < min ? erases : min;
+            max = erases > max ? erases : max;
+        }
 
+        if (min == 0 or max > 2 * min) {
+            return false;
+        }
+    }
 
+    const auto gen = generation;
 
-namespace flash_filesystem
+    reset();
+    Platform pfrm(".regr_output", ".regr_output2");
+    initialize(pfrm, 8);
+
+    if (layout not_eq segmented_log or statistics(pfrm).generation_ not_eq gen) {
+        return false;
+    }
+
+    auto save = contents(rounds, 700);
+    store_file_data(pfrm, "/save.dat", save);
+    compact(pfrm);
+
+    return gap_space == 0 and
+           check(pfrm, "/static.dat", contents(0, 1000)) and
+           check(pfrm, "/save.dat", contents(rounds, 700)) and
+           check(pfrm, "/log.dat", contents(rounds - 1, 301));
+}
+
+
+
+bool cost_benefit_cleaning()
+{
+    Platform pfrm(32 * 1024, ".regr_output");
+    initialize(pfrm, 8, segmented_log);
+
+    Vector<char> data;
+    for (int i = 0; i < 1000; ++i) {
+        data.push_back('c');
+    }
+    scramble(data, 1 << 16);
+
+    // An old segment holding files that rarely change, one of them deleted.
+    for (int i = 0; i < 3; ++i) {
+        store_file_data(pfrm, format<32>("/cold/%.dat", i).c_str(), data);
+    }
+    const int cold_segment = active_segments[cold];
+    unlink_file(pfrm, "/cold/0.dat");
+
+    // A newer segment holding mostly dead copies of a file that we keep
+    // saving.
+    int hot_segment = -1;
+    for (int i = 0;; ++i) {
+        scramble(data, i);
+        store_file_data(pfrm, "/hot.dat", data);
+        if (hot_segment == -1) {
+            hot_segment = active_segments[hot];
+        } else if (active_segments[hot] not_eq hot_segment) {
+            break;
+        }
+    }
+
+    if (cold_segment == hot_segment or segments[cold_segment].dead_ == 0 or
+        segments[hot_segment].dead_ <= segments[cold_segment].dead_) {
+        return false;
+    }
+
+    // The oldest segment would be the first choice for a fifo cleaner, but the
+    // newer one is cheaper to clean and frees up more space.
+    if (clean_victim() not_eq hot_segment or
+        not clean_segment(pfrm, hot_segment)) {
+        return false;
+    }
+
+    Vector<char> out;
+    read_file_data(pfrm, "/hot.dat", out);
+
+    return out.size() == data.size() and file_exists(pfrm, "/cold/1.dat") and
+           segments[hot_segment].sequence_ == 0;
+}
+
+
+
+bool hot_cold_separation()
+{
+    Platform pfrm(32 * 1024, ".regr_output");
+    initialize(pfrm, 8, segmented_log);
+
+    auto temperature_of = [&](const char* path) {
+        Record r;
+        const auto offset = find_file(pfrm, path, r);
+        SegmentHeader header;
+        pfrm.read_save_data(
+            &header, sizeof header, segment_begin(segment_of(offset)));
+        return header.temperature_.get();
+    };
+
+    Vector<char> data;
+    for (int i = 0; i < 1000; ++i) {
+        data.push_back('m');
+    }
+    scramble(data, 1 << 16);
+
+    for (int i = 0; i < 4; ++i) {
+        store_file_data(pfrm, format<32>("/mods/%.dat", i).c_str(), data);
+    }
+
+    data.resize(400);
+
+    static const int saves = 300;
+    for (int i = 0; i < saves; ++i) {
+        scramble(data, i);
+        store_file_data(pfrm, "/save.dat", data);
+    }
+
+    // Old autosaves should have piled up in hot segments, not next to the
+    // mods. The first autosave went to a cold segment, as we hadn't seen it
+    // written before.
+    u32 cold_dead = 0;
+    for (auto index : segment_order) {
+        SegmentHeader header;
+        pfrm.read_save_data(&header, sizeof header, segment_begin(index));
+        if (header.temperature_.get() == cold) {
+            cold_dead += segments[index].dead_;
+        }
+    }
+
+    if (cold_dead > sizeof(Record) + 10 + data.size()) {
+        return false;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        if (temperature_of(format<32>("/mods/%.dat", i).c_str()) not_eq cold) {
+            return false;
+        }
+    }
+
+    Vector<char> out;
+    read_file_data(pfrm, "/save.dat", out);
+
+    return temperature_of("/save.dat") == hot and out == data;
+}
+
+
+
+bool deferred_erase()
 {
+    Vector<char> data;
+    for (int i = 0; i < 600; ++i) {
+        data.push_back('s');
+    }
+
+    {
+        Platform pfrm(32 * 1024, ".regr_output");
+        initialize(pfrm, 8, segmented_log);
+
+        // As long as we give it some idle time between saves, the filesystem
+        // should never need to erase anything while storing a file.
+        u32 store_erases = 0;
+        for (int i = 0; i < 200; ++i) {
+            scramble(data, i);
+            const auto before = pfrm.erase_count_;
+            store_file_data(
+                pfrm, format<32>("/save%.dat", i % 3).c_str(), data);
+            store_erases += pfrm.erase_count_ - before;
+
+            for (int j = 0; j < 64 and idle(pfrm); ++j)
+                ;
+        }
+
+        if (store_erases not_eq 0 or not erase_queue.empty()) {
+            return false;
+        }
+
+        // Without idle time, we fall back to erasing while storing. Segments
+        // that we cleaned but didn't erase yet shouldn't confuse a remount.
+        for (int i = 200; i < 260; ++i) {
+            scramble(data, i);
+            store_file_data(
+                pfrm, format<32>("/save%.dat", i % 3).c_str(), data);
+        }
+    }
 
+    reset();
+    Platform pfrm(".regr_output", ".regr_output2");
+    if (initialize(pfrm, 8) not_eq already_initialized) {
+        return false;
+    }
 
+    for (int i = 257; i < 260; ++i) {
+        Vector<char> out;
+        read_file_data(pfrm, format<32>("/save%.dat", i % 3).c_str(), out);
+        scramble(data, i);
+        if (out not_eq data) {
+            return false;
+        }
+    }
 
-void reset()
-{
-    start_offset = 0;
-    end_offset = 0;
-    gap_space = 0;
+    return true;
 }
 
 
 
-bool basic_readwrite()
+bool idle_cleaning()
 {
-    Platform pfrm(".regr_input", ".regr_output");
-    initialize(pfrm, 8);
+    Platform pfrm(32 * 1024, ".regr_output");
+    initialize(pfrm, 8, segmented_log);
+
+    // Records that we keep counts of, so that lookups can skip searching the
+    // log when there aren't any: a reference, a pack, and the entries of a
+    // circular log.
+    Vector<char> data(600);
+    scramble(data, 1);
+    store_file_data(pfrm, "/a.dat", data);
+    store_file_data(pfrm, "/b.dat", data);
+
+    Vector<char> cfg[2];
+    cfg[0].push_back('1');
+    cfg[1].push_back('2');
+    PackedFile files[] = {{"/cfg/x", &cfg[0]}, {"/cfg/y", &cfg[1]}};
+    store_packed_files(pfrm, files, 2);
+
+    create_circular_log(pfrm, "/debug.log", 64);
+    append_file(pfrm, "/debug.log", "entry", 5);
 
-    Vector<char> v1;
-    for (int i = 0; i < 21; ++i) {
-        v1.push_back('a');
+    Record r;
+    const auto before = find_file(pfrm, "/b.dat", r);
+
+    if (reference_records not_eq 1 or pack_records not_eq 1 or
+        entry_records not_eq 1) {
+        return false;
     }
 
-    flash_filesystem::store_file_data(pfrm, "/tmp/rwtest.dat", v1);
+    // Keep saving another file, with idle time in between, until the cleaner
+    // has moved everything a few times over.
+    Vector<char> save(1000);
+    for (int i = 0; i < 300; ++i) {
+        scramble(save, i);
+        store_file_data(pfrm, "/save.dat", save);
 
-    Vector<char> v2;
+        for (int j = 0; j < 64 and idle(pfrm); ++j)
+            ;
+    }
 
-    flash_filesystem::read_file_data(pfrm, "/tmp/rwtest.dat", v2);
+    if (find_file(pfrm, "/b.dat", r) == before or reference_records not_eq 1 or
+        pack_records not_eq 1 or entry_records not_eq 1) {
+        return false;
+    }
 
-    if (v1.size() not_eq v2.size()) {
+    // Each of these would skip the log if we'd lost count.
+    unlink_file(pfrm, "/a.dat");
+
+    Vector<char> out;
+    read_file_data(pfrm, "/b.dat", out);
+    if (out not_eq data) {
         return false;
     }
 
-    for (u32 i = 0; i < v1.size(); ++i) {
-        if (v1[i] not_eq v2[i]) {
-            return false;
-        }
+    out.clear();
+    read_file_data(pfrm, "/cfg/y", out);
+    if (out not_eq cfg[1]) {
+        return false;
     }
 
-    return true;
+    out.clear();
+    read_file_data(pfrm, "/debug.log", out);
+    return out.size() == 5 and out[0] == 'e';
 }
 
 
 
-bool persistence()
+bool wear_counters()
 {
-    Vector<char> v1;
-    for (int i = 0; i < 21; ++i) {
-        v1.push_back('a');
-    }
+    struct Zone
+    {
+        u32 offset_;
+        u32 erase_count_;
+    };
 
-    Vector<char> v2;
-    for (int i = 0; i < 20; ++i) {
-        v1.push_back('b');
-    }
+    // Compare each zone's erase count against the number of erases that the
+    // test platform saw at the beginning of the zone.
+    auto report = [](Platform& pfrm, Buffer<Zone, FS_MAX_SEGMENTS>& zones) {
+        zones.clear();
+        bool ok = true;
+        wear_report(pfrm, [&](u32 offset, u32, u32 erase_count) {
+            ok = ok and erase_count == pfrm.erases_[offset];
+            zones.push_back({offset, erase_count});
+        });
+        return ok and not zones.empty();
+    };
 
-    {
-        Platform pfrm(".regr_input", ".regr_output");
-        initialize(pfrm, 8);
+    auto collect = [](Platform& pfrm, Buffer<Zone, FS_MAX_SEGMENTS>& zones) {
+        zones.clear();
+        wear_report(pfrm, [&](u32 offset, u32, u32 erase_count) {
+            zones.push_back({offset, erase_count});
+        });
+    };
 
-        flash_filesystem::store_file_data(pfrm, "/tmp/ptest.dat", v1);
-        flash_filesystem::store_file_data(pfrm, "/tmp/ptest2.dat", v2);
+    Vector<char> data;
+    for (int i = 0; i < 3000; ++i) {
+        data.push_back('w');
     }
 
-    {
+    for (auto l : {single_log, dual_log, segmented_log}) {
         reset();
-        Platform pfrm(".regr_output", ".regr_output2");
-        initialize(pfrm, 8);
 
-        Vector<char> v1_1;
-        Vector<char> v2_1;
+        Buffer<Zone, FS_MAX_SEGMENTS> zones;
 
-        flash_filesystem::read_file_data(pfrm, "/tmp/ptest.dat", v1_1);
-        flash_filesystem::read_file_data(pfrm, "/tmp/ptest2.dat", v2_1);
+        {
+            Platform pfrm(32 * 1024, ".regr_output");
+            initialize(pfrm, 8, l);
 
-        if (v1_1.size() not_eq v1.size() or v2_1.size() not_eq v2.size()) {
-            return false;
-        }
+            for (int i = 0; i < 40; ++i) {
+                scramble(data, i);
+                store_file_data(pfrm, "/wear.dat", data);
+            }
 
-        for (u32 i = 0; i < v1.size(); ++i) {
-            if (v1_1[i] not_eq v1[i]) {
+            if (not report(pfrm, zones) or
+                statistics(pfrm).max_erase_count_ < 2) {
                 return false;
             }
         }
 
-        for (u32 i = 0; i < v2.size(); ++i) {
-            if (v2_1[i] not_eq v2[i]) {
+        reset();
+        Platform pfrm(".regr_output", ".regr_output2");
+        initialize(pfrm, 8);
+
+        // The test platform doesn't remember erases from before the restart,
+        // but the filesystem should.
+        Buffer<Zone, FS_MAX_SEGMENTS> mounted;
+        collect(pfrm, mounted);
+        if (mounted.size() not_eq zones.size()) {
+            return false;
+        }
+
+        for (u32 i = 0; i < zones.size(); ++i) {
+            if (mounted[i].offset_ not_eq zones[i].offset_ or
+                mounted[i].erase_count_ not_eq zones[i].erase_count_) {
                 return false;
             }
         }
@@ -1091,93 +9607,69 @@ bool persistence()
 
 
 
-bool compaction()
+bool scratch_arena_compaction()
 {
-    Buffer<std::pair<StringBuffer<68>, Vector<char>>, 9> files;
-
+    struct Config
     {
-        Platform pfrm(".regr_input", ".regr_output");
-        initialize(pfrm, 8);
+        u32 erase_unit_;
+        u32 arena_size_;
+    };
 
-        walk(pfrm, [&files, &pfrm](const char* path) {
-            Vector<char> file_data;
-            read_file_data(pfrm, path, file_data);
-            files.push_back({path, file_data});
-        });
+    // Large enough to stage everything, and then two sizes that can only
+    // stream.
+    static const Config configs[] = {{4096, 32768}, {4096, 4096}, {2, 64}};
 
-        compact(pfrm);
+    for (auto& config : configs) {
+        reset();
 
-        for (auto& kvp : files) {
-            Vector<char> data;
-            read_file_data(pfrm, kvp.first.c_str(), data);
+        static u8 arena[32768];
 
-            if (data.size() not_eq kvp.second.size()) {
-                return false;
-            }
+        Buffer<std::pair<StringBuffer<68>, Vector<char>>, 12> files;
 
-            for (u32 i = 0; i < data.size(); ++i) {
-                if (data[i] not_eq kvp.second[i]) {
-                    return false;
-                }
-            }
-        }
-    }
+        {
+            Platform pfrm(".regr_input", ".regr_output");
+            pfrm.erase_unit_ = config.erase_unit_;
+            initialize(pfrm, 8);
+            set_scratch_arena(arena, config.arena_size_);
 
-    // Persistence test: make sure everything comes up ok after a restart
-    // following compaction.
-    reset();
-    Platform pfrm(".regr_output", ".regr_output2");
-    initialize(pfrm, 8);
+            Vector<char> data;
+            for (int i = 0; i < 999; ++i) {
+                data.push_back('a' + i % 26);
+            }
+            scramble(data, 1);
+            store_file_data(pfrm, "/arena.dat", data);
 
-    if (end_offset not_eq 5396) {
-        return false;
-    }
+            StringBuffer<68> first;
+            walk(pfrm, [&first](const char* path) {
+                if (first.empty()) {
+                    first = path;
+                }
+            });
 
-    if (gap_space not_eq 0) {
-        return false;
-    }
+            // Leave a gap at the very beginning of the log.
+            unlink_file(pfrm, first.c_str());
 
-    for (auto& kvp : files) {
-        Vector<char> data;
-        read_file_data(pfrm, kvp.first.c_str(), data);
+            walk(pfrm, [&files, &pfrm](const char* path) {
+                Vector<char> file_data;
+                read_file_data(pfrm, path, file_data);
+                files.push_back({path, file_data});
+            });
 
-        if (data.size() not_eq kvp.second.size()) {
-            return false;
-        }
+            compact(pfrm);
 
-        for (u32 i = 0; i < data.size(); ++i) {
-            if (data[i] not_eq kvp.second[i]) {
+            if (gap_space not_eq 0) {
                 return false;
             }
         }
-    }
 
-    return true;
-}
-
-
-
-bool write_triggered_compaction()
-{
-    Buffer<std::pair<StringBuffer<68>, Vector<char>>, 9> files;
-
-    Vector<char> test;
-    for (int i = 0; i < 9999; ++i) {
-        test.push_back('A');
-    }
-
-    {
-        Platform pfrm(".regr_input", ".regr_output");
+        reset();
+        Platform pfrm(".regr_output", ".regr_output2");
+        pfrm.erase_unit_ = config.erase_unit_;
         initialize(pfrm, 8);
 
-        walk(pfrm, [&files, &pfrm](const char* path) {
-            Vector<char> file_data;
-            read_file_data(pfrm, path, file_data);
-            files.push_back({path, file_data});
-        });
-
-        // trigger compaction
-        store_file_data(pfrm, "/stuff.dat", test);
+        if (gap_space not_eq 0) {
+            return false;
+        }
 
         for (auto& kvp : files) {
             Vector<char> data;
@@ -1195,36 +9687,78 @@ bool write_triggered_compaction()
         }
     }
 
-    // Persistence test: make sure everything comes up ok after a restart
-    // following compaction.
-    reset();
-    Platform pfrm(".regr_output", ".regr_output2");
+    return true;
+}
+
+
+
+bool many_files_compaction()
+{
+    Platform pfrm(64 * 1024, ".regr_output");
+    pfrm.erase_unit_ = 2;
     initialize(pfrm, 8);
 
-    if (end_offset not_eq 15414) {
-        return false;
+    static const int file_count = 600;
+
+    auto path = [](int i) { return format<32>("/save/%.dat", i); };
+
+    for (int i = 0; i < file_count; ++i) {
+        Vector<char> data;
+        data.push_back(i % 128);
+        data.push_back(i / 128);
+        store_file_data(pfrm, path(i).c_str(), data);
     }
 
+    // Unlink the first file, so that compaction needs to move everything.
+    unlink_file(pfrm, path(0).c_str());
+    compact(pfrm);
+
     if (gap_space not_eq 0) {
         return false;
     }
 
-    for (auto& kvp : files) {
+    for (int i = 1; i < file_count; ++i) {
         Vector<char> data;
-        read_file_data(pfrm, kvp.first.c_str(), data);
+        read_file_data(pfrm, path(i).c_str(), data);
+        if (data.size() not_eq 2 or data[0] not_eq i % 128 or
+            data[1] not_eq i / 128) {
+            return false;
+        }
+    }
 
-        if (data.size() not_eq kvp.second.size()) {
+    return true;
+}
+
+
+
+bool ring_buffer()
+{
+    RingBuffer<int, 4> rb;
+
+    for (int i = 0; i < 4; ++i) {
+        rb.push_back(i);
+    }
+
+    if (rb.push_back(4) or not rb.full()) {
+        return false;
+    }
+
+    // Wrap around the end of the storage.
+    for (int i = 4; i < 10; ++i) {
+        if (rb.front() not_eq i - 4) {
             return false;
         }
+        rb.pop_front();
+        rb.push_back(i);
+    }
 
-        for (u32 i = 0; i < data.size(); ++i) {
-            if (data[i] not_eq kvp.second[i]) {
-                return false;
-            }
+    for (u32 i = 0; i < rb.size(); ++i) {
+        if (rb[i] not_eq int(6 + i)) {
+            return false;
         }
     }
 
-    return true;
+    return rb.back() == 9;
 }
 
 
@@ -1252,6 +9786,33 @@ void regression()
     TEST_CASE(persistence);
     TEST_CASE(compaction);
     TEST_CASE(write_triggered_compaction);
+    TEST_CASE(partial_compaction);
+    TEST_CASE(hot_first_compaction);
+    TEST_CASE(skip_unchanged_writes);
+    TEST_CASE(delta_records);
+    TEST_CASE(append_extents);
+    TEST_CASE(circular_log);
+    TEST_CASE(update_slots);
+    TEST_CASE(slotted_file_stores);
+    TEST_CASE(compressed_files);
+    TEST_CASE(deduplicated_files);
+    TEST_CASE(packed_files);
+    TEST_CASE(directory_ids);
+    TEST_CASE(indexed_lookups);
+    TEST_CASE(directory_filter);
+    TEST_CASE(prefix_removal);
+    TEST_CASE(metadata_renames);
+    TEST_CASE(cloned_files);
+    TEST_CASE(dual_layout);
+    TEST_CASE(segmented_layout);
+    TEST_CASE(cost_benefit_cleaning);
+    TEST_CASE(hot_cold_separation);
+    TEST_CASE(deferred_erase);
+    TEST_CASE(idle_cleaning);
+    TEST_CASE(wear_counters);
+    TEST_CASE(scratch_arena_compaction);
+    TEST_CASE(many_files_compaction);
+    TEST_CASE(ring_buffer);
 
     puts("");
     std::cout << pass_count << " tests passed" << std::endl;
@@ -1264,10 +9825,136 @@ void regression()
 
 
 
+#ifdef __BENCHMARK__
+#include <chrono>
+
+
+namespace flash_filesystem
+{
+
+
+
+void benchmark_compaction()
+{
+    std::cout << "compaction, by live file count:" << std::endl;
+
+    for (int file_count : {125, 250, 500, 1000, 2000}) {
+        reset();
+        Platform pfrm(128 * 1024, ".bench_output");
+        pfrm.erase_unit_ = 2;
+        initialize(pfrm, 8);
+
+        for (int i = 0; i < file_count; ++i) {
+            Vector<char> data;
+            data.push_back(i % 128);
+            data.push_back(i / 128);
+            store_file_data(pfrm, format<32>("/save/%.dat", i).c_str(), data);
+        }
+
+        unlink_file(pfrm, "/save/0.dat");
+
+        const auto start = std::chrono::steady_clock::now();
+        compact(pfrm);
+        const auto stop = std::chrono::steady_clock::now();
+
+        const auto usec =
+            std::chrono::duration_cast<std::chrono::microseconds>(stop - start)
+                .count();
+
+        std::cout << "  files: " << file_count << ", usec: " << usec
+                  << ", usec/file: " << double(usec) / file_count << std::endl;
+    }
+}
+
+
+
+// Bytes written to the save media per byte of file data stored, for a game that
+// keeps some files that rarely change, and autosaves constantly.
+void benchmark_write_amplification()
+{
+    std::cout << "write amplification, autosave workload:" << std::endl;
+
+    static const struct
+    {
+        Layout layout_;
+        const char* name_;
+    } layouts[] = {{single_log, "single_log"},
+                   {dual_log, "dual_log"},
+                   {segmented_log, "segmented_log"}};
+
+    for (auto& l : layouts) {
+        reset();
+        Platform pfrm(64 * 1024, ".bench_output");
+        initialize(pfrm, 8, l.layout_);
+
+        Vector<char> data;
+
+        for (int i = 0; i < 12; ++i) {
+            // NOTE: random, so that compression doesn't skew the results.
+            data.resize(1500);
+            scramble(data, i);
+            store_file_data(pfrm, format<32>("/cold/%.dat", i).c_str(), data);
+        }
+
+        const auto written = pfrm.bytes_written_;
+        const auto erased = pfrm.bytes_erased_;
+
+        u32 stored = 0;
+
+        for (int i = 0; i < 4000; ++i) {
+            data.resize(900);
+            scramble(data, i);
+            store_file_data(pfrm, "/save/autosave.dat", data);
+            stored += data.size();
+
+            if (i % 8 == 0) {
+                data.resize(200);
+                scramble(data, i + 100);
+                store_file_data(pfrm, "/save/settings.dat", data);
+                stored += data.size();
+            }
+
+            if (i % 50 == 0) {
+                data.resize(1500);
+                scramble(data, i + 200);
+                store_file_data(
+                    pfrm, format<32>("/cold/%.dat", i / 50 % 12).c_str(), data);
+                stored += data.size();
+            }
+        }
+
+        std::cout << "  " << l.name_ << ", written/stored: "
+                  << double(pfrm.bytes_written_ - written) / stored
+                  << ", erased/stored: "
+                  << double(pfrm.bytes_erased_ - erased) / stored
+                  << std::endl;
+    }
+}
+
+
+
+void benchmarks()
+{
+    benchmark_compaction();
+    benchmark_write_amplification();
+}
+
+
+
+} // namespace flash_filesystem
+#endif // __BENCHMARK__
+
+
+
 int main()
 {
     using namespace flash_filesystem;
 
+#ifdef __BENCHMARK__
+    flash_filesystem::benchmarks();
+    return 0;
+#endif
+
     flash_filesystem::regression();
 
     return 0;
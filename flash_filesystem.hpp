@@ -97,10 +97,107 @@ static constexpr const int max_path = FS_MAX_PATH;
 
 
 
+// The number of paths for which the filesystem tracks read counts. Compaction
+// writes the most frequently read files to the beginning of the log, where
+// lookups find them sooner.
+#ifndef FS_ACCESS_COUNTERS
+#define FS_ACCESS_COUNTERS 16
+#endif
+
+
+
+// The segmented layout splits the save media into segments of this size,
+// rounded up to a multiple of the erase unit.
+#ifndef FS_SEGMENT_SIZE
+#define FS_SEGMENT_SIZE 4096
+#endif
+
+
+
+#ifndef FS_MAX_SEGMENTS
+#define FS_MAX_SEGMENTS 32
+#endif
+
+
+
+// When a store changes only part of a file, the filesystem appends a patch
+// record, holding just the changed bytes, rather than rewriting the whole file.
+// After this many patches, the next store rewrites the file in full.
+#ifndef FS_MAX_PATCHES
+#define FS_MAX_PATCHES 4
+#endif
+
+
+
+// The number of times that append_file() adds to a file before rewriting it
+// with the appended data merged in.
+#ifndef FS_MAX_EXTENTS
+#define FS_MAX_EXTENTS 8
+#endif
+
+
+
+// The number of updates that a counter or flag set has room for in its record,
+// before we have to write a new one. See add_counter() and set_flag().
+#ifndef FS_UPDATE_SLOTS
+#define FS_UPDATE_SLOTS 16
+#endif
+
+
+
+// The number of slotted files that the filesystem keeps track of, see
+// create_slotted_file().
+#ifndef FS_SLOTTED_FILES
+#define FS_SLOTTED_FILES 4
+#endif
+
+
+
+// The number of directories that record names can refer to by id, rather than
+// repeating the directory in every name. The first directories that we store
+// files in get the ids.
+#ifndef FS_DIRECTORIES
+#define FS_DIRECTORIES 16
+#endif
+
+
+
+// The number of files that the filesystem keeps in a sorted index in memory,
+// four bytes each, so that lookups and directory listings don't have to search
+// the log. With more files than this, they go back to searching the log.
+#ifndef FS_INDEX_SIZE
+#define FS_INDEX_SIZE 128
+#endif
+
+
+
+// The number of renamed files that the filesystem can keep track of until the
+// next compaction, see rename_file().
+#ifndef FS_RENAMED_FILES
+#define FS_RENAMED_FILES 8
+#endif
+
+
+
 struct Statistics
 {
     u16 bytes_used_;
     u16 bytes_available_;
+
+    // Persisted on the save media. Counts compactions with the dual layout, and
+    // opened segments with the segmented layout. Divide by the number of
+    // regions or segments to get the average number of erase cycles.
+    u32 generation_;
+
+    // The highest erase count among the wear zones, see wear_report().
+    u32 max_erase_count_;
+
+    // Calls to store_file_data() that didn't write anything, because the file
+    // already held the same data. Counted since initialize().
+    u32 skipped_writes_;
+
+    // The space that compression saves among the files currently stored.
+    u32 bytes_saved_;
 };
 
 
@@ -109,6 +206,19 @@ Statistics statistics(Platform& pfrm);
 
 
 
+// Invoke callback(offset, size, erase_count) for each wear zone of the save
+// media. The erase counts persist across restarts. A zone is the whole media
+// for the single log layout, each of the two regions for the dual layout, and
+// each segment for the segmented layout. With the single log layout, we only
+// count erases that include the beginning of the log, i.e. whole-media erases
+// and compactions that rewrite the root, so later parts of the media may have
+// seen more erases. Zero means that we don't know, e.g. for media formatted by
+// older versions of the library.
+void wear_report(Platform& pfrm,
+                 Function<8 * sizeof(void*), void(u32, u32, u32)> callback);
+
+
+
 enum InitStatus {
     // Newly initialized
     initialized,
@@ -121,7 +231,56 @@ enum InitStatus {
 
 
 
-InitStatus initialize(Platform& pfrm, u32 offset);
+enum Layout {
+    // One log, spanning the whole save media. Compaction stages live files in
+    // ram, and erases and rewrites the media in place.
+    single_log,
+
+    // Two logs, each spanning half of the save media. Compaction copies live
+    // files from the current log to the other one, without using any ram, and
+    // losing power partway through compaction will not lose any data. But you
+    // only get to use half of the save media. Suited to larger media, like
+    // 64kb/128kb flash chips.
+    dual_log,
+
+    // Splits the save media into segments (see FS_SEGMENT_SIZE), and writes
+    // to them in rotation, so that erase cycles spread evenly across the whole
+    // save media, rather than wearing out the beginning of it. When we run out
+    // of space, we clean a segment by copying its live files to the current
+    // segment, and erase only that segment. We pick the segment that frees up
+    // the most space for the least copying, favoring older segments, like the
+    // LFS cost-benefit cleaner. Files that we've seen rewritten often go to a
+    // separate segment from everything else, so that cleaning mostly touches
+    // segments full of old autosaves, and leaves rarely changing files in
+    // place. One segment stays in reserve for cleaning. Suited to flash chips.
+    segmented_log,
+};
+
+
+
+// NOTE: the layout only applies when formatting the save media. If the media
+// already holds a filesystem, initialize() uses the existing layout.
+InitStatus
+initialize(Platform& pfrm, u32 offset, Layout layout = single_log);
+
+
+
+// Lend the filesystem a block of memory for staging data during compaction and
+// large reads, e.g. an ewram region that your game doesn't need while saving.
+// When the arena can hold everything that compaction needs to relocate, the
+// filesystem stages it there instead of allocating from the heap. When the
+// arena is too small, compaction streams through it, one chunk of erase units
+// at a time. Pass nullptr to go back to allocating from the heap.
+void set_scratch_arena(void* base, u32 size);
+
+
+
+// Do a bit of housekeeping, so that later writes don't have to wait on it:
+// erase save memory freed up by compaction, and with the segmented layout,
+// clean a segment ahead of time when we're running low on free ones. Call it
+// when your game has time to spare, e.g. while the player sits in a menu.
+// Each call does at most one erase. Returns true if there's more to do.
+bool idle(Platform& pfrm);
 
 
 
@@ -133,6 +292,86 @@ u32 read_file_data(Platform&, const char* path, Vector<char>& output);
 
 
 
+// Add data to the end of a file, creating the file if it doesn't exist. Rather
+// than rewriting the file, writes a record holding only the new data, which
+// compaction merges into the rest of the file. Returns false if we ran out of
+// space.
+bool append_file(Platform& pfrm,
+                 const char* path,
+                 const char* data,
+                 u32 length);
+
+
+
+// Create an empty circular log at path, replacing any existing file. Each
+// append_file() to the log writes only the appended data, and reads return the
+// last capacity bytes appended, as the log drops its oldest entries to make
+// room. Storing to the path with store_file_data() turns it back into a normal
+// file.
+bool create_circular_log(Platform& pfrm, const char* path, u32 capacity);
+
+
+
+// Add amount to the counter at path, creating it if it doesn't exist. Rather
+// than writing a new record, programs a single halfword of the counter's
+// existing one, until its FS_UPDATE_SLOTS run out. Returns false if we ran out
+// of space.
+bool add_counter(Platform& pfrm, const char* path, u16 amount = 1);
+
+
+
+// Zero if there's no counter at path.
+u32 read_counter(Platform& pfrm, const char* path);
+
+
+
+// Set a flag, numbered 0 to 0xfffe, in the flag set at path, creating it if it
+// doesn't exist. Like add_counter(), setting a flag programs a halfword in
+// place, until we run out of update slots. Clearing a flag always writes a new
+// record.
+bool set_flag(Platform& pfrm, const char* path, u16 flag);
+bool clear_flag(Platform& pfrm, const char* path, u16 flag);
+bool test_flag(Platform& pfrm, const char* path, u16 flag);
+
+
+
+// For small files that you rewrite all the time, like settings or checkpoints.
+// Gives the file at path a record with count (up to 31) slots of size bytes
+// each, keeping its contents. Each store_file_data() to the file writes the
+// next blank slot, without searching the log or invalidating the previous
+// version, and reads pick the newest slot. Once the slots run out, the next
+// store writes a new record. A store that doesn't fit in a slot writes a new
+// record with bigger slots. Returns false if we already have FS_SLOTTED_FILES
+// slotted files, or ran out of space.
+bool create_slotted_file(Platform& pfrm,
+                         const char* path,
+                         u16 size,
+                         u8 count);
+
+
+
+// A file to store with store_packed_files().
+struct PackedFile
+{
+    const char* path_;
+    Vector<char>* data_;
+};
+
+
+
+// Small files, like settings, spend more space on their record headers and
+// names than on their contents. Stores count files at once, replacing any
+// existing files at the same paths, in records that hold up to 31 files of up
+// to 255 bytes each, sharing a header. Of two files with the same path, the
+// later one wins, as if stored one after the other. Files that are too
+// big get records of their own. Reads, walk() and unlink_file() treat packed
+// files like any other, and storing to a packed file moves it into a record of
+// its own. We can only reclaim a pack's space once we've removed all of its
+// files. Returns false if we ran out of space.
+bool store_packed_files(Platform& pfrm, const PackedFile* files, u32 count);
+
+
+
 u32 file_size(Platform&, const char* path);
 
 
@@ -195,21 +434,80 @@ void walk(Platform& pfrm,
 
 
 
+// Like walk(), for the files whose paths begin with prefix, in order of path,
+// straight from the index (see FS_INDEX_SIZE). Without the index, skips records
+// that refer to a directory by id (see FS_DIRECTORIES) without reading their
+// names, when the directory can't hold any matching files. The callback may
+// write files, even if that compacts the log.
+void walk(Platform& pfrm,
+          const char* prefix,
+          Function<8 * sizeof(void*), void(const char*)> callback);
+
+
+
+// The number of files whose paths begin with prefix.
+u32 count_files(Platform& pfrm, const char* prefix);
+
+
+
+// Whether any files live under directory, e.g. "/mods/". The filesystem keeps
+// a bloom filter of the directories that hold files, so for an empty directory
+// we usually don't have to touch the save media at all.
+bool directory_exists(Platform& pfrm, const char* directory);
+
+
+
 template <typename F>
 void walk_directory(Platform& pfrm, const char* directory, F callback)
 {
-    walk(pfrm, [callback, directory](const char* path) {
-        auto remainder =
-            starts_with(directory, StringBuffer<FS_MAX_PATH>(path));
-        if (remainder) {
-            callback(remainder);
-        }
+    const auto length = str_len(directory);
+    walk(pfrm, directory, [callback, length](const char* path) {
+        callback(path + length);
     });
 }
 
 
 
-void unlink_file(Platform& pfrm, const char* path);
+// Returns false if there was no file at path, or if we ran out of space to give
+// the files that reference it contents of their own, in which case the file
+// stays where it is.
+bool unlink_file(Platform& pfrm, const char* path);
+
+
+
+struct RemovedFiles
+{
+    u32 count_;
+    u32 bytes_freed_;
+};
+
+
+
+// Give the file at from the path to, replacing any file already there. Rather
+// than rewriting the file, appends a small rename record, which gives the
+// file's record its new name, and compaction later merges the two. Packed
+// files, files with patches or extents, and renames past FS_RENAMED_FILES get
+// copied instead. Circular logs, counters, flag sets and slotted files can't be
+// renamed.
+bool rename_file(Platform& pfrm, const char* from, const char* to);
+
+
+
+// Copy the file at src to dst, e.g. to duplicate a save slot, without copying
+// its contents. Writes a reference to src, which shares its contents until one
+// of the two files changes (see store_file_data()). Packed files and files with
+// patches or extents get copied. Circular logs, counters, flag sets and slotted
+// files can't be cloned.
+bool clone_file(Platform& pfrm, const char* src, const char* dst);
+
+
+
+// Unlink every file whose path begins with prefix, e.g. a save slot's
+// directory, in one pass over the log, rather than searching the log again for
+// each file. Reports the number of files removed, and the space freed, which
+// compaction will reclaim. If we run out of space to give files outside of
+// prefix that reference files under it contents of their own, removes nothing.
+RemovedFiles remove_prefix(Platform& pfrm, const char* prefix);
 
 
 
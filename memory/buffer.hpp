@@ -305,4 +305,162 @@ private:
 
 
 
+// A fixed-capacity queue. Unlike Buffer, removing an element from the front
+// takes constant time, so use this for anything first-in-first-out.
+template <typename T, u32 Capacity> class RingBuffer
+{
+public:
+    using ValueType = T;
+
+    // (only for stl compatibility)
+    using value_type = ValueType;
+
+
+    RingBuffer() : mem_{}, begin_(0), size_(0)
+    {
+    }
+
+    RingBuffer(const RingBuffer& other) : mem_{}, begin_(0), size_(0)
+    {
+        for (u32 i = 0; i < other.size(); ++i) {
+            push_back(other[i]);
+        }
+    }
+
+    const RingBuffer& operator=(const RingBuffer& other)
+    {
+        clear();
+        for (u32 i = 0; i < other.size(); ++i) {
+            push_back(other[i]);
+        }
+        return *this;
+    }
+
+    ~RingBuffer()
+    {
+        if constexpr (not std::is_trivially_destructible<T>()) {
+            RingBuffer::clear();
+        }
+    }
+
+
+    static constexpr u32 capacity()
+    {
+        return Capacity;
+    }
+
+
+    bool push_back(const T& elem)
+    {
+        if (full()) {
+            return false;
+        }
+        new (slot(size_)) T(elem);
+        ++size_;
+        return true;
+    }
+
+
+    template <typename... Args> bool emplace_back(Args&&... args)
+    {
+        if (full()) {
+            return false;
+        }
+        new (slot(size_)) T(std::forward<Args>(args)...);
+        ++size_;
+        return true;
+    }
+
+
+    void pop_front()
+    {
+        slot(0)->~T();
+        begin_ = (begin_ + 1) % Capacity;
+        --size_;
+    }
+
+
+    T& front()
+    {
+        return *slot(0);
+    }
+
+
+    const T& front() const
+    {
+        return *slot(0);
+    }
+
+
+    T& back()
+    {
+        return *slot(size_ - 1);
+    }
+
+
+    const T& back() const
+    {
+        return *slot(size_ - 1);
+    }
+
+
+    // Index zero refers to the front of the queue.
+    T& operator[](u32 index)
+    {
+        return *slot(index);
+    }
+
+
+    const T& operator[](u32 index) const
+    {
+        return *slot(index);
+    }
+
+
+    void clear()
+    {
+        while (not empty()) {
+            pop_front();
+        }
+        begin_ = 0;
+    }
+
+
+    u32 size() const
+    {
+        return size_;
+    }
+
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+
+    bool full() const
+    {
+        return size_ == Capacity;
+    }
+
+
+private:
+    T* slot(u32 index)
+    {
+        return reinterpret_cast<T*>(mem_.data()) + (begin_ + index) % Capacity;
+    }
+
+    const T* slot(u32 index) const
+    {
+        return reinterpret_cast<const T*>(mem_.data()) +
+               (begin_ + index) % Capacity;
+    }
+
+    alignas(T) std::array<u8, Capacity * sizeof(T)> mem_;
+    u32 begin_;
+    u32 size_;
+};
+
+
+
 }
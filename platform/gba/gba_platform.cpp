@@ -318,6 +318,65 @@ void Platform::erase_save_sector()
 
 
 
+static const u32 flash_sector_size = 4096;
+
+
+
+int Platform::save_erase_unit()
+{
+    if (bootleg_flash_type) {
+        // Each erase_save_range() erases the whole chip and writes back the
+        // save, see below, so better to erase everything once. The filesystem
+        // then falls back to compacting the whole single log.
+        return ::save_capacity;
+    } else if (save_using_flash) {
+        return flash_sector_size;
+    } else {
+        // Sram can be overwritten freely, but the filesystem never writes less
+        // than a halfword.
+        return 2;
+    }
+}
+
+
+
+void Platform::erase_save_range(u32 offset, u32 length)
+{
+    if (not save_using_flash) {
+        u8* save_mem = (u8*)0x0E000000;
+        const u32 end = offset + length;
+        for (u32 i = offset; i < end and i < (u32)::save_capacity; ++i) {
+            save_mem[i] = 0xff;
+        }
+    } else {
+        const u32 end = offset + length;
+        offset -= offset % flash_sector_size;
+
+        for (; offset < end; offset += flash_sector_size) {
+            set_flash_bank(offset >= 0x10000);
+
+            volatile u8* sector = flash_mem + (offset & 0xffff);
+
+            FLASH_CMD(FLASH_CMD_ERASE);
+            FLASH_CMD_BEGIN;
+            *sector = FLASH_CMD_ERASE_SECTOR << 4;
+
+            // Wait for erase to complete.
+            while (*sector not_eq 0xff)
+                ;
+        }
+    }
+
+    if (bootleg_flash_type) {
+        // The bootleg flash chip can only erase the whole sram backing area, so
+        // we need to write back everything that we didn't mean to erase.
+        bootleg_flash_erase(bootleg_flash_type);
+        bootleg_flash_writeback(bootleg_flash_type, 0, ::save_capacity);
+    }
+}
+
+
+
 
 Platform::Platform()
 {
@@ -58,6 +58,13 @@ public:
 
     void erase_save_sector();
 
+    // The smallest block of save memory that can be erased independently. The
+    // filesystem rounds partial erase requests to multiples of this size.
+    int save_erase_unit();
+
+    // Erase every erase unit overlapping the range [offset, offset + length).
+    void erase_save_range(u32 offset, u32 length);
+
 
     Platform();
     Platform(const Platform&) = delete;